@@ -43,6 +43,7 @@
 #include <grpc/support/log.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>  // NOLINT (gRPC requires this)
 #include <mutex>   // NOLINT
 #include <set>
@@ -60,11 +61,13 @@
 #include "src/main/cpp/util/exit_code.h"
 #include "src/main/cpp/util/file.h"
 #include "src/main/cpp/util/logging.h"
+#include "src/main/cpp/util/md5.h"
 #include "src/main/cpp/util/numbers.h"
 #include "src/main/cpp/util/port.h"
 #include "src/main/cpp/util/strings.h"
 #include "src/main/cpp/workspace_layout.h"
 #include "third_party/ijar/zip.h"
+#include "third_party/ijar/zlib_client.h"
 
 #include "src/main/protobuf/command_server.grpc.pb.h"
 
@@ -782,44 +785,295 @@ static void StartServerAndConnect(const WorkspaceLayout *workspace_layout,
 }
 
 // A devtools_ijar::ZipExtractorProcessor to extract the files from the blaze
-// zip.
+// zip. The files are only collected while the zip is processed, and written
+// by Extract() on several threads.
+//
+// If `file_store` is not empty, the files are shared with the other install
+// bases through it: it holds a hard link to every extracted file, named after
+// the file's name, size and CRC-32 in the zip's central directory. Files
+// found there are linked into the install base instead of being extracted, so
+// that a new release only extracts the files that changed. The extracted files
+// are only added to the store by StoreExtractedFiles(), once they are synced,
+// and a stored file is only linked if it still has the expected contents.
 class ExtractBlazeZipProcessor : public devtools_ijar::ZipExtractorProcessor {
  public:
-  explicit ExtractBlazeZipProcessor(const string &embedded_binaries)
-      : embedded_binaries_(embedded_binaries) {}
+  ExtractBlazeZipProcessor(const string &embedded_binaries,
+                           const string &file_store)
+      : embedded_binaries_(embedded_binaries),
+        file_store_(file_store),
+        mtime_(blaze_util::CreateFileMtime()) {}
 
   virtual bool Accept(const char *filename, const devtools_ijar::u4 attr) {
     return !devtools_ijar::zipattr_is_dir(attr);
   }
 
+  // Never called, since ProcessRaw() takes every file.
   virtual void Process(const char *filename, const devtools_ijar::u4 attr,
-                       const devtools_ijar::u1 *data, const size_t size) {
-    string path = blaze_util::JoinPath(embedded_binaries_, filename);
-    if (!blaze_util::MakeDirectories(blaze_util::Dirname(path), 0777)) {
+                       const devtools_ijar::u1 *data, const size_t size) {}
+
+  // Creates the directory of the file and records the file, whose data stays
+  // mapped as long as the ZipExtractor.
+  virtual bool ProcessRaw(const char *filename, const devtools_ijar::u4 attr,
+                          const devtools_ijar::u1 *data,
+                          const size_t compressed_size, const size_t size,
+                          const bool compressed,
+                          const devtools_ijar::u4 crc32) {
+    EmbeddedFile file = {blaze_util::JoinPath(embedded_binaries_, filename),
+                         GetStoredPath(filename, size, crc32),
+                         data,
+                         compressed_size,
+                         size,
+                         compressed,
+                         crc32,
+                         false};
+    string directory = blaze_util::Dirname(file.path);
+    if (directories_.insert(directory).second &&
+        !blaze_util::MakeDirectories(directory, 0777)) {
       pdie(blaze_exit_code::INTERNAL_ERROR, "couldn't create '%s'",
-           path.c_str());
+           file.path.c_str());
     }
+    files_.push_back(file);
+    return true;
+  }
 
-    if (!blaze_util::WriteFile(data, size, path)) {
-      die(blaze_exit_code::LOCAL_ENVIRONMENTAL_ERROR,
-          "\nFailed to write zipped file \"%s\": %s", path.c_str(),
-          blaze_util::GetLastErrorString().c_str());
+  // Writes the files on worker threads. Their timestamps are set to the
+  // distant future before they are closed, see ActuallyExtractData().
+  void Extract() {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, files_.size());
+    std::atomic<size_t> next_file(0);
+    vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+      workers.emplace_back([this, &next_file]() {
+        devtools_ijar::Decompressor decompressor;
+        size_t index;
+        while ((index = next_file++) < files_.size()) {
+          ExtractFile(&files_[index], &decompressor);
+        }
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Adds the files written by Extract() to the file store. Only called once
+  // they are synced, so that the store never holds a partially written file.
+  void StoreExtractedFiles() const {
+    for (const auto &file : files_) {
+      // It is not an error if another client stored the file first, or if
+      // hard links are not supported.
+      if (file.storable) {
+        blaze_util::LinkFile(file.path, file.stored_path);
+      }
+    }
+  }
+
+  // Returns the full paths of the extracted files.
+  vector<string> GetExtractedFiles() const {
+    vector<string> result;
+    for (const auto &file : files_) {
+      result.push_back(file.path);
     }
+    return result;
   }
 
  private:
+  struct EmbeddedFile {
+    string path;
+    // The path of the file in the file store, or empty.
+    string stored_path;
+    const devtools_ijar::u1 *data;
+    size_t compressed_size;
+    size_t size;
+    bool compressed;
+    devtools_ijar::u4 crc32;
+    // Whether the file was written by Extract() with the expected CRC-32, and
+    // can be added to the file store.
+    bool storable;
+  };
+
+  string GetStoredPath(const char *filename, size_t size,
+                       devtools_ijar::u4 crc32) const {
+    if (file_store_.empty()) {
+      return "";
+    }
+    string key = string(filename) + "\n" + ToString(size) + "\n" +
+                 ToString(static_cast<uint64_t>(crc32));
+    blaze_util::Md5Digest digest;
+    digest.Update(key.data(), key.size());
+    unsigned char buf[blaze_util::Md5Digest::kDigestLength];
+    digest.Finish(buf);
+    return blaze_util::JoinPath(file_store_, digest.String());
+  }
+
+  // Links the file from the file store, if it is there and intact: it has the
+  // size and the CRC-32 of the file in the zip, and its mtime is still in the
+  // distant future. The mtime is shared with the install bases already using
+  // the file, so it is never changed. A stored file that is not intact is
+  // removed, to be replaced by the file about to be extracted. Returns false if
+  // the file has to be extracted.
+  bool LinkStoredFile(const EmbeddedFile &file) {
+    if (!blaze_util::LinkFile(file.stored_path, file.path)) {
+      return false;
+    }
+    // Check the link rather than the stored path, which another client may
+    // replace meanwhile.
+    uint64_t size;
+    int link_count;
+    bool is_in_future = false;
+    devtools_ijar::u4 crc32;
+    if (blaze_util::GetFileStat(file.path, &size, &link_count) &&
+        size == file.size &&
+        mtime_->GetIfInDistantFuture(file.path, &is_in_future) &&
+        is_in_future && GetFileCrc32(file.path, &crc32) &&
+        crc32 == file.crc32) {
+      return true;
+    }
+    blaze_util::UnlinkPath(file.path);
+    blaze_util::UnlinkPath(file.stored_path);
+    return false;
+  }
+
+  // Computes the CRC-32 of the file chunk by chunk. Returns false if the file
+  // cannot be read.
+  static bool GetFileCrc32(const string &path, devtools_ijar::u4 *result) {
+    blaze_util::file_handle_type handle;
+    if (!blaze_util::OpenFileForReading(path, &handle)) {
+      return false;
+    }
+    std::unique_ptr<devtools_ijar::u1[]> buf(
+        new devtools_ijar::u1[STREAM_CHUNK_SIZE]);
+    devtools_ijar::u4 crc32 = 0;
+    int read;
+    int error;
+    while ((read = blaze_util::ReadFromHandle(
+                handle, buf.get(), STREAM_CHUNK_SIZE, &error)) != 0) {
+      if (read < 0) {
+        if (error == blaze_util::ReadFileResult::INTERRUPTED) {
+          continue;
+        }
+        blaze_util::CloseFileHandle(handle);
+        return false;
+      }
+      crc32 = devtools_ijar::UpdateCrcChecksum(crc32, buf.get(), read);
+    }
+    blaze_util::CloseFileHandle(handle);
+    *result = crc32;
+    return true;
+  }
+
+  // Writes the file unless it can be linked from the file store. Sets
+  // file->storable if it can be added to the store.
+  void ExtractFile(EmbeddedFile *file,
+                   devtools_ijar::Decompressor *decompressor) {
+    if (!file->stored_path.empty() && LinkStoredFile(*file)) {
+      return;
+    }
+
+    blaze_util::file_handle_type handle;
+    if (!blaze_util::OpenFileForWriting(file->path, 0755, &handle)) {
+      WriteFailed(file->path);
+    }
+
+    devtools_ijar::u4 crc32 = 0;
+    if (!file->compressed) {
+      if (!blaze_util::WriteToHandle(handle, file->data,
+                                     file->compressed_size)) {
+        WriteFailed(file->path);
+      }
+      crc32 = devtools_ijar::UpdateCrcChecksum(crc32, file->data,
+                                               file->compressed_size);
+    } else {
+      // Inflate chunk by chunk, so that large files like the server jar are
+      // never held in memory as a whole.
+      if (!decompressor->StartStream(file->data, file->compressed_size,
+                                     STREAM_CHUNK_SIZE)) {
+        InflateFailed(file->path, decompressor);
+      }
+      const devtools_ijar::u1 *chunk;
+      size_t length;
+      int ret;
+      while ((ret = decompressor->NextChunk(&chunk, &length)) > 0) {
+        if (!blaze_util::WriteToHandle(handle, chunk, length)) {
+          WriteFailed(file->path);
+        }
+        crc32 = devtools_ijar::UpdateCrcChecksum(crc32, chunk, length);
+      }
+      if (ret < 0) {
+        InflateFailed(file->path, decompressor);
+      }
+    }
+
+    if (!mtime_->SetHandleToDistantFuture(handle)) {
+      pdie(blaze_exit_code::LOCAL_ENVIRONMENTAL_ERROR,
+           "failed to set timestamp on '%s'", file->path.c_str());
+    }
+    if (!blaze_util::CloseFileHandle(handle)) {
+      WriteFailed(file->path);
+    }
+
+    // Only share the file with the next install bases if it is intact.
+    file->storable = !file->stored_path.empty() && crc32 == file->crc32;
+  }
+
+  static void WriteFailed(const string &path) {
+    die(blaze_exit_code::LOCAL_ENVIRONMENTAL_ERROR,
+        "\nFailed to write zipped file \"%s\": %s", path.c_str(),
+        blaze_util::GetLastErrorString().c_str());
+  }
+
+  static void InflateFailed(const string &path,
+                            devtools_ijar::Decompressor *decompressor) {
+    die(blaze_exit_code::LOCAL_ENVIRONMENTAL_ERROR,
+        "\nFailed to extract zipped file \"%s\": %s", path.c_str(),
+        decompressor->GetError());
+  }
+
   const string embedded_binaries_;
+  const string file_store_;
+  std::unique_ptr<blaze_util::IFileMtime> mtime_;
+  vector<EmbeddedFile> files_;
+  // The directories created for the files.
+  set<string> directories_;
+};
+
+// A blaze_util::DirectoryEntryConsumer that removes the files of the file store
+// that no install base links to anymore.
+class FileStorePruner : public blaze_util::DirectoryEntryConsumer {
+ public:
+  void Consume(const string &name, bool is_directory) override {
+    uint64_t size;
+    int link_count;
+    if (!is_directory && blaze_util::GetFileStat(name, &size, &link_count) &&
+        link_count == 1) {
+      blaze_util::UnlinkPath(name);
+    }
+  }
 };
 
 // Actually extracts the embedded data files into the tree whose root
-// is 'embedded_binaries'.
+// is 'embedded_binaries', sharing them through 'file_store' (see
+// ExtractBlazeZipProcessor) unless it is empty.
 static void ActuallyExtractData(const string &argv0,
-                                const string &embedded_binaries) {
-  ExtractBlazeZipProcessor processor(embedded_binaries);
+                                const string &embedded_binaries,
+                                string file_store) {
   if (!blaze_util::MakeDirectories(embedded_binaries, 0777)) {
     pdie(blaze_exit_code::INTERNAL_ERROR, "couldn't create '%s'",
          embedded_binaries.c_str());
   }
+  if (!file_store.empty()) {
+    if (blaze_util::MakeDirectories(file_store, 0755)) {
+      // The files of the install bases that were deleted are only linked
+      // from the file store.
+      FileStorePruner pruner;
+      blaze_util::ForEachDirectoryEntry(file_store, &pruner);
+    } else {
+      // Extract every file, as if there was no file store.
+      file_store.clear();
+    }
+  }
+  ExtractBlazeZipProcessor processor(embedded_binaries, file_store);
 
   fprintf(stderr, "Extracting %s installation...\n",
           globals->options->product_name.c_str());
@@ -837,52 +1091,49 @@ static void ActuallyExtractData(const string &argv0,
         globals->options->product_name.c_str(), extractor->GetError());
   }
 
-  // Set the timestamps of the extracted files to the future and make sure (or
-  // at least as sure as we can...) that the files we have written are actually
-  // on the disk.
-
-  vector<string> extracted_files;
-
-  // Walks the temporary directory recursively and collects full file paths.
-  blaze_util::GetAllFilesUnder(embedded_binaries, &extracted_files);
-
-  std::unique_ptr<blaze_util::IFileMtime> mtime(blaze_util::CreateFileMtime());
-  set<string> synced_directories;
-  for (const auto &it : extracted_files) {
-    const char *extracted_path = it.c_str();
-
-    // Set the time to a distantly futuristic value so we can observe tampering.
-    // Note that keeping a static, deterministic timestamp, such as the default
-    // timestamp set by unzip (1970-01-01) and using that to detect tampering is
-    // not enough, because we also need the timestamp to change between Bazel
-    // releases so that the metadata cache knows that the files may have
-    // changed. This is essential for the correctness of actions that use
-    // embedded binaries as artifacts.
-    if (!mtime.get()->SetToDistantFuture(it)) {
-      pdie(blaze_exit_code::LOCAL_ENVIRONMENTAL_ERROR,
-           "failed to set timestamp on '%s'", extracted_path);
+  // The extracted files get their timestamps set to a distantly futuristic
+  // value so we can observe tampering.
+  // Note that keeping a static, deterministic timestamp, such as the default
+  // timestamp set by unzip (1970-01-01) and using that to detect tampering is
+  // not enough, because we also need the timestamp to change between Bazel
+  // releases so that the metadata cache knows that the files may have
+  // changed. This is essential for the correctness of actions that use
+  // embedded binaries as artifacts.
+  processor.Extract();
+
+  // Make sure (or at least as sure as we can...) that the files we have written
+  // are actually on the disk. Syncing the whole file system at once is much
+  // faster than syncing the files one by one where it is supported.
+  if (!blaze_util::SyncFileSystem(embedded_binaries)) {
+    set<string> synced_directories;
+    for (const auto &it : processor.GetExtractedFiles()) {
+      const char *extracted_path = it.c_str();
+
+      blaze_util::SyncFile(it);
+
+      string directory = blaze_util::Dirname(extracted_path);
+
+      // Now walk up until embedded_binaries and sync every directory in
+      // between. synced_directories is used to avoid syncing the same
+      // directory twice. The !directory.empty() and
+      // !blaze_util::IsRootDirectory(directory) conditions are not strictly
+      // needed, but it makes this loop more robust, because otherwise, if due
+      // to some glitch, directory was not under embedded_binaries, it would
+      // get into an infinite loop.
+      while (directory != embedded_binaries &&
+             synced_directories.count(directory) == 0 && !directory.empty() &&
+             !blaze_util::IsRootDirectory(directory)) {
+        blaze_util::SyncFile(directory);
+        synced_directories.insert(directory);
+        directory = blaze_util::Dirname(directory);
+      }
     }
 
-    blaze_util::SyncFile(it);
-
-    string directory = blaze_util::Dirname(extracted_path);
-
-    // Now walk up until embedded_binaries and sync every directory in between.
-    // synced_directories is used to avoid syncing the same directory twice.
-    // The !directory.empty() and !blaze_util::IsRootDirectory(directory)
-    // conditions are not strictly needed, but it makes this loop more robust,
-    // because otherwise, if due to some glitch, directory was not under
-    // embedded_binaries, it would get into an infinite loop.
-    while (directory != embedded_binaries &&
-           synced_directories.count(directory) == 0 && !directory.empty() &&
-           !blaze_util::IsRootDirectory(directory)) {
-      blaze_util::SyncFile(directory);
-      synced_directories.insert(directory);
-      directory = blaze_util::Dirname(directory);
-    }
+    blaze_util::SyncFile(embedded_binaries);
   }
 
-  blaze_util::SyncFile(embedded_binaries);
+  // The files are on the disk, share them with the next install bases.
+  processor.StoreExtractedFiles();
 }
 
 // Installs Blaze by extracting the embedded data files, iff necessary.
@@ -901,7 +1152,14 @@ static void ExtractData(const string &self_path) {
                          blaze::GetProcessIdAsString();
     string tmp_binaries =
         blaze_util::JoinPath(tmp_install, "_embedded_binaries");
-    ActuallyExtractData(self_path, tmp_binaries);
+    // The file store is shared by the install bases of the user. It is under
+    // the output user root, which belongs to the user, even if the install
+    // base is in a shared directory. Files cannot be linked from it if the
+    // install base is on another file system, they are extracted instead.
+    string file_store = blaze_util::JoinPath(
+        blaze_util::JoinPath(globals->options->output_user_root, "install"),
+        "_file_store");
+    ActuallyExtractData(self_path, tmp_binaries, file_store);
 
     uint64_t et = GetMillisecondsMonotonic();
     globals->extract_data_time = et - st;
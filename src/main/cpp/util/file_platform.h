@@ -26,6 +26,18 @@ class IPipe;
 
 IPipe* CreatePipe();
 
+#if defined(COMPILER_MSVC) || defined(__CYGWIN__)
+// We cannot include <windows.h> because it #defines many symbols that conflict
+// with our function names, e.g. GetUserName, SendMessage.
+// Instead of typedef'ing HANDLE, let's use the actual type, void*. If that ever
+// changes in the future and HANDLE would no longer be compatible with void*
+// (very unlikely, given how fundamental this type is in Windows), then we'd get
+// a compilation error.
+typedef /* HANDLE */ void *file_handle_type;
+#else   // !(defined(COMPILER_MSVC) || defined(__CYGWIN__))
+typedef int file_handle_type;
+#endif  // defined(COMPILER_MSVC) || defined(__CYGWIN__)
+
 // Class to query/manipulate the last modification time (mtime) of files.
 class IFileMtime {
  public:
@@ -45,6 +57,11 @@ class IFileMtime {
   // a decade.
   // Returns true if the mtime was changed successfully.
   virtual bool SetToDistantFuture(const std::string &path) = 0;
+
+  // Sets the mtime of the file opened for writing as `handle` to the distant
+  // future, like `SetToDistantFuture`. Further writes change the mtime again.
+  // Returns true if the mtime was changed successfully.
+  virtual bool SetHandleToDistantFuture(file_handle_type handle) = 0;
 };
 
 // Creates a platform-specific implementation of `IFileMtime`.
@@ -53,18 +70,6 @@ IFileMtime *CreateFileMtime();
 // Split a path to dirname and basename parts.
 std::pair<std::string, std::string> SplitPath(const std::string &path);
 
-#if defined(COMPILER_MSVC) || defined(__CYGWIN__)
-// We cannot include <windows.h> because it #defines many symbols that conflict
-// with our function names, e.g. GetUserName, SendMessage.
-// Instead of typedef'ing HANDLE, let's use the actual type, void*. If that ever
-// changes in the future and HANDLE would no longer be compatible with void*
-// (very unlikely, given how fundamental this type is in Windows), then we'd get
-// a compilation error.
-typedef /* HANDLE */ void *file_handle_type;
-#else   // !(defined(COMPILER_MSVC) || defined(__CYGWIN__))
-typedef int file_handle_type;
-#endif  // defined(COMPILER_MSVC) || defined(__CYGWIN__)
-
 // Result of a `ReadFromHandle` operation.
 //
 // This is a platform-independent abstraction of `errno`. If you need to handle
@@ -82,6 +87,12 @@ struct ReadFileResult {
 int ReadFromHandle(file_handle_type handle, void *data, size_t size,
                    int *error);
 
+// Opens the file `filename` for reading with `ReadFromHandle`, for the files
+// that are too large to be read by `ReadFile` into a single buffer. The handle
+// is closed with `CloseFileHandle`.
+// Returns false on failure, sets errno.
+bool OpenFileForReading(const std::string &filename, file_handle_type *result);
+
 // Replaces 'content' with contents of file 'filename'.
 // If `max_size` is positive, the method reads at most that many bytes;
 // otherwise the method reads the whole file.
@@ -99,6 +110,21 @@ bool ReadFile(const std::string &filename, void *data, size_t size);
 bool WriteFile(const void *data, size_t size, const std::string &filename,
                unsigned int perm = 0755);
 
+// Creates the file `filename`, replacing it if it exists, with permissions
+// `perm` and opens it for writing with `WriteToHandle`, for the files that are
+// too large to be passed to `WriteFile` in a single buffer.
+// Returns false on failure, sets errno.
+bool OpenFileForWriting(const std::string &filename, unsigned int perm,
+                        file_handle_type *result);
+
+// Writes all `size` bytes from `data` to the file opened as `handle`.
+// Returns false on failure, sets errno.
+bool WriteToHandle(file_handle_type handle, const void *data, size_t size);
+
+// Closes the file opened as `handle`.
+// Returns false on failure (which can happen on NFS), sets errno.
+bool CloseFileHandle(file_handle_type handle);
+
 // Result of a `WriteToStdOutErr` operation.
 //
 // This is a platform-independent abstraction of `errno`. If you need to handle
@@ -139,6 +165,17 @@ bool ReadDirectorySymlink(const std::string &symlink, std::string *result);
 // Returns true on success. In case of failure sets errno.
 bool UnlinkPath(const std::string &file_path);
 
+// Creates `link_name` as a hard link to the file `target`. Hard links share the
+// contents and the mtime of the file.
+// Returns false on failure (e.g. the paths are on different file systems, or
+// hard links are not supported), sets errno.
+bool LinkFile(const std::string &target, const std::string &link_name);
+
+// Stores the size of the file `path` in `size` and its number of hard links in
+// `link_count`.
+// Returns false if `path` cannot be stat'ed.
+bool GetFileStat(const std::string &path, uint64_t *size, int *link_count);
+
 // Returns true if this path exists, following symlinks.
 bool PathExists(const std::string& path);
 
@@ -175,6 +212,13 @@ bool IsAbsolute(const std::string &path);
 // pdie() if syncing fails.
 void SyncFile(const std::string& path);
 
+// Flushes to disk all the data of the file system holding `path`, like
+// syncfs(). This is much faster than calling `SyncFile` on every file just
+// written under `path`. pdie() if syncing fails.
+// Returns false if this is not supported on the platform, in which case the
+// files have to be synced one by one.
+bool SyncFileSystem(const std::string& path);
+
 // mkdir -p path. All newly created directories use the given mode.
 // `mode` should be an octal permission mask, e.g. 0755.
 // Returns false on failure, sets errno.
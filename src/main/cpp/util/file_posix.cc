@@ -18,8 +18,12 @@
 #include <limits.h>  // PATH_MAX
 #include <stdlib.h>  // getenv
 #include <sys/stat.h>
-#include <unistd.h>  // access, open, close, fsync
+#include <sys/time.h>  // futimes
+#include <unistd.h>  // access, open, close, fsync, link, syscall
 #include <utime.h>   // utime
+#if defined(__linux__)
+#include <sys/syscall.h>  // SYS_syncfs
+#endif  // defined(__linux__)
 
 #include <string>
 #include <vector>
@@ -235,6 +239,44 @@ bool WriteFile(const void *data, size_t size, const string &filename,
   return result == static_cast<int>(size);
 }
 
+bool OpenFileForReading(const string &filename, file_handle_type *result) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  *result = fd;
+  return true;
+}
+
+bool OpenFileForWriting(const string &filename, unsigned int perm,
+                        file_handle_type *result) {
+  UnlinkPath(filename);  // We don't care about the success of this.
+  int fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_TRUNC, perm);
+  if (fd == -1) {
+    return false;
+  }
+  *result = fd;
+  return true;
+}
+
+bool WriteToHandle(file_handle_type fd, const void *data, size_t size) {
+  const char *p = reinterpret_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t written = write(fd, p, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool CloseFileHandle(file_handle_type fd) { return close(fd) == 0; }
+
 int WriteToStdOutErr(const void *data, size_t size, bool to_stdout) {
   size_t r = fwrite(data, 1, size, to_stdout ? stdout : stderr);
   return (r == size) ? WriteResult::SUCCESS
@@ -267,6 +309,20 @@ bool UnlinkPath(const string &file_path) {
   return unlink(file_path.c_str()) == 0;
 }
 
+bool LinkFile(const string &target, const string &link_name) {
+  return link(target.c_str(), link_name.c_str()) == 0;
+}
+
+bool GetFileStat(const string &path, uint64_t *size, int *link_count) {
+  struct stat buf;
+  if (stat(path.c_str(), &buf) < 0) {
+    return false;
+  }
+  *size = buf.st_size;
+  *link_count = buf.st_nlink;
+  return true;
+}
+
 bool PathExists(const string& path) {
   return access(path.c_str(), F_OK) == 0;
 }
@@ -333,6 +389,32 @@ void SyncFile(const string& path) {
   close(fd);
 }
 
+bool SyncFileSystem(const string &path) {
+#if defined(__linux__) && defined(SYS_syncfs)
+  const char *file_path = path.c_str();
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    pdie(blaze_exit_code::LOCAL_ENVIRONMENTAL_ERROR,
+         "failed to open '%s' for syncing", file_path);
+  }
+  // The system call rather than syncfs(), which glibc only has since 2.14.
+  if (syscall(SYS_syncfs, fd) < 0) {
+    if (errno == ENOSYS) {
+      // Linux older than 2.6.39.
+      close(fd);
+      return false;
+    }
+    pdie(blaze_exit_code::LOCAL_ENVIRONMENTAL_ERROR,
+         "failed to sync the file system of '%s'", file_path);
+  }
+  close(fd);
+  return true;
+#else   // !(defined(__linux__) && defined(SYS_syncfs))
+  // sync() may return before the data is on the disk.
+  return false;
+#endif  // defined(__linux__) && defined(SYS_syncfs)
+}
+
 class PosixFileMtime : public IFileMtime {
  public:
   PosixFileMtime()
@@ -342,6 +424,7 @@ class PosixFileMtime : public IFileMtime {
   bool GetIfInDistantFuture(const string &path, bool *result) override;
   bool SetToNow(const string &path) override;
   bool SetToDistantFuture(const string &path) override;
+  bool SetHandleToDistantFuture(file_handle_type fd) override;
 
  private:
   // 9 years in the future.
@@ -378,6 +461,13 @@ bool PosixFileMtime::SetToDistantFuture(const string &path) {
   return Set(path, distant_future_);
 }
 
+bool PosixFileMtime::SetHandleToDistantFuture(file_handle_type fd) {
+  // futimes() rather than futimens(), which older macOS versions lack.
+  struct timeval times[2] = {{distant_future_.actime, 0},
+                             {distant_future_.modtime, 0}};
+  return futimes(fd, times) == 0;
+}
+
 bool PosixFileMtime::Set(const string &path, const struct utimbuf &mtime) {
   return utime(path.c_str(), &mtime) == 0;
 }
@@ -159,6 +159,7 @@ class WindowsFileMtime : public IFileMtime {
   bool GetIfInDistantFuture(const string& path, bool* result) override;
   bool SetToNow(const string& path) override;
   bool SetToDistantFuture(const string& path) override;
+  bool SetHandleToDistantFuture(file_handle_type handle) override;
 
  private:
   // 9 years in the future.
@@ -224,6 +225,14 @@ bool WindowsFileMtime::SetToDistantFuture(const string& path) {
   return Set(path, distant_future_);
 }
 
+bool WindowsFileMtime::SetHandleToDistantFuture(file_handle_type handle) {
+  return ::SetFileTime(
+             /* hFile */ handle,
+             /* lpCreationTime */ NULL,
+             /* lpLastAccessTime */ NULL,
+             /* lpLastWriteTime */ &distant_future_) == TRUE;
+}
+
 bool WindowsFileMtime::Set(const string& path, const FILETIME& time) {
   if (path.empty()) {
     return false;
@@ -566,13 +575,10 @@ bool AsShortWindowsPath(const string& path, string* result) {
   return true;
 }
 
-static bool OpenFileForReading(const string& filename, HANDLE* result) {
+bool OpenFileForReading(const string& filename, HANDLE* result) {
   if (filename.empty()) {
     return false;
   }
-  if (IsDevNull(filename)) {
-    return true;
-  }
   wstring wfilename;
   if (!AsWindowsPathWithUncPrefix(filename, &wfilename)) {
     return false;
@@ -585,7 +591,7 @@ static bool OpenFileForReading(const string& filename, HANDLE* result) {
       /* dwCreationDisposition */ OPEN_EXISTING,
       /* dwFlagsAndAttributes */ FILE_ATTRIBUTE_NORMAL,
       /* hTemplateFile */ NULL);
-  return true;
+  return *result != INVALID_HANDLE_VALUE;
 }
 
 int ReadFromHandle(file_handle_type handle, void* data, size_t size,
@@ -665,6 +671,49 @@ bool WriteFile(const void* data, size_t size, const string& filename,
   return actually_written == size;
 }
 
+bool OpenFileForWriting(const string& filename, unsigned int perm,
+                        file_handle_type* result) {
+  wstring wpath;
+  if (!AsWindowsPathWithUncPrefix(filename, &wpath)) {
+    return false;
+  }
+
+  UnlinkPathW(wpath);  // We don't care about the success of this.
+  HANDLE handle = ::CreateFileW(
+      /* lpFileName */ wpath.c_str(),
+      /* dwDesiredAccess */ GENERIC_WRITE,
+      /* dwShareMode */ FILE_SHARE_READ,
+      /* lpSecurityAttributes */ NULL,
+      /* dwCreationDisposition */ CREATE_ALWAYS,
+      /* dwFlagsAndAttributes */ FILE_ATTRIBUTE_NORMAL,
+      /* hTemplateFile */ NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  // TODO(laszlocsomor): respect `perm` and set the file permissions accordingly
+  *result = handle;
+  return true;
+}
+
+bool WriteToHandle(file_handle_type handle, const void* data, size_t size) {
+  const char* p = reinterpret_cast<const char*>(data);
+  while (size > 0) {
+    DWORD chunk = size > MAXDWORD ? MAXDWORD : static_cast<DWORD>(size);
+    DWORD actually_written = 0;
+    if (!::WriteFile(handle, p, chunk, &actually_written, NULL)) {
+      return false;
+    }
+    p += actually_written;
+    size -= actually_written;
+  }
+  return true;
+}
+
+bool CloseFileHandle(file_handle_type handle) {
+  return ::CloseHandle(handle) != FALSE;
+}
+
 int WriteToStdOutErr(const void* data, size_t size, bool to_stdout) {
   DWORD written = 0;
   HANDLE h = ::GetStdHandle(to_stdout ? STD_OUTPUT_HANDLE : STD_ERROR_HANDLE);
@@ -878,6 +927,17 @@ bool ReadDirectorySymlink(const string& name, string* result) {
   return true;
 }
 
+bool LinkFile(const string& target, const string& link_name) {
+  // Not implemented (it could use CreateHardLinkW), so the install bases are
+  // extracted in full, without sharing files.
+  return false;
+}
+
+bool GetFileStat(const string& path, uint64_t* size, int* link_count) {
+  // Only used together with LinkFile.
+  return false;
+}
+
 bool PathExists(const string& path) {
   if (path.empty()) {
     return false;
@@ -1102,6 +1162,11 @@ void SyncFile(const string& path) {
   // fsync always fails on Cygwin with "Permission denied" for some reason.
 }
 
+bool SyncFileSystem(const string& path) {
+  // No-op on Windows native, like SyncFile.
+  return true;
+}
+
 static bool IsRootDirectoryW(const wstring& path) {
   return IsRootOrAbsolute(path, true);
 }
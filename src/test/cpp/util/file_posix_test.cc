@@ -16,6 +16,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <memory>
 
 #include "src/main/cpp/util/file.h"
 #include "src/main/cpp/util/file_platform.h"
@@ -272,6 +273,75 @@ TEST(FilePosixTest, CanAccess) {
   ASSERT_EQ(0, rmdir(dir.c_str()));
 }
 
+TEST(FilePosixTest, WriteToHandle) {
+  const char* tmpdir = getenv("TEST_TMPDIR");
+  ASSERT_NE(nullptr, tmpdir);
+  ASSERT_NE(0, *tmpdir);
+
+  string file(JoinPath(tmpdir, "writetohandletest.txt"));
+  file_handle_type handle;
+  ASSERT_TRUE(OpenFileForWriting(file, 0700, &handle));
+  ASSERT_TRUE(WriteToHandle(handle, "hello ", 6));
+  ASSERT_TRUE(WriteToHandle(handle, "world", 5));
+  std::unique_ptr<IFileMtime> mtime(CreateFileMtime());
+  ASSERT_TRUE(mtime->SetHandleToDistantFuture(handle));
+  ASSERT_TRUE(CloseFileHandle(handle));
+
+  string content;
+  ASSERT_TRUE(ReadFile(file, &content));
+  ASSERT_EQ("hello world", content);
+  char buf[16];
+  ASSERT_TRUE(OpenFileForReading(file, &handle));
+  ASSERT_EQ(11, ReadFromHandle(handle, buf, sizeof(buf), nullptr));
+  ASSERT_EQ(0, ReadFromHandle(handle, buf, sizeof(buf), nullptr));
+  ASSERT_TRUE(CloseFileHandle(handle));
+  ASSERT_EQ("hello world", string(buf, 11));
+  bool is_in_future = false;
+  ASSERT_TRUE(mtime->GetIfInDistantFuture(file, &is_in_future));
+  ASSERT_TRUE(is_in_future);
+
+  // The file is replaced.
+  ASSERT_TRUE(OpenFileForWriting(file, 0700, &handle));
+  ASSERT_TRUE(WriteToHandle(handle, "bye", 3));
+  ASSERT_TRUE(CloseFileHandle(handle));
+  ASSERT_TRUE(ReadFile(file, &content));
+  ASSERT_EQ("bye", content);
+  ASSERT_TRUE(mtime->GetIfInDistantFuture(file, &is_in_future));
+  ASSERT_FALSE(is_in_future);
+
+  ASSERT_EQ(0, unlink(file.c_str()));
+}
+
+TEST(FilePosixTest, LinkFile) {
+  const char* tmpdir = getenv("TEST_TMPDIR");
+  ASSERT_NE(nullptr, tmpdir);
+  ASSERT_NE(0, *tmpdir);
+
+  string file(JoinPath(tmpdir, "linkfiletest.txt"));
+  string link(JoinPath(tmpdir, "linkfiletest.link"));
+  ASSERT_TRUE(WriteFile("hello", 5, file));
+  uint64_t size = 0;
+  int link_count = 0;
+  ASSERT_TRUE(GetFileStat(file, &size, &link_count));
+  ASSERT_EQ(5, size);
+  ASSERT_EQ(1, link_count);
+
+  ASSERT_TRUE(LinkFile(file, link));
+  ASSERT_FALSE(LinkFile(file, link));
+  ASSERT_TRUE(GetFileStat(link, &size, &link_count));
+  ASSERT_EQ(5, size);
+  ASSERT_EQ(2, link_count);
+  string content;
+  ASSERT_TRUE(ReadFile(link, &content));
+  ASSERT_EQ("hello", content);
+
+  ASSERT_EQ(0, unlink(file.c_str()));
+  ASSERT_TRUE(GetFileStat(link, &size, &link_count));
+  ASSERT_EQ(1, link_count);
+  ASSERT_EQ(0, unlink(link.c_str()));
+  ASSERT_FALSE(GetFileStat(link, &size, &link_count));
+}
+
 TEST(FilePosixTest, GetCwd) {
   char cwdbuf[PATH_MAX];
   ASSERT_EQ(cwdbuf, getcwd(cwdbuf, PATH_MAX));
@@ -0,0 +1,120 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_TOOLS_SINGLEJAR_AFFIX_SET_H_
+#define SRC_TOOLS_SINGLEJAR_AFFIX_SET_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * A set of prefixes (or suffixes) which tells whether a name starts (ends)
+ * with any of them. The strings are kept in a trie (of the reversed
+ * strings for the suffixes), so a match takes time proportional to the
+ * length of the matched part of the name rather than to the number of
+ * strings in the set.
+ */
+class AffixSet {
+ public:
+  enum Kind { kPrefixes, kSuffixes };
+
+  explicit AffixSet(Kind kind) : kind_(kind), size_(0), nodes_(1) {}
+
+  // Adds the string to the set.
+  void Add(const std::string &affix) {
+    uint32_t node = 0;
+    for (size_t i = 0; i < affix.size(); ++i) {
+      uint8_t c = At(affix.data(), affix.size(), i);
+      auto &children = nodes_[node].children;
+      auto child = std::lower_bound(children.begin(), children.end(),
+                                    std::make_pair(c, uint32_t(0)));
+      if (child != children.end() && child->first == c) {
+        node = child->second;
+      } else {
+        uint32_t new_node = nodes_.size();
+        children.insert(child, std::make_pair(c, new_node));
+        nodes_.emplace_back();
+        node = new_node;
+      }
+    }
+    nodes_[node].terminal = true;
+    ++size_;
+  }
+
+  // Adds all the strings to the set.
+  void Add(const std::vector<std::string> &affixes) {
+    for (auto &affix : affixes) {
+      Add(affix);
+    }
+  }
+
+  // True if the name starts (ends) with a string in the set.
+  bool Matches(const char *name, size_t name_length) const {
+    uint32_t node = 0;
+    for (size_t i = 0;; ++i) {
+      if (nodes_[node].terminal) {
+        return true;
+      }
+      if (i == name_length) {
+        return false;
+      }
+      node = Child(node, At(name, name_length, i));
+      if (node == 0) {
+        return false;
+      }
+    }
+  }
+
+  bool Matches(const std::string &name) const {
+    return Matches(name.data(), name.size());
+  }
+
+  // Number of strings added.
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+ private:
+  struct Node {
+    Node() : terminal(false) {}
+    bool terminal;  // A string in the set ends here.
+    // The characters and the nodes they lead to, sorted by character.
+    std::vector<std::pair<uint8_t, uint32_t> > children;
+  };
+
+  // The i-th character of the string in the order it is matched.
+  uint8_t At(const char *str, size_t length, size_t i) const {
+    return static_cast<uint8_t>(kind_ == kPrefixes ? str[i]
+                                                   : str[length - 1 - i]);
+  }
+
+  // Returns the child of the node for given character, or 0 (the root,
+  // which is no one's child) if there is none.
+  uint32_t Child(uint32_t node, uint8_t c) const {
+    auto &children = nodes_[node].children;
+    auto child = std::lower_bound(children.begin(), children.end(),
+                                  std::make_pair(c, uint32_t(0)));
+    return child != children.end() && child->first == c ? child->second : 0;
+  }
+
+  const Kind kind_;
+  size_t size_;
+  std::vector<Node> nodes_;  // The root is nodes_[0].
+};
+
+#endif  // SRC_TOOLS_SINGLEJAR_AFFIX_SET_H_
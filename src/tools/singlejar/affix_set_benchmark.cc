@@ -0,0 +1,89 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reports how long it takes to match entry names against a set of package
+// prefixes, checking the prefixes one by one (the way singlejar used to)
+// and with AffixSet.
+// Usage:
+//   affix_set_benchmark [--prefixes N] [--names N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "src/tools/singlejar/affix_set.h"
+#include "src/tools/singlejar/diag.h"
+
+int main(int argc, char *argv[]) {
+  int prefix_count = 500;
+  int name_count = 200000;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--prefixes") && i + 1 < argc) {
+      prefix_count = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--names") && i + 1 < argc) {
+      name_count = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Usage: %s [--prefixes N] [--names N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // Half of the names are in the packages with the prefixes.
+  std::vector<std::string> prefixes;
+  for (int i = 0; i < prefix_count; ++i) {
+    prefixes.push_back("com/example/team" + std::to_string(i) + "/");
+  }
+  std::vector<std::string> names;
+  for (int i = 0; i < name_count; ++i) {
+    const int package = i % (2 * prefix_count);
+    names.push_back("com/example/team" + std::to_string(package) +
+                    "/pkg/Class" + std::to_string(i) + ".class");
+  }
+  AffixSet prefix_set(AffixSet::kPrefixes);
+  prefix_set.Add(prefixes);
+
+  auto start = std::chrono::steady_clock::now();
+  size_t linear_matches = 0;
+  for (auto &name : names) {
+    for (auto &prefix : prefixes) {
+      if (prefix.size() <= name.size() &&
+          0 == strncmp(name.c_str(), prefix.c_str(), prefix.size())) {
+        ++linear_matches;
+        break;
+      }
+    }
+  }
+  auto linear_end = std::chrono::steady_clock::now();
+  size_t trie_matches = 0;
+  for (auto &name : names) {
+    if (prefix_set.Matches(name)) {
+      ++trie_matches;
+    }
+  }
+  auto trie_end = std::chrono::steady_clock::now();
+
+  if (linear_matches != trie_matches) {
+    diag_errx(1, "%s:%d: linear matching found %zu names, trie %zu", __FILE__,
+              __LINE__, linear_matches, trie_matches);
+  }
+  printf("%zu names, %zu prefixes, %zu matches: linear %.3fs, trie %.3fs\n",
+         names.size(), prefixes.size(), trie_matches,
+         std::chrono::duration<double>(linear_end - start).count(),
+         std::chrono::duration<double>(trie_end - linear_end).count());
+  return 0;
+}
@@ -0,0 +1,115 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "src/tools/singlejar/affix_set.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+TEST(AffixSetTest, Prefixes) {
+  AffixSet prefixes(AffixSet::kPrefixes);
+  EXPECT_TRUE(prefixes.empty());
+  EXPECT_FALSE(prefixes.Matches("com/google/Foo.class"));
+  EXPECT_FALSE(prefixes.Matches(""));
+  prefixes.Add(std::vector<std::string>{"com/google/", "org/", "or"});
+  EXPECT_EQ(3, prefixes.size());
+  EXPECT_TRUE(prefixes.Matches("com/google/Foo.class"));
+  EXPECT_TRUE(prefixes.Matches("com/google/"));
+  EXPECT_FALSE(prefixes.Matches("com/google"));
+  EXPECT_FALSE(prefixes.Matches("com/example/Foo.class"));
+  EXPECT_TRUE(prefixes.Matches("org/Foo.class"));
+  EXPECT_TRUE(prefixes.Matches("oracle/Foo.class"));
+  EXPECT_FALSE(prefixes.Matches("o"));
+  EXPECT_FALSE(prefixes.Matches("Foo.class"));
+  // Only the given number of characters is matched.
+  const char name[] = "com/google/Foo.class";
+  EXPECT_TRUE(prefixes.Matches(name, 11));
+  EXPECT_FALSE(prefixes.Matches(name, 10));
+}
+
+TEST(AffixSetTest, Suffixes) {
+  AffixSet suffixes(AffixSet::kSuffixes);
+  EXPECT_FALSE(suffixes.Matches("foo.png"));
+  suffixes.Add(".png");
+  suffixes.Add(".jpg");
+  suffixes.Add("g");
+  suffixes.Add(".png");
+  EXPECT_EQ(4, suffixes.size());
+  EXPECT_TRUE(suffixes.Matches("foo.png"));
+  EXPECT_TRUE(suffixes.Matches(".jpg"));
+  EXPECT_TRUE(suffixes.Matches("foo.svg"));
+  EXPECT_FALSE(suffixes.Matches("foo.gif"));
+  EXPECT_FALSE(suffixes.Matches("foo.pngx"));
+  EXPECT_FALSE(suffixes.Matches(""));
+  const char name[] = "foo.png.txt";
+  EXPECT_TRUE(suffixes.Matches(name, 7));
+  EXPECT_FALSE(suffixes.Matches(name, 6));
+}
+
+// An empty string matches every name.
+TEST(AffixSetTest, EmptyString) {
+  AffixSet prefixes(AffixSet::kPrefixes);
+  prefixes.Add("");
+  EXPECT_TRUE(prefixes.Matches(""));
+  EXPECT_TRUE(prefixes.Matches("foo"));
+  AffixSet suffixes(AffixSet::kSuffixes);
+  suffixes.Add("");
+  EXPECT_TRUE(suffixes.Matches(""));
+  EXPECT_TRUE(suffixes.Matches("foo"));
+}
+
+// The bytes above 0x7F are not sign-extended.
+TEST(AffixSetTest, NonAscii) {
+  AffixSet suffixes(AffixSet::kSuffixes);
+  suffixes.Add("\xC3\xA9");
+  suffixes.Add("\x7F");
+  EXPECT_TRUE(suffixes.Matches("caf\xC3\xA9"));
+  EXPECT_TRUE(suffixes.Matches("del\x7F"));
+  EXPECT_FALSE(suffixes.Matches("cafe"));
+}
+
+// Checks that the trie matches the same names as checking the prefixes one
+// by one.
+TEST(AffixSetTest, MatchesLikeLinearSearch) {
+  std::vector<std::string> prefixes;
+  for (int i = 0; i < 50; ++i) {
+    prefixes.push_back("com/example/team" + std::to_string(i) + "/");
+  }
+  AffixSet prefix_set(AffixSet::kPrefixes);
+  prefix_set.Add(prefixes);
+  size_t matches = 0;
+  for (int i = 0; i < 1000; ++i) {
+    std::string name = "com/example/team" + std::to_string(i % 100) +
+                       "/pkg/Class" + std::to_string(i) + ".class";
+    bool linear_match = false;
+    for (auto &prefix : prefixes) {
+      if (prefix.size() <= name.size() &&
+          0 == strncmp(name.c_str(), prefix.c_str(), prefix.size())) {
+        linear_match = true;
+        break;
+      }
+    }
+    EXPECT_EQ(linear_match, prefix_set.Matches(name)) << name;
+    if (linear_match) {
+      ++matches;
+    }
+  }
+  EXPECT_EQ(500, matches);
+}
+
+}  // namespace
@@ -15,11 +15,21 @@
 #include "src/tools/singlejar/combiners.h"
 #include "src/tools/singlejar/diag.h"
 
+#include <ctype.h>
+#include <stdlib.h>
+
 Combiner::~Combiner() {}
 
 Concatenator::~Concatenator() {}
 
 bool Concatenator::Merge(const CDH *cdh, const LH *lh) {
+  if (Z_DEFLATED == lh->compression_method() && !inflater_.get()) {
+    inflater_.reset(new Inflater());
+  }
+  return Merge(cdh, lh, inflater_.get());
+}
+
+bool Concatenator::Merge(const CDH *cdh, const LH *lh, Inflater *inflater) {
   if (insert_newlines_ && buffer_.get() && buffer_->data_size() &&
       '\n' != buffer_->last_byte()) {
     Append("\n", 1);
@@ -28,10 +38,7 @@ bool Concatenator::Merge(const CDH *cdh, const LH *lh) {
   if (Z_NO_COMPRESSION == lh->compression_method()) {
     buffer_->ReadEntryContents(lh);
   } else if (Z_DEFLATED == lh->compression_method()) {
-    if (!inflater_.get()) {
-      inflater_.reset(new Inflater());
-    }
-    buffer_->DecompressEntryContents(cdh, lh, inflater_.get());
+    buffer_->DecompressEntryContents(cdh, lh, inflater);
   } else {
     errx(2, "%s is neither stored nor deflated", filename_.c_str());
   }
@@ -39,21 +46,35 @@ bool Concatenator::Merge(const CDH *cdh, const LH *lh) {
 }
 
 void *Concatenator::OutputEntry(bool compress) {
+  return OutputEntry(compress, nullptr);
+}
+
+void *Concatenator::OutputEntry(bool compress, Deflater *deflater) {
   if (!buffer_.get()) {
     return nullptr;
   }
+  return CreateEntry(filename_, buffer_.get(), compress, deflater);
+}
 
+TransientBytes *Concatenator::OutputContents(std::string *name) {
+  *name = filename_;
+  return buffer_.get();
+}
+
+void *Concatenator::CreateEntry(const std::string &filename,
+                                TransientBytes *contents, bool compress,
+                                Deflater *deflater) {
   // Allocate a contiguous buffer for the local file header and
   // deflated data. We assume that deflate decreases the size, so if
   //  the deflater reports overflow, we just save original data.
   size_t deflated_buffer_size =
-      sizeof(LH) + filename_.size() + buffer_->data_size();
+      sizeof(LH) + filename.size() + contents->data_size();
 
   // Huge entry (>4GB) needs Zip64 extension field with 64-bit original
   // and compressed size values.
   uint8_t
       zip64_extension_buffer[sizeof(Zip64ExtraField) + 2 * sizeof(uint64_t)];
-  bool huge_buffer = ziph::zfield_needs_ext64(buffer_->data_size());
+  bool huge_buffer = ziph::zfield_needs_ext64(contents->data_size());
   if (huge_buffer) {
     deflated_buffer_size += sizeof(zip64_extension_buffer);
   }
@@ -68,7 +89,7 @@ void *Concatenator::OutputEntry(bool compress) {
   lh->last_mod_file_date(33);  // 1980-01-01
   lh->crc32(0x12345678);
   lh->compressed_file_size32(0);
-  lh->file_name(filename_.c_str(), filename_.size());
+  lh->file_name(filename.c_str(), filename.size());
 
   if (huge_buffer) {
     // Add Z64 extension if this is a huge entry.
@@ -77,10 +98,10 @@ void *Concatenator::OutputEntry(bool compress) {
         reinterpret_cast<Zip64ExtraField *>(zip64_extension_buffer);
     z64->signature();
     z64->payload_size(2 * sizeof(uint64_t));
-    z64->attr64(0, buffer_->data_size());
+    z64->attr64(0, contents->data_size());
     lh->extra_fields(reinterpret_cast<uint8_t *>(z64), z64->size());
   } else {
-    lh->uncompressed_file_size32(buffer_->data_size());
+    lh->uncompressed_file_size32(contents->data_size());
     lh->extra_fields(nullptr, 0);
   }
 
@@ -88,20 +109,19 @@ void *Concatenator::OutputEntry(bool compress) {
   uint64_t compressed_size;
   uint16_t method;
   if (compress) {
-    method = buffer_->CompressOut(lh->data(), &checksum, &compressed_size);
+    method = contents->CompressOut(lh->data(), &checksum, &compressed_size,
+                                   deflater);
   } else {
-    buffer_->CopyOut(lh->data(), &checksum);
+    contents->CopyOut(lh->data(), &checksum);
     method = Z_NO_COMPRESSION;
-    compressed_size = buffer_->data_size();
+    compressed_size = contents->data_size();
   }
   lh->crc32(checksum);
   lh->compression_method(method);
   if (huge_buffer) {
-    lh->compressed_file_size32(ziph::zfield_needs_ext64(compressed_size)
-                                   ? 0xFFFFFFFF
-                                   : compressed_size);
-    // Not sure if this has to be written in the small case, but it shouldn't
-    // hurt.
+    // If the local header has Zip64 extra field, it has both sizes, and
+    // both 32-bit size fields are 0xFFFFFFFF.
+    lh->compressed_file_size32(0xFFFFFFFF);
     const_cast<Zip64ExtraField *>(lh->zip64_extra_field())
         ->attr64(1, compressed_size);
   } else {
@@ -161,12 +181,25 @@ bool XmlCombiner::Merge(const CDH *cdh, const LH *lh) {
 }
 
 void *XmlCombiner::OutputEntry(bool compress) {
+  return OutputEntry(compress, nullptr);
+}
+
+void *XmlCombiner::OutputEntry(bool compress, Deflater *deflater) {
   if (!concatenator_.get()) {
     return nullptr;
   }
   concatenator_->Append(end_tag_);
   concatenator_->Append("\n");
-  return concatenator_->OutputEntry(compress);
+  return concatenator_->OutputEntry(compress, deflater);
+}
+
+TransientBytes *XmlCombiner::OutputContents(std::string *name) {
+  if (!concatenator_.get()) {
+    return nullptr;
+  }
+  concatenator_->Append(end_tag_);
+  concatenator_->Append("\n");
+  return concatenator_->OutputContents(name);
 }
 
 PropertyCombiner::~PropertyCombiner() {}
@@ -174,3 +207,163 @@ PropertyCombiner::~PropertyCombiner() {}
 bool PropertyCombiner::Merge(const CDH *cdh, const LH *lh) {
   return false;  // This should not be called.
 }
+
+void *PropertyCombiner::OutputEntry(bool compress) {
+  return OutputEntry(compress, nullptr);
+}
+
+void *PropertyCombiner::OutputEntry(bool compress, Deflater *deflater) {
+  AppendProperties();
+  return Concatenator::OutputEntry(compress, deflater);
+}
+
+TransientBytes *PropertyCombiner::OutputContents(std::string *name) {
+  AppendProperties();
+  return Concatenator::OutputContents(name);
+}
+
+void PropertyCombiner::AddLine(const std::string &key, std::string line) {
+  auto inserted = line_index_.emplace(key, lines_.size());
+  if (inserted.second) {
+    lines_.emplace_back(key, std::move(line));
+  } else {
+    lines_[inserted.first->second].second = std::move(line);
+  }
+}
+
+void PropertyCombiner::AppendProperties() {
+  for (auto &line : lines_) {
+    Append(line.second);
+    Append("\n", 1);
+  }
+  lines_.clear();
+  line_index_.clear();
+}
+
+static bool IsPropertyWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\f';
+}
+
+static bool IsHexDigit(char c) {
+  return isxdigit(static_cast<unsigned char>(c));
+}
+
+// Returns the property name with the escape sequences replaced by the
+// characters they stand for (\uXXXX ones by UTF-8).
+static std::string UnescapeKey(const std::string &key) {
+  if (key.find('\\') == std::string::npos) {
+    return key;
+  }
+  std::string result;
+  for (size_t i = 0; i < key.size(); ++i) {
+    char c = key[i];
+    if (c != '\\' || i + 1 == key.size()) {
+      result += c;
+      continue;
+    }
+    c = key[++i];
+    unsigned long code_point;
+    switch (c) {
+      case 't':
+        result += '\t';
+        break;
+      case 'n':
+        result += '\n';
+        break;
+      case 'r':
+        result += '\r';
+        break;
+      case 'f':
+        result += '\f';
+        break;
+      case 'u':
+        if (i + 4 < key.size() && IsHexDigit(key[i + 1]) &&
+            IsHexDigit(key[i + 2]) && IsHexDigit(key[i + 3]) &&
+            IsHexDigit(key[i + 4])) {
+          code_point = strtoul(key.substr(i + 1, 4).c_str(), nullptr, 16);
+          if (code_point < 0x80) {
+            result += static_cast<char>(code_point);
+          } else if (code_point < 0x800) {
+            result += static_cast<char>(0xC0 | (code_point >> 6));
+            result += static_cast<char>(0x80 | (code_point & 0x3F));
+          } else {
+            result += static_cast<char>(0xE0 | (code_point >> 12));
+            result += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (code_point & 0x3F));
+          }
+          i += 4;
+          break;
+        }
+        result += c;
+        break;
+      default:
+        result += c;
+        break;
+    }
+  }
+  return result;
+}
+
+// The format is that of java.util.Properties.load(): a line ending with an
+// odd number of backslashes continues on the next line, the name ends at
+// the first unescaped '=', ':' or whitespace.
+void PropertyCombiner::AddProperties(const char *data, size_t size) {
+  const char *const data_end = data + size;
+  // Returns the end of the line starting at 'p'.
+  auto line_end = [data_end](const char *p) {
+    while (p < data_end && *p != '\n' && *p != '\r') {
+      ++p;
+    }
+    return p;
+  };
+  // Returns the start of the line following the one ending at 'p'.
+  auto next_line = [data_end](const char *p) {
+    if (p < data_end && *p == '\r') {
+      ++p;
+    }
+    if (p < data_end && *p == '\n') {
+      ++p;
+    }
+    return p;
+  };
+  while (data < data_end) {
+    while (data < data_end && IsPropertyWhitespace(*data)) {
+      ++data;
+    }
+    if (data == data_end) {
+      break;
+    }
+    if (*data == '#' || *data == '!' || *data == '\n' || *data == '\r') {
+      data = next_line(line_end(data));
+      continue;
+    }
+    // Join the continued lines to find the name. The line is output as is.
+    const char *line_start = data;
+    const char *end;
+    std::string joined;
+    for (;;) {
+      end = line_end(data);
+      const char *p = end;
+      while (p > data && p[-1] == '\\') {
+        --p;
+      }
+      const bool continued = (end - p) % 2 == 1;
+      joined.append(data, end - data - continued);
+      data = next_line(end);
+      if (!continued || data == data_end) {
+        break;
+      }
+      while (data < data_end && IsPropertyWhitespace(*data)) {
+        ++data;
+      }
+    }
+    size_t key_end = 0;
+    while (key_end < joined.size() && joined[key_end] != '=' &&
+           joined[key_end] != ':' && !IsPropertyWhitespace(joined[key_end])) {
+      key_end += joined[key_end] == '\\' ? 2 : 1;
+    }
+    key_end = std::min(key_end, joined.size());
+    AddLine(UnescapeKey(joined.substr(0, key_end)),
+            std::string(line_start, end - line_start));
+  }
+}
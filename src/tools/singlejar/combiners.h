@@ -17,6 +17,9 @@
 
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "src/tools/singlejar/transient_bytes.h"
 #include "src/tools/singlejar/zip_headers.h"
@@ -33,6 +36,17 @@ class Combiner {
   // Otherwise the payload is compressed, provided that the compressed data
   // is smaller than the original.
   virtual void *OutputEntry(bool compress) = 0;
+  // Same as above, but compresses the payload with given deflater (unless
+  // it is null), so that its compression level and strategy apply.
+  virtual void *OutputEntry(bool compress, Deflater *deflater) {
+    return OutputEntry(compress);
+  }
+  // Finishes the contents of the output entry and returns them, setting
+  // `name' to the entry name, so that the caller can write out a large
+  // entry piece by piece instead of having OutputEntry create it in memory.
+  // Returns null if the combiner does not support this or has nothing to
+  // output. Only one of OutputContents and OutputEntry can be called.
+  virtual TransientBytes *OutputContents(std::string *name) { return nullptr; }
 };
 
 // An output jar entry consisting of a concatenation of the input jar
@@ -46,8 +60,21 @@ class Concatenator : public Combiner {
 
   bool Merge(const CDH *cdh, const LH *lh) override;
 
+  // Same as above, but decompresses the entry with given inflater.
+  bool Merge(const CDH *cdh, const LH *lh, Inflater *inflater);
+
   void *OutputEntry(bool compress) override;
 
+  void *OutputEntry(bool compress, Deflater *deflater) override;
+
+  TransientBytes *OutputContents(std::string *name) override;
+
+  // Returns the buffer containing Local Header followed by the payload for
+  // the entry with given name and contents, see Combiner::OutputEntry.
+  static void *CreateEntry(const std::string &filename,
+                           TransientBytes *contents, bool compress,
+                           Deflater *deflater);
+
   void Append(const char *s, size_t n) {
     CreateBuffer();
     buffer_->Append(reinterpret_cast<const uint8_t *>(s), n);
@@ -95,6 +122,10 @@ class XmlCombiner : public Combiner {
 
   void *OutputEntry(bool compress) override;
 
+  void *OutputEntry(bool compress, Deflater *deflater) override;
+
+  TransientBytes *OutputContents(std::string *name) override;
+
   const std::string filename() const { return filename_; }
 
  private:
@@ -105,9 +136,13 @@ class XmlCombiner : public Combiner {
   std::unique_ptr<Inflater> inflater_;
 };
 
-// A wrapper around Concatenator allowing to append
+// A wrapper around Concatenator allowing to add the properties, i.e.,
 //   NAME=VALUE
-// lines to the contents.
+// lines, to the contents. A property added more than once is output once,
+// in the place where it was first added, with the value added last, so
+// that java.util.Properties.load() sees the same properties as it would
+// in the concatenation of all the lines. The properties are output in the
+// order they were added.
 // NOTE that it does not allow merging existing entries.
 class PropertyCombiner : public Concatenator {
  public:
@@ -116,21 +151,35 @@ class PropertyCombiner : public Concatenator {
 
   bool Merge(const CDH *cdh, const LH *lh) override;
 
+  void *OutputEntry(bool compress) override;
+
+  void *OutputEntry(bool compress, Deflater *deflater) override;
+
+  TransientBytes *OutputContents(std::string *name) override;
+
   void AddProperty(const char *key, const char *value) {
-    // TODO(asmundak): deduplicate properties.
-    Append(key);
-    Append("=", 1);
-    Append(value);
-    Append("\n", 1);
+    AddProperty(std::string(key), std::string(value));
   }
 
   void AddProperty(const std::string &key, const std::string &value) {
-    // TODO(asmundak): deduplicate properties.
-    Append(key);
-    Append("=", 1);
-    Append(value);
-    Append("\n", 1);
+    AddLine(key, key + "=" + value);
   }
+
+  // Parses the given contents of a properties file in a single pass and
+  // adds its properties. The comments and blank lines are dropped, the
+  // property lines are output as is.
+  void AddProperties(const char *data, size_t size);
+
+ private:
+  // Adds the property with given (unescaped) name, 'line' being its text.
+  void AddLine(const std::string &key, std::string line);
+  // Appends the property lines to the contents.
+  void AppendProperties();
+
+  // The property names and lines in the order the properties were added.
+  std::vector<std::pair<std::string, std::string> > lines_;
+  // The index of each property in lines_.
+  std::unordered_map<std::string, size_t> line_index_;
 };
 
 #endif  //  SRC_TOOLS_SINGLEJAR_COMBINERS_H_
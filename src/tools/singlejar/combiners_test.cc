@@ -14,6 +14,8 @@
 
 #include "src/tools/singlejar/combiners.h"
 
+#include <algorithm>
+
 #include "src/tools/singlejar/input_jar.h"
 #include "src/tools/singlejar/zip_headers.h"
 #include "src/tools/singlejar/zlib_interface.h"
@@ -193,6 +195,53 @@ TEST_F(CombinersTest, XmlCombiner) {
   free(reinterpret_cast<void *>(entry));
 }
 
+// Test OutputContents, which is used instead of OutputEntry for the large
+// entries.
+TEST_F(CombinersTest, OutputContents) {
+  InputJar input_jar;
+  Concatenator concatenator("concat");
+  XmlCombiner xml_combiner("combined.xml", "toplevel");
+  std::string name;
+  ASSERT_EQ(nullptr, concatenator.OutputContents(&name));
+  ASSERT_EQ(nullptr, xml_combiner.OutputContents(&name));
+  ASSERT_TRUE(input_jar.Open("combiners.zip"));
+  const LH *lh;
+  const CDH *cdh;
+  while ((cdh = input_jar.NextEntry(&lh))) {
+    if (cdh->file_name_is("tag1.xml") || cdh->file_name_is("tag2.xml")) {
+      ASSERT_TRUE(concatenator.Merge(cdh, lh));
+      ASSERT_TRUE(xml_combiner.Merge(cdh, lh));
+    }
+  }
+
+  std::string contents;
+  auto append = [&contents](const void *chunk, uint64_t chunk_size) {
+    contents.append(reinterpret_cast<const char *>(chunk), chunk_size);
+  };
+  TransientBytes *bytes = concatenator.OutputContents(&name);
+  ASSERT_NE(nullptr, bytes);
+  EXPECT_EQ("concat", name);
+  bytes->stream_out(append);
+  EXPECT_EQ(kConcatenatedContents, contents);
+
+  contents.clear();
+  bytes = xml_combiner.OutputContents(&name);
+  ASSERT_NE(nullptr, bytes);
+  EXPECT_EQ("combined.xml", name);
+  bytes->stream_out(append);
+  EXPECT_EQ(kCombinedXmlContents, contents);
+
+  // The entry created from the contents is the same OutputEntry creates.
+  LH *entry = reinterpret_cast<LH *>(
+      Concatenator::CreateEntry(name, bytes, false, nullptr));
+  EXPECT_TRUE(entry->file_name_is("combined.xml"));
+  EXPECT_EQ(Z_NO_COMPRESSION, entry->compression_method());
+  EXPECT_EQ(kCombinedXmlContents,
+            string(reinterpret_cast<char *>(entry->data()),
+                   entry->uncompressed_file_size()));
+  free(reinterpret_cast<void *>(entry));
+}
+
 // Test PropertyCombiner.
 TEST_F(CombinersTest, PropertyCombiner) {
   static char kProperties[] =
@@ -243,4 +292,69 @@ TEST_F(CombinersTest, PropertyCombiner) {
   free(reinterpret_cast<void *>(entry));
 }
 
+// Returns the contents PropertyCombiner outputs.
+static string PropertyContents(PropertyCombiner *property_combiner) {
+  LH *entry = reinterpret_cast<LH *>(property_combiner->OutputEntry(false));
+  if (entry == nullptr) {
+    return "";
+  }
+  string contents(reinterpret_cast<char *>(entry->data()),
+                  entry->uncompressed_file_size());
+  free(reinterpret_cast<void *>(entry));
+  return contents;
+}
+
+// Test that PropertyCombiner outputs each property once, with the last value.
+TEST_F(CombinersTest, PropertyCombinerDuplicates) {
+  PropertyCombiner property_combiner("properties");
+  property_combiner.AddProperty("name1", "value1");
+  property_combiner.AddProperty("name2", "value2");
+  property_combiner.AddProperty("name1", "value3");
+  static const char kPropertiesFile[] =
+      "# comment\n"
+      "\n"
+      "  ! another comment\n"
+      "name2 = value4\n"
+      "name3:value5\r\n"
+      "name\\ 4 value6\n"
+      "name5=first \\\n"
+      "      second\n"
+      "name6=value7\\\\\n"
+      "na\\u006de1 value8";
+  property_combiner.AddProperties(kPropertiesFile, strlen(kPropertiesFile));
+  EXPECT_EQ(
+      "na\\u006de1 value8\n"
+      "name2 = value4\n"
+      "name3:value5\n"
+      "name\\ 4 value6\n"
+      "name5=first \\\n"
+      "      second\n"
+      "name6=value7\\\\\n",
+      PropertyContents(&property_combiner));
+}
+
+// Test that PropertyCombiner unescapes \uXXXX in the names only when it is
+// followed by four hex digits.
+TEST_F(CombinersTest, PropertyCombinerInvalidUnicodeEscape) {
+  PropertyCombiner property_combiner("properties");
+  static const char kPropertiesFile[] = "\\u+041=1\n\\u0041=2\nA=3\n";
+  property_combiner.AddProperties(kPropertiesFile, strlen(kPropertiesFile));
+  EXPECT_EQ("\\u+041=1\nA=3\n", PropertyContents(&property_combiner));
+}
+
+// Test that many duplicate properties are handled in linear time.
+TEST_F(CombinersTest, PropertyCombinerManyDuplicates) {
+  PropertyCombiner property_combiner("properties");
+  const int kProperties = 50000;
+  for (int round = 0; round < 4; ++round) {
+    for (int i = 0; i < kProperties; ++i) {
+      property_combiner.AddProperty("name" + std::to_string(i),
+                                    std::to_string(round));
+    }
+  }
+  string contents = PropertyContents(&property_combiner);
+  EXPECT_EQ(kProperties, std::count(contents.begin(), contents.end(), '\n'));
+  EXPECT_EQ(0, contents.compare(0, 8, "name0=3\n"));
+}
+
 }  // namespace
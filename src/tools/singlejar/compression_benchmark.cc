@@ -0,0 +1,128 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reports how long it takes singlejar to compress given jars and how large
+// the output is, for each compression level and for the fast strategies.
+// Usage:
+//   compression_benchmark [--threads N] JAR...
+// The jars are first combined into a jar with all the entries stored, then
+// this jar is compressed with each setting.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "src/tools/singlejar/diag.h"
+#include "src/tools/singlejar/options.h"
+#include "src/tools/singlejar/output_jar.h"
+
+namespace {
+
+// Runs singlejar with given arguments, returns the elapsed time in seconds.
+double RunSinglejar(const std::vector<std::string> &args) {
+  std::vector<const char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(arg.c_str());
+  }
+  Options options;
+  options.ParseCommandLine(argv.size(), argv.data());
+  OutputJar output_jar;
+  auto start = std::chrono::steady_clock::now();
+  if (output_jar.Doit(&options)) {
+    diag_errx(1, "%s:%d: singlejar failed", __FILE__, __LINE__);
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+off_t FileSize(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st)) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path.c_str());
+  }
+  return st.st_size;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string threads = "1";
+  std::vector<std::string> jars;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = argv[++i];
+    } else {
+      jars.push_back(argv[i]);
+    }
+  }
+  if (jars.empty()) {
+    fprintf(stderr, "Usage: %s [--threads N] JAR...\n", argv[0]);
+    return 1;
+  }
+
+  const char *tmpdir = getenv("TEST_TMPDIR");
+  std::string dir = std::string(tmpdir ? tmpdir : "/tmp") +
+                    "/compression_benchmark.XXXXXX";
+  if (mkdtemp(&dir[0]) == nullptr) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__, dir.c_str());
+  }
+  const std::string stored = dir + "/stored.jar";
+  const std::string output = dir + "/out.jar";
+
+  // Without --compression singlejar decompresses the entries.
+  std::vector<std::string> args = {"--output", stored, "--normalize",
+                                   "--sources"};
+  args.insert(args.end(), jars.begin(), jars.end());
+  RunSinglejar(args);
+  const off_t stored_size = FileSize(stored);
+
+  struct Setting {
+    const char *level;
+    const char *strategy;
+  };
+  std::vector<Setting> settings;
+  static const char *levels[] = {"0", "1", "2", "3", "4",
+                                 "5", "6", "7", "8", "9"};
+  for (auto level : levels) {
+    settings.push_back({level, "default"});
+  }
+  settings.push_back({"6", "huffman_only"});
+  settings.push_back({"6", "rle"});
+
+  printf("%-5s %-12s %10s %14s %7s\n", "level", "strategy", "seconds",
+         "bytes", "ratio");
+  printf("%-5s %-12s %10s %14lld %7.3f\n", "-", "stored", "-",
+         static_cast<long long>(stored_size), 1.0);
+  for (auto &setting : settings) {
+    double seconds = RunSinglejar(
+        {"--output", output, "--normalize", "--compression", "--threads",
+         threads, "--compression_level", setting.level,
+         "--compression_strategy", setting.strategy, "--sources", stored});
+    off_t size = FileSize(output);
+    printf("%-5s %-12s %10.3f %14lld %7.3f\n", setting.level,
+           setting.strategy, seconds, static_cast<long long>(size),
+           static_cast<double>(size) / stored_size);
+    unlink(output.c_str());
+  }
+  unlink(stored.c_str());
+  rmdir(dir.c_str());
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/tools/singlejar/entry_compressor.h"
+
+#include <stdlib.h>
+
+#include "src/tools/singlejar/diag.h"
+
+EntryCompressor::EntryCompressor(int threads, int compression_level,
+                                 int compression_strategy)
+    : compression_level_(compression_level),
+      compression_strategy_(compression_strategy),
+      started_(0),
+      stopping_(false) {
+  if (threads < 1) {
+    threads = 1;
+  }
+  for (int i = 0; i < threads; ++i) {
+    workers_.emplace_back(&EntryCompressor::Work, this);
+  }
+}
+
+EntryCompressor::~EntryCompressor() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  job_submitted_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+  for (auto &job : jobs_) {
+    free(job.result);
+  }
+}
+
+void EntryCompressor::Submit(const Task &task) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    jobs_.push_back(Job{task, nullptr, false});
+  }
+  job_submitted_.notify_one();
+}
+
+void *EntryCompressor::Next() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (jobs_.empty()) {
+    diag_errx(1, "%s:%d: No entries are pending", __FILE__, __LINE__);
+  }
+  job_done_.wait(lock, [this]() { return jobs_.front().done; });
+  void *result = jobs_.front().result;
+  jobs_.pop_front();
+  --started_;
+  return result;
+}
+
+size_t EntryCompressor::pending() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return jobs_.size();
+}
+
+void EntryCompressor::Work() {
+  Inflater inflater;
+  Deflater deflater(compression_level_, compression_strategy_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    job_submitted_.wait(
+        lock, [this]() { return stopping_ || started_ < jobs_.size(); });
+    if (stopping_) {
+      return;
+    }
+    Job &job = jobs_[started_++];
+    lock.unlock();
+    void *result = job.task(&inflater, &deflater);
+    lock.lock();
+    job.result = result;
+    job.done = true;
+    job_done_.notify_all();
+  }
+}
@@ -0,0 +1,96 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_TOOLS_SINGLEJAR_ENTRY_COMPRESSOR_H_
+#define SRC_TOOLS_SINGLEJAR_ENTRY_COMPRESSOR_H_ 1
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "src/tools/singlejar/zlib_interface.h"
+
+/*
+ * Runs the tasks producing output jar entries (that is, decompressing
+ * and/or compressing their contents) on a pool of worker threads, and
+ * returns the produced entries in the order the tasks were submitted.
+ * Each worker thread owns an Inflater and a Deflater which are passed to
+ * every task it runs, so that they are not created anew for each entry.
+ * The usage pattern is:
+ *   EntryCompressor compressor(4);
+ *   compressor.Submit([](Inflater *inflater, Deflater *deflater) {
+ *     ... return local header followed by the payload ...
+ *   });
+ *   ...
+ *   while (compressor.pending()) {
+ *     void *entry = compressor.Next();
+ *     ... write entry, free it ...
+ *   }
+ * Submit() and Next() should be called from the same thread.
+ */
+class EntryCompressor {
+ public:
+  // A task returns a buffer allocated with malloc() containing Local Header
+  // followed by the payload (see Combiner::OutputEntry), or nullptr.
+  typedef std::function<void *(Inflater *inflater, Deflater *deflater)> Task;
+
+  // The workers' deflaters use given compression level and strategy.
+  explicit EntryCompressor(int threads,
+                           int compression_level = Z_DEFAULT_COMPRESSION,
+                           int compression_strategy = Z_DEFAULT_STRATEGY);
+
+  // Waits for the running tasks to finish. The entries which have not been
+  // retrieved by Next() are freed.
+  ~EntryCompressor();
+
+  // Queues up given task.
+  void Submit(const Task &task);
+
+  // Returns the entry produced by the earliest submitted task whose result
+  // has not been retrieved yet, waiting for that task to complete.
+  void *Next();
+
+  // The number of submitted tasks whose results have not been retrieved.
+  size_t pending() const;
+
+ private:
+  struct Job {
+    Task task;
+    void *result;
+    bool done;
+  };
+
+  void Work();
+
+  const int compression_level_;
+  const int compression_strategy_;
+  std::vector<std::thread> workers_;
+  mutable std::mutex mutex_;
+  std::condition_variable job_submitted_;
+  std::condition_variable job_done_;
+  // Jobs submitted but not retrieved yet. References to the elements of a
+  // deque remain valid when elements are added or removed at its ends, so
+  // the workers can run the tasks without holding the mutex.
+  std::deque<Job> jobs_;
+  size_t started_;    // Index in jobs_ of the first job not started yet.
+  bool stopping_;
+};
+
+#endif  // SRC_TOOLS_SINGLEJAR_ENTRY_COMPRESSOR_H_
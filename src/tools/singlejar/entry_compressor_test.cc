@@ -0,0 +1,82 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "src/tools/singlejar/entry_compressor.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// Returns a task which sleeps for a while and returns a malloc'ed copy
+// of the given value.
+EntryCompressor::Task ValueTask(int value, useconds_t delay) {
+  return [value, delay](Inflater *inflater, Deflater *deflater) {
+    EXPECT_NE(nullptr, inflater);
+    EXPECT_NE(nullptr, deflater);
+    usleep(delay);
+    int *result = reinterpret_cast<int *>(malloc(sizeof(int)));
+    *result = value;
+    return reinterpret_cast<void *>(result);
+  };
+}
+
+// Results are returned in the submission order even if the tasks complete
+// out of order.
+TEST(EntryCompressorTest, Ordered) {
+  EntryCompressor compressor(4);
+  const int kTasks = 100;
+  for (int i = 0; i < kTasks; ++i) {
+    compressor.Submit(ValueTask(i, (kTasks - i) % 7 * 1000));
+  }
+  EXPECT_EQ(kTasks, compressor.pending());
+  for (int i = 0; i < kTasks; ++i) {
+    int *result = reinterpret_cast<int *>(compressor.Next());
+    ASSERT_NE(nullptr, result);
+    EXPECT_EQ(i, *result);
+    free(result);
+  }
+  EXPECT_EQ(0, compressor.pending());
+}
+
+// Submitting and retrieving can be interleaved.
+TEST(EntryCompressorTest, Interleaved) {
+  EntryCompressor compressor(2);
+  int expected = 0;
+  for (int i = 0; i < 50; ++i) {
+    compressor.Submit(ValueTask(i, i % 3 * 500));
+    if (i % 5 == 4) {
+      int *result = reinterpret_cast<int *>(compressor.Next());
+      EXPECT_EQ(expected++, *result);
+      free(result);
+    }
+  }
+  while (compressor.pending()) {
+    int *result = reinterpret_cast<int *>(compressor.Next());
+    EXPECT_EQ(expected++, *result);
+    free(result);
+  }
+  EXPECT_EQ(50, expected);
+}
+
+// Results not retrieved are discarded on destruction.
+TEST(EntryCompressorTest, Abandoned) {
+  EntryCompressor compressor(3);
+  for (int i = 0; i < 10; ++i) {
+    compressor.Submit(ValueTask(i, 100));
+  }
+}
+
+}  // namespace
@@ -0,0 +1,247 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_TOOLS_SINGLEJAR_NAME_INDEX_H_
+#define SRC_TOOLS_SINGLEJAR_NAME_INDEX_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Maps entry names to values of type V. This is an open addressing hash
+ * table with linear probing. The names are copied to an arena allocated
+ * in large blocks, so unlike std::unordered_map<std::string, V> it does
+ * not allocate memory for each name, and looking up a name does not
+ * require constructing a std::string: a name can be passed as a pointer
+ * to the file name in a Central Directory Header.
+ * Values are stored in the table itself, so the pointers returned by
+ * Find() and Insert() are valid only until the next insertion.
+ * The arena can be mapped from a file, see set_arena_file().
+ */
+template <class V>
+class NameIndex {
+ public:
+  NameIndex()
+      : size_(0),
+        arena_position_(nullptr),
+        arena_available_(0),
+        arena_bytes_(0),
+        peak_bytes_(0),
+        arena_fd_(-1),
+        arena_file_bytes_(0) {}
+
+  // Returns the value for the given name, or nullptr if it is absent.
+  V *Find(const char *name, size_t name_length) {
+    if (slots_.empty()) {
+      return nullptr;
+    }
+    Slot *slot = Probe(name, name_length, Hash(name, name_length));
+    return slot->name ? &slot->value : nullptr;
+  }
+
+  V *Find(const std::string &name) { return Find(name.data(), name.size()); }
+
+  // Adds the name with the given value unless the name is already present.
+  // Returns the pointer to the value for the name and true if it has been
+  // added.
+  std::pair<V *, bool> Insert(const char *name, size_t name_length,
+                              const V &value) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      Grow();
+    }
+    uint32_t hash = Hash(name, name_length);
+    Slot *slot = Probe(name, name_length, hash);
+    if (slot->name) {
+      return std::make_pair(&slot->value, false);
+    }
+    slot->name = Save(name, name_length);
+    slot->name_length = name_length;
+    slot->hash = hash;
+    slot->value = value;
+    ++size_;
+    UpdatePeak();
+    return std::make_pair(&slot->value, true);
+  }
+
+  std::pair<V *, bool> Insert(const std::string &name, const V &value) {
+    return Insert(name.data(), name.size(), value);
+  }
+
+  // Calls f(name, name_length, value) for each name, in no particular order.
+  template <class F>
+  void ForEach(const F &f) {
+    for (auto &slot : slots_) {
+      if (slot.name) {
+        f(slot.name, slot.name_length, slot.value);
+      }
+    }
+  }
+
+  // Removes all names, releasing the memory.
+  void clear() {
+    std::vector<Slot>().swap(slots_);
+    arena_.clear();
+    mapped_arena_.clear();
+    size_ = 0;
+    arena_position_ = nullptr;
+    arena_available_ = 0;
+    arena_bytes_ = 0;
+    arena_file_bytes_ = 0;
+  }
+
+  // Saves the names inserted from now on in the given file, which the
+  // caller keeps open while the index is in use. The arena blocks are then
+  // shared mappings of the file, which the kernel can write out and
+  // reclaim, so that only the table, with a fixed size slot per name,
+  // stays in memory. The names are read back only when their hashes
+  // match. If the file cannot be extended or mapped, the names are kept
+  // in memory.
+  void set_arena_file(int fd) { arena_fd_ = fd; }
+
+  // Number of names.
+  size_t size() const { return size_; }
+
+  // Memory used by the index, and the largest amount it has used. The
+  // arena blocks mapped from the file are not counted.
+  size_t bytes() const { return slots_.size() * sizeof(Slot) + arena_bytes_; }
+  size_t peak_bytes() const { return peak_bytes_; }
+
+  // The size of the arena blocks mapped from the file.
+  size_t arena_file_bytes() const { return arena_file_bytes_; }
+
+ private:
+  struct Slot {
+    Slot() : name(nullptr), name_length(0), hash(0), value() {}
+    const char *name;  // In the arena, nullptr if the slot is free.
+    uint32_t name_length;
+    uint32_t hash;
+    V value;
+  };
+
+  // FNV-1a.
+  static uint32_t Hash(const char *name, size_t name_length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < name_length; ++i) {
+      hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619u;
+    }
+    return hash;
+  }
+
+  // Returns the slot containing the name, or the free slot where it belongs.
+  Slot *Probe(const char *name, size_t name_length, uint32_t hash) {
+    size_t mask = slots_.size() - 1;
+    for (size_t index = hash & mask;; index = (index + 1) & mask) {
+      Slot *slot = &slots_[index];
+      if (slot->name == nullptr ||
+          (slot->hash == hash && slot->name_length == name_length &&
+           !memcmp(slot->name, name, name_length))) {
+        return slot;
+      }
+    }
+  }
+
+  // Doubles the table size. Both tables exist while the slots are moved,
+  // which is accounted for in the peak size.
+  void Grow() {
+    std::vector<Slot> slots(std::max<size_t>(slots_.size() * 2, 1024));
+    slots_.swap(slots);
+    peak_bytes_ = std::max(peak_bytes_, bytes() + slots.size() * sizeof(Slot));
+    for (auto &slot : slots) {
+      if (slot.name) {
+        *Probe(slot.name, slot.name_length, slot.hash) = slot;
+      }
+    }
+  }
+
+  // Copies the name to the arena.
+  const char *Save(const char *name, size_t name_length) {
+    // A slot's name is non-null, so an empty name takes a byte too.
+    size_t size = std::max<size_t>(name_length, 1);
+    if (size > arena_available_ && !MapArenaBlock(size)) {
+      size_t block_size = std::max<size_t>(size, kArenaBlockSize);
+      arena_.emplace_back(new char[block_size]);
+      arena_position_ = arena_.back().get();
+      arena_available_ = block_size;
+      arena_bytes_ += block_size;
+    }
+    char *saved = arena_position_;
+    memcpy(saved, name, name_length);
+    arena_position_ += size;
+    arena_available_ -= size;
+    return saved;
+  }
+
+  // Extends the arena file by a block which can hold the name of given
+  // size and maps it. Returns false if there is no file or this fails.
+  bool MapArenaBlock(size_t size) {
+    if (arena_fd_ < 0) {
+      return false;
+    }
+    size_t block_size = (size + kArenaFileBlockSize - 1) /
+                        kArenaFileBlockSize * kArenaFileBlockSize;
+    off_t offset = static_cast<off_t>(arena_file_bytes_);
+    if (ftruncate(arena_fd_, offset + block_size)) {
+      return false;
+    }
+    void *block = mmap(nullptr, block_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, arena_fd_, offset);
+    if (block == MAP_FAILED) {
+      return false;
+    }
+    mapped_arena_.emplace_back(static_cast<char *>(block),
+                               Unmapper{block_size});
+    arena_position_ = mapped_arena_.back().get();
+    arena_available_ = block_size;
+    arena_file_bytes_ += block_size;
+    return true;
+  }
+
+  void UpdatePeak() { peak_bytes_ = std::max(peak_bytes_, bytes()); }
+
+  struct Unmapper {
+    size_t size;
+    void operator()(char *block) const { munmap(block, size); }
+  };
+
+  static const size_t kArenaBlockSize = 1 << 16;
+  static const size_t kArenaFileBlockSize = 1 << 20;
+
+  std::vector<Slot> slots_;  // The size is a power of 2.
+  size_t size_;
+  std::vector<std::unique_ptr<char[]> > arena_;
+  char *arena_position_;
+  size_t arena_available_;
+  size_t arena_bytes_;
+  size_t peak_bytes_;
+  int arena_fd_;
+  std::vector<std::unique_ptr<char, Unmapper> > mapped_arena_;
+  size_t arena_file_bytes_;
+};
+
+template <class V>
+const size_t NameIndex<V>::kArenaBlockSize;
+
+template <class V>
+const size_t NameIndex<V>::kArenaFileBlockSize;
+
+#endif  // SRC_TOOLS_SINGLEJAR_NAME_INDEX_H_
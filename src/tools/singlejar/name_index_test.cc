@@ -0,0 +1,126 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdio.h>
+#include <string>
+
+#include "src/tools/singlejar/name_index.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// Names are found by the contents, not by the pointer.
+TEST(NameIndexTest, InsertFind) {
+  NameIndex<int> index;
+  EXPECT_EQ(nullptr, index.Find("foo"));
+  auto got = index.Insert("foo", 1);
+  EXPECT_TRUE(got.second);
+  EXPECT_EQ(1, *got.first);
+  got = index.Insert(std::string("foo"), 2);
+  EXPECT_FALSE(got.second);
+  EXPECT_EQ(1, *got.first);
+  const char name[] = "foo/bar";
+  ASSERT_NE(nullptr, index.Find(name, 3));
+  EXPECT_EQ(1, *index.Find(name, 3));
+  EXPECT_EQ(nullptr, index.Find(name, 4));
+  got = index.Insert(name, sizeof(name) - 1, 3);
+  EXPECT_TRUE(got.second);
+  *got.first = 4;
+  EXPECT_EQ(4, *index.Find("foo/bar"));
+  EXPECT_EQ(2, index.size());
+}
+
+// Empty name is a valid name.
+TEST(NameIndexTest, EmptyName) {
+  NameIndex<int> index;
+  EXPECT_EQ(nullptr, index.Find(""));
+  EXPECT_TRUE(index.Insert("", 1).second);
+  ASSERT_NE(nullptr, index.Find(""));
+  EXPECT_EQ(1, *index.Find(""));
+}
+
+// The index grows, keeping all the names.
+TEST(NameIndexTest, Grow) {
+  NameIndex<int> index;
+  const int kNames = 100000;
+  for (int i = 0; i < kNames; ++i) {
+    EXPECT_TRUE(index.Insert("dir/name" + std::to_string(i), i).second);
+  }
+  EXPECT_EQ(kNames, index.size());
+  for (int i = 0; i < kNames; ++i) {
+    int *value = index.Find("dir/name" + std::to_string(i));
+    ASSERT_NE(nullptr, value);
+    EXPECT_EQ(i, *value);
+  }
+  int count = 0;
+  long sum = 0;
+  index.ForEach([&](const char *name, size_t name_length, int value) {
+    EXPECT_EQ("dir/name" + std::to_string(value),
+              std::string(name, name_length));
+    ++count;
+    sum += value;
+  });
+  EXPECT_EQ(kNames, count);
+  EXPECT_EQ(static_cast<long>(kNames) * (kNames - 1) / 2, sum);
+  EXPECT_LE(index.bytes(), index.peak_bytes());
+  EXPECT_LT(0, index.peak_bytes());
+
+  index.clear();
+  EXPECT_EQ(0, index.size());
+  EXPECT_EQ(0, index.bytes());
+  EXPECT_EQ(nullptr, index.Find("dir/name1"));
+}
+
+// The names can be kept in a file rather than in memory.
+TEST(NameIndexTest, ArenaFile) {
+  FILE *arena_file = tmpfile();
+  ASSERT_NE(nullptr, arena_file);
+  NameIndex<int> index;
+  NameIndex<int> memory_index;
+  EXPECT_TRUE(index.Insert("in/memory", -1).second);
+  memory_index.Insert("in/memory", -1);
+  index.set_arena_file(fileno(arena_file));
+  const int kNames = 100000;
+  // Names longer than a file block, too.
+  const std::string long_name(3 << 20, 'x');
+  EXPECT_TRUE(index.Insert(long_name, kNames).second);
+  memory_index.Insert(long_name, kNames);
+  for (int i = 0; i < kNames; ++i) {
+    EXPECT_TRUE(index.Insert("dir/name" + std::to_string(i), i).second);
+    memory_index.Insert("dir/name" + std::to_string(i), i);
+  }
+  EXPECT_FALSE(index.Insert("dir/name1", 0).second);
+  EXPECT_EQ(kNames + 2, index.size());
+  ASSERT_NE(nullptr, index.Find("in/memory"));
+  EXPECT_EQ(-1, *index.Find("in/memory"));
+  ASSERT_NE(nullptr, index.Find(long_name));
+  EXPECT_EQ(kNames, *index.Find(long_name));
+  for (int i = 0; i < kNames; ++i) {
+    int *value = index.Find("dir/name" + std::to_string(i));
+    ASSERT_NE(nullptr, value);
+    EXPECT_EQ(i, *value);
+  }
+  // The names inserted after set_arena_file() are in the file, so only
+  // the table has grown in memory.
+  EXPECT_LT(long_name.size(), index.arena_file_bytes());
+  ASSERT_EQ(0, fseek(arena_file, 0, SEEK_END));
+  EXPECT_EQ(static_cast<long>(index.arena_file_bytes()), ftell(arena_file));
+  EXPECT_GT(memory_index.bytes() - long_name.size(), index.bytes());
+
+  index.clear();
+  EXPECT_EQ(0, index.arena_file_bytes());
+  EXPECT_EQ(nullptr, index.Find("dir/name1"));
+  fclose(arena_file);
+}
+
+}  // namespace
@@ -17,6 +17,32 @@
 #include "src/tools/singlejar/diag.h"
 #include "src/tools/singlejar/token_stream.h"
 
+#include <zlib.h>
+
+// Returns zlib compression strategy given its name.
+static int ParseCompressionStrategy(const std::string &name) {
+  static const struct {
+    const char *name;
+    int strategy;
+  } strategies[] = {
+      {"default", Z_DEFAULT_STRATEGY},
+      {"filtered", Z_FILTERED},
+      {"huffman_only", Z_HUFFMAN_ONLY},
+      {"rle", Z_RLE},
+      {"fixed", Z_FIXED},
+  };
+  for (auto &strategy : strategies) {
+    if (name == strategy.name) {
+      return strategy.strategy;
+    }
+  }
+  diag_errx(1,
+            "--compression_strategy should be one of default, filtered, "
+            "huffman_only, rle, fixed; got %s",
+            name.c_str());
+  return Z_DEFAULT_STRATEGY;
+}
+
 void Options::ParseCommandLine(int argc, const char * const argv[]) {
   ArgTokenStream tokens(argc, argv);
   std::string optarg;
@@ -24,6 +50,11 @@ void Options::ParseCommandLine(int argc, const char * const argv[]) {
     if (tokens.MatchAndSet("--output", &output_jar) ||
         tokens.MatchAndSet("--main_class", &main_class) ||
         tokens.MatchAndSet("--java_launcher", &java_launcher) ||
+        tokens.MatchAndSet("--output_index", &output_index) ||
+        tokens.MatchAndSet("--previous_output", &previous_output) ||
+        tokens.MatchAndSet("--previous_index", &previous_index) ||
+        tokens.MatchAndSet("--profile", &profile) ||
+        tokens.MatchAndSet("--cache_dir", &cache_dir) ||
         tokens.MatchAndSet("--deploy_manifest_lines", &manifest_lines) ||
         tokens.MatchAndSet("--sources", &input_jars) ||
         tokens.MatchAndSet("--resources", &resources) ||
@@ -31,6 +62,7 @@ void Options::ParseCommandLine(int argc, const char * const argv[]) {
         tokens.MatchAndSet("--include_prefixes", &include_prefixes) ||
         tokens.MatchAndSet("--exclude_build_data", &exclude_build_data) ||
         tokens.MatchAndSet("--compression", &force_compression) ||
+        tokens.MatchAndSet("--mmap_output", &mmap_output) ||
         tokens.MatchAndSet("--dont_change_compression",
                            &preserve_compression) ||
         tokens.MatchAndSet("--normalize", &normalize_timestamps) ||
@@ -38,7 +70,13 @@ void Options::ParseCommandLine(int argc, const char * const argv[]) {
         tokens.MatchAndSet("--verbose", &verbose) ||
         tokens.MatchAndSet("--warn_duplicate_resources",
                            &warn_duplicate_resources) ||
-        tokens.MatchAndSet("--nocompress_suffixes", &nocompress_suffixes)) {
+        tokens.MatchAndSet("--nocompress_suffixes", &nocompress_suffixes) ||
+        tokens.MatchAndSet("--threads", &threads) ||
+        tokens.MatchAndSet("--cen_buffer_mb", &cen_buffer_mb) ||
+        tokens.MatchAndSet("--compression_level", &compression_level)) {
+      continue;
+    } else if (tokens.MatchAndSet("--compression_strategy", &optarg)) {
+      compression_strategy = ParseCompressionStrategy(optarg);
       continue;
     } else if (tokens.MatchAndSet("--build_info_file", &optarg)) {
       build_info_files.push_back(optarg);
@@ -59,4 +97,22 @@ void Options::ParseCommandLine(int argc, const char * const argv[]) {
         1,
         "--compression and --dont_change_compression are mutually exclusive");
   }
+  if (previous_output.empty() != previous_index.empty()) {
+    diag_errx(1, "--previous_output and --previous_index go together");
+  }
+  if (!previous_output.empty() && previous_output == output_jar) {
+    diag_errx(1, "--previous_output cannot be the same as --output");
+  }
+  if (threads < 1) {
+    diag_errx(1, "--threads should be at least 1, got %d", threads);
+  }
+  if (compression_level < -1 || compression_level > 9) {
+    diag_errx(1, "--compression_level should be between -1 and 9, got %d",
+              compression_level);
+  }
+  if (cen_buffer_mb < 0) {
+    diag_errx(1, "--cen_buffer_mb cannot be negative, got %d", cen_buffer_mb);
+  }
+  include_prefix_set.Add(include_prefixes);
+  nocompress_suffix_set.Add(nocompress_suffixes);
 }
@@ -18,18 +18,27 @@
 #include <string>
 #include <vector>
 
+#include "src/tools/singlejar/affix_set.h"
+
 /* Command line options. */
 class Options {
  public:
   Options()
       : exclude_build_data(false),
         force_compression(false),
+        mmap_output(false),
         normalize_timestamps(false),
         no_duplicates(false),
         no_duplicate_classes(false),
         preserve_compression(false),
         verbose(false),
-        warn_duplicate_resources(false) {}
+        warn_duplicate_resources(false),
+        threads(1),
+        cen_buffer_mb(0),
+        compression_level(-1),
+        compression_strategy(0),
+        include_prefix_set(AffixSet::kPrefixes),
+        nocompress_suffix_set(AffixSet::kSuffixes) {}
 
   // Parses command line arguments into the fields of this instance.
   void ParseCommandLine(int argc, const char * const argv[]);
@@ -37,6 +46,11 @@ class Options {
   std::string output_jar;
   std::string main_class;
   std::string java_launcher;
+  std::string output_index;
+  std::string previous_output;
+  std::string previous_index;
+  std::string profile;
+  std::string cache_dir;
   std::vector<std::string> manifest_lines;
   std::vector<std::string> input_jars;
   std::vector<std::string> resources;
@@ -47,12 +61,22 @@ class Options {
   std::vector<std::string> nocompress_suffixes;
   bool exclude_build_data;
   bool force_compression;
+  bool mmap_output;
   bool normalize_timestamps;
   bool no_duplicates;
   bool no_duplicate_classes;
   bool preserve_compression;
   bool verbose;
   bool warn_duplicate_resources;
+  int threads;
+  int cen_buffer_mb;
+  int compression_level;     // zlib compression level 0-9, -1 is the zlib
+                             // default (Z_DEFAULT_COMPRESSION).
+  int compression_strategy;  // zlib compression strategy, 0 is the default.
+  // The include_prefixes and nocompress_suffixes, compiled for matching
+  // the entry names by ParseCommandLine.
+  AffixSet include_prefix_set;
+  AffixSet nocompress_suffix_set;
 };
 
 #endif  // THIRD_PARTY_BAZEL_SRC_TOOLS_SINGLEJAR_OPTIONS_H_
@@ -20,6 +20,8 @@
 #include "src/main/cpp/util/port.h"
 #include "gtest/gtest.h"
 
+#include <zlib.h>
+
 TEST(OptionsTest, Flags1) {
   const char *args[] = {"--exclude_build_data",
                         "--compression",
@@ -31,11 +33,16 @@ TEST(OptionsTest, Flags1) {
 
   EXPECT_TRUE(options.exclude_build_data);
   EXPECT_TRUE(options.force_compression);
+  EXPECT_FALSE(options.mmap_output);
   EXPECT_TRUE(options.normalize_timestamps);
   EXPECT_TRUE(options.no_duplicates);
   EXPECT_FALSE(options.preserve_compression);
   EXPECT_FALSE(options.verbose);
   EXPECT_FALSE(options.warn_duplicate_resources);
+  EXPECT_EQ(1, options.threads);
+  EXPECT_EQ(0, options.cen_buffer_mb);
+  EXPECT_EQ(-1, options.compression_level);
+  EXPECT_EQ(Z_DEFAULT_STRATEGY, options.compression_strategy);
   EXPECT_EQ("output_jar", options.output_jar);
 }
 
@@ -43,12 +50,14 @@ TEST(OptionsTest, Flags2) {
   const char *args[] = {"--dont_change_compression",
                         "--verbose",
                         "--warn_duplicate_resources",
+                        "--mmap_output",
                         "--output", "output_jar"};
   Options options;
   options.ParseCommandLine(arraysize(args), args);
 
   ASSERT_FALSE(options.exclude_build_data);
   ASSERT_FALSE(options.force_compression);
+  ASSERT_TRUE(options.mmap_output);
   ASSERT_FALSE(options.normalize_timestamps);
   ASSERT_FALSE(options.no_duplicates);
   ASSERT_TRUE(options.preserve_compression);
@@ -60,22 +69,40 @@ TEST(OptionsTest, SingleOptargs) {
   const char *args[] = {"--output", "output_jar",
                         "--main_class", "com.google.Main",
                         "--java_launcher", "//tools:mylauncher",
+                        "--output_index", "output_index",
+                        "--previous_output", "previous_jar",
+                        "--previous_index", "previous_index",
+                        "--profile", "profile.json",
+                        "--cache_dir", "cache",
                         "--build_info_file", "build_file1",
                         "--extra_build_info", "extra_build_line1",
                         "--build_info_file", "build_file2",
-                        "--extra_build_info", "extra_build_line2"};
+                        "--extra_build_info", "extra_build_line2",
+                        "--threads", "8",
+                        "--cen_buffer_mb", "16",
+                        "--compression_level", "9",
+                        "--compression_strategy", "rle"};
   Options options;
   options.ParseCommandLine(arraysize(args), args);
 
   EXPECT_EQ("output_jar", options.output_jar);
   EXPECT_EQ("com.google.Main", options.main_class);
   EXPECT_EQ("//tools:mylauncher", options.java_launcher);
+  EXPECT_EQ("output_index", options.output_index);
+  EXPECT_EQ("previous_jar", options.previous_output);
+  EXPECT_EQ("previous_index", options.previous_index);
+  EXPECT_EQ("profile.json", options.profile);
+  EXPECT_EQ("cache", options.cache_dir);
   ASSERT_EQ(2, options.build_info_files.size());
   EXPECT_EQ("build_file1", options.build_info_files[0]);
   EXPECT_EQ("build_file2", options.build_info_files[1]);
   ASSERT_EQ(2, options.build_info_lines.size());
   EXPECT_EQ("extra_build_line1", options.build_info_lines[0]);
   EXPECT_EQ("extra_build_line2", options.build_info_lines[1]);
+  EXPECT_EQ(8, options.threads);
+  EXPECT_EQ(16, options.cen_buffer_mb);
+  EXPECT_EQ(9, options.compression_level);
+  EXPECT_EQ(Z_RLE, options.compression_strategy);
 }
 
 TEST(OptionsTest, MultiOptargs) {
@@ -105,6 +132,10 @@ TEST(OptionsTest, MultiOptargs) {
   EXPECT_EQ(2, options.nocompress_suffixes.size());
   EXPECT_EQ(".png", options.nocompress_suffixes[0]);
   EXPECT_EQ(".so", options.nocompress_suffixes[1]);
+  EXPECT_TRUE(options.include_prefix_set.Matches("prefix2/foo"));
+  EXPECT_FALSE(options.include_prefix_set.Matches("foo/prefix1"));
+  EXPECT_TRUE(options.nocompress_suffix_set.Matches("foo.so"));
+  EXPECT_FALSE(options.nocompress_suffix_set.Matches("foo.png.txt"));
 }
 
 TEST(OptionsTest, EmptyMultiOptargs) {
@@ -14,6 +14,8 @@
 
 #include <stdlib.h>
 
+#include <vector>
+
 #include "src/main/cpp/util/file.h"
 #include "src/main/cpp/util/file_platform.h"
 #include "src/main/cpp/util/port.h"
@@ -22,6 +24,7 @@
 #include "src/tools/singlejar/options.h"
 #include "src/tools/singlejar/output_jar.h"
 #include "src/tools/singlejar/test_util.h"
+#include "src/tools/singlejar/zlib_interface.h"
 #include "gtest/gtest.h"
 
 namespace {
@@ -36,6 +39,65 @@ using std::string;
 #define DATA_DIR_TOP
 #endif
 
+// A combiner whose output is a compressed entry with given number of zero
+// bytes. The entry is compressed chunk by chunk, so the uncompressed
+// contents is never in memory.
+class ZeroesCombiner : public Combiner {
+ public:
+  ZeroesCombiner(const string &filename, uint64_t size)
+      : filename_(filename), size_(size) {}
+  ~ZeroesCombiner() override {}
+  bool Merge(const CDH *cdh, const LH *lh) override { return true; }
+  void *OutputEntry(bool compress) override {
+    const size_t kChunkSize = 1 << 20;
+    std::vector<uint8_t> zeroes(kChunkSize);
+    std::vector<uint8_t> compressed(kChunkSize);
+    Deflater deflater;
+    uint32_t checksum = 0;
+    for (uint64_t remaining = size_; remaining > 0;) {
+      uint32_t chunk_size = std::min<uint64_t>(kChunkSize, remaining);
+      remaining -= chunk_size;
+      checksum = crc32(checksum, zeroes.data(), chunk_size);
+      deflater.next_in = zeroes.data();
+      deflater.avail_in = chunk_size;
+      do {
+        if (compressed.size() - deflater.total_out < kChunkSize) {
+          compressed.resize(compressed.size() + kChunkSize);
+        }
+        deflater.next_out = compressed.data() + deflater.total_out;
+        deflater.avail_out = compressed.size() - deflater.total_out;
+        deflate(&deflater, remaining ? Z_NO_FLUSH : Z_FINISH);
+      } while (deflater.avail_in > 0 || deflater.avail_out == 0);
+    }
+
+    uint8_t zip64_buffer[sizeof(Zip64ExtraField) + 2 * sizeof(uint64_t)];
+    Zip64ExtraField *zip64_ef = reinterpret_cast<Zip64ExtraField *>(zip64_buffer);
+    zip64_ef->signature();
+    zip64_ef->attr_count(2);
+    zip64_ef->attr64(0, size_);
+    zip64_ef->attr64(1, deflater.total_out);
+    LH *lh = reinterpret_cast<LH *>(malloc(
+        sizeof(LH) + filename_.size() + zip64_ef->size() + deflater.total_out));
+    lh->signature();
+    lh->version(45);
+    lh->bit_flag(0);
+    lh->compression_method(Z_DEFLATED);
+    lh->last_mod_file_time(1);
+    lh->last_mod_file_date(33);
+    lh->crc32(checksum);
+    lh->compressed_file_size32(0xFFFFFFFF);
+    lh->uncompressed_file_size32(0xFFFFFFFF);
+    lh->file_name(filename_.c_str(), filename_.size());
+    lh->extra_fields(zip64_buffer, zip64_ef->size());
+    memcpy(lh->data(), compressed.data(), deflater.total_out);
+    return lh;
+  }
+
+ private:
+  const string filename_;
+  const uint64_t size_;
+};
+
 class OutputHugeJarTest : public ::testing::Test {
  protected:
   void CreateOutput(const string &out_path, const std::vector<string> &args) {
@@ -74,4 +136,35 @@ TEST_F(OutputHugeJarTest, EntryAbove4G) {
                           DATA_DIR_TOP "src/tools/singlejar/libtest1.jar"});
 }
 
+TEST_F(OutputHugeJarTest, EntryOver4G) {
+  // Verifies that an entry whose size does not fit into 32 bits has correct
+  // Zip64 extra field in the Central Directory.
+  const uint64_t kSize = 0x140000000;  // 5GB
+  output_jar_.ExtraCombiner("huge", new ZeroesCombiner("huge", kSize));
+  string out_path = OutputFilePath("out.jar");
+  CreateOutput(out_path, {"--sources",
+                          DATA_DIR_TOP "src/tools/singlejar/libtest1.jar"});
+
+  InputJar input_jar;
+  ASSERT_TRUE(input_jar.Open(out_path));
+  const LH *lh;
+  const CDH *cdh;
+  bool found = false;
+  while ((cdh = input_jar.NextEntry(&lh))) {
+    if (cdh->file_name_is("huge")) {
+      found = true;
+      ASSERT_NE(nullptr, cdh->zip64_extra_field());
+      EXPECT_EQ(0xFFFFFFFF, cdh->uncompressed_file_size32());
+      EXPECT_EQ(kSize, cdh->uncompressed_file_size());
+      EXPECT_EQ(lh->compressed_file_size(), cdh->compressed_file_size());
+      EXPECT_EQ(45, cdh->version_to_extract());
+    } else {
+      EXPECT_EQ(nullptr, cdh->zip64_extra_field())
+          << "Entry: " << cdh->file_name_string();
+    }
+  }
+  EXPECT_TRUE(found);
+  input_jar.Close();
+}
+
 }  // namespace
@@ -21,10 +21,26 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
-
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "src/main/cpp/util/md5.h"
 #include "src/tools/singlejar/combiners.h"
 #include "src/tools/singlejar/diag.h"
 #include "src/tools/singlejar/input_jar.h"
@@ -34,38 +50,57 @@
 
 #include <zlib.h>
 
-#define TODO(cond, msg)                                              \
-  if (!(cond)) {                                                     \
-    diag_errx(2, "%s:%d: TODO(asmundak): " msg, __FILE__, __LINE__); \
-  }
-
 OutputJar::OutputJar()
     : options_(nullptr),
+      known_names_fd_(-1),
       file_(nullptr),
       outpos_(0),
-      buffer_(nullptr),
+      input_range_{nullptr, nullptr, 0, 0},
+      patch_size_(0),
+      kernel_copy_(true),
+      kernel_clone_(true),
+      output_block_size_(0),
+      mapped_output_(nullptr),
+      mapped_size_(0),
+      mapped_pos_(0),
+      kernel_copied_bytes_(0),
       entries_(0),
       duplicate_entries_(0),
       cen_(nullptr),
       cen_size_(0),
       cen_capacity_(0),
+      cen_spill_(nullptr),
+      cen_spilled_(0),
       spring_handlers_("META-INF/spring.handlers"),
       spring_schemas_("META-INF/spring.schemas"),
       protobuf_meta_handler_("protobuf.meta", false),
       manifest_("META-INF/MANIFEST.MF"),
-      build_properties_("build-data.properties") {
-  known_members_.emplace(spring_handlers_.filename(),
+      build_properties_("build-data.properties"),
+      reused_entries_(0),
+      cached_entries_(0),
+      phase_times_{0, 0, 0, 0},
+      copied_bytes_(0),
+      recompressed_bytes_(0),
+      recompressed_entries_(0),
+      normalized_headers_(0) {
+  known_members_.Insert(spring_handlers_.filename(),
                          EntryInfo{&spring_handlers_});
-  known_members_.emplace(spring_schemas_.filename(),
+  known_members_.Insert(spring_schemas_.filename(),
                          EntryInfo{&spring_schemas_});
-  known_members_.emplace(manifest_.filename(), EntryInfo{&manifest_});
-  known_members_.emplace(protobuf_meta_handler_.filename(),
+  known_members_.Insert(manifest_.filename(), EntryInfo{&manifest_});
+  known_members_.Insert(protobuf_meta_handler_.filename(),
                          EntryInfo{&protobuf_meta_handler_});
   manifest_.Append(
       "Manifest-Version: 1.0\r\n"
       "Created-By: singlejar\r\n");
 }
 
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
 static std::string Basename(const std::string& path) {
   size_t pos = path.rfind('/');
   if (pos == std::string::npos) {
@@ -80,12 +115,20 @@ int OutputJar::Doit(Options *options) {
     diag_errx(1, "%s:%d: Doit() can be called only once.", __FILE__, __LINE__);
   }
   options_ = options;
+  auto phase_start = std::chrono::steady_clock::now();
+
+  // With --cen_buffer_mb, keep the entry names in a file, too. The index
+  // table itself, about 32 bytes per entry, remains in memory.
+  if (options_->cen_buffer_mb) {
+    known_names_fd_ = CreateTempFile(".names");
+    known_members_.set_arena_file(known_names_fd_);
+  }
 
   // Register the handler for the build-data.properties file unless
   // --exclude_build_data is present. Otherwise we do not generate this file,
   // and it will be copied from the first source archive containing it.
   if (!options_->exclude_build_data) {
-    known_members_.emplace(build_properties_.filename(),
+    known_members_.Insert(build_properties_.filename(),
                            EntryInfo{&build_properties_});
   }
 
@@ -115,9 +158,8 @@ int OutputJar::Doit(Options *options) {
     if (file_ == nullptr || fstat(in_fd, &statbuf)) {
       diag_err(1, "%s", launcher_path);
     }
-    // TODO(asmundak):  Consider going back to sendfile() or reflink
-    // (BTRFS_IOC_CLONE/XFS_IOC_CLONE) here.  The launcher preamble can
-    // be very large for targets with many native deps.
+    // The launcher preamble can be very large for targets with many native
+    // deps. AppendFile clones or copies it in the kernel when it can.
     ssize_t byte_count = AppendFile(in_fd, 0, statbuf.st_size);
     if (byte_count < 0) {
       diag_err(1, "%s:%d: Cannot copy %s to %s", __FILE__, __LINE__,
@@ -150,8 +192,8 @@ int OutputJar::Doit(Options *options) {
   }
 
   for (auto &build_info_line : options_->build_info_lines) {
-    build_properties_.Append(build_info_line);
-    build_properties_.Append("\n");
+    build_properties_.AddProperties(build_info_line.data(),
+                                    build_info_line.size());
   }
 
   for (auto &build_info_file : options_->build_info_files) {
@@ -160,19 +202,9 @@ int OutputJar::Doit(Options *options) {
       diag_err(1, "%s:%d: Bad build info file %s", __FILE__, __LINE__,
                build_info_file.c_str());
     }
-    const char *data = reinterpret_cast<const char *>(mapped_file.start());
-    const char *data_end = reinterpret_cast<const char *>(mapped_file.end());
-    // TODO(asmundak): this isn't right, we should parse properties file.
-    while (data < data_end) {
-      const char *next_data = strchr(static_cast<const char *>(data), '\n');
-      if (next_data) {
-        ++next_data;
-      } else {
-        next_data = data_end;
-      }
-      build_properties_.Append(data, next_data - data);
-      data = next_data;
-    }
+    build_properties_.AddProperties(
+        reinterpret_cast<const char *>(mapped_file.start()),
+        mapped_file.size());
     mapped_file.Close();
   }
 
@@ -195,31 +227,24 @@ int OutputJar::Doit(Options *options) {
   }
 
   // Ready to write zip entries. Decide whether created entries should be
-  // compressed.
+  // compressed, and how.
   bool compress = options_->force_compression || options_->preserve_compression;
+  deflater_.reset(new Deflater(options_->compression_level,
+                               options_->compression_strategy));
   // First, write a directory entry for the META-INF, followed by the manifest
   // file, followed by the build properties file.
   WriteMetaInf();
   manifest_.Append("\r\n");
-  WriteEntry(manifest_.OutputEntry(compress));
+  WriteCombinedEntry(&manifest_, compress, deflater_.get());
   if (!options_->exclude_build_data) {
-    WriteEntry(build_properties_.OutputEntry(compress));
+    WriteCombinedEntry(&build_properties_, compress, deflater_.get());
   }
 
   // Then classpath resources.
   for (auto &classpath_resource : classpath_resources_) {
-    bool do_compress = compress;
-    if (do_compress && !options_->nocompress_suffixes.empty()) {
-      for (auto &suffix : options_->nocompress_suffixes) {
-        auto entry_name = classpath_resource->filename();
-        if (entry_name.length() >= suffix.size() &&
-            !entry_name.compare(entry_name.length() - suffix.size(),
-                                suffix.size(), suffix)) {
-          do_compress = false;
-          break;
-        }
-      }
-    }
+    bool do_compress =
+        compress && !options_->nocompress_suffix_set.Matches(
+                        classpath_resource->filename());
 
     // Add parent directory entries.
     size_t pos = classpath_resource->filename().find('/');
@@ -231,18 +256,42 @@ int OutputJar::Doit(Options *options) {
       pos = classpath_resource->filename().find('/', pos + 1);
     }
 
-    WriteEntry(classpath_resource->OutputEntry(do_compress));
+    WriteCombinedEntry(classpath_resource.get(), do_compress,
+                       deflater_.get());
   }
 
   // Then copy source files' contents.
-  for (int ix = 0; ix < options_->input_jars.size(); ++ix) {
-    if (!AddJar(ix)) {
-      exit(1);
-    }
+  if (incremental()) {
+    input_jar_digests_.resize(options_->input_jars.size());
+  }
+  jar_profiles_.resize(options_->input_jars.size());
+  if (!options_->cache_dir.empty()) {
+    cache_misses_.resize(options_->input_jars.size());
+  }
+  if (!options_->previous_output.empty() && !LoadPreviousOutput()) {
+    diag_warnx("%s:%d: Cannot reuse %s, building from scratch", __FILE__,
+               __LINE__, options_->previous_output.c_str());
+    previous_jars_.clear();
+    previous_entries_.clear();
+    previous_output_.Close();
   }
+  if (options_->threads > 1) {
+    compressor_.reset(new EntryCompressor(options_->threads,
+                                          options_->compression_level,
+                                          options_->compression_strategy));
+  }
+  phase_times_.open = SecondsSince(phase_start);
+  phase_start = std::chrono::steady_clock::now();
+  if (!AddJars()) {
+    exit(1);
+  }
+  phase_times_.scan = SecondsSince(phase_start);
 
   // All entries written, write Central Directory and close.
   Close();
+  if (!options_->profile.empty()) {
+    WriteProfile();
+  }
   return 0;
 }
 
@@ -250,18 +299,32 @@ OutputJar::~OutputJar() {
   if (file_) {
     diag_warnx("%s:%d: Close() should be called first", __FILE__, __LINE__);
   }
+  if (known_names_fd_ >= 0) {
+    close(known_names_fd_);
+  }
 }
 
 // Try to perform I/O in units of this size.
 // (128KB is the default max request size for fuse filesystems.)
 static const size_t kBufferSize = 128<<10;
 
+// The buffer for the output created in memory and written out along with
+// the input ranges. It can hold the largest local header.
+static const size_t kPatchBufferSize = 256 << 10;
+
+// With --mmap_output, the output file is preallocated and mapped in chunks
+// of at least this size.
+static const size_t kMinMappedSize = 1 << 20;
+
 bool OutputJar::Open() {
   if (file_) {
     diag_errx(1, "%s:%d: Cannot open output archive twice", __FILE__, __LINE__);
   }
   // Set execute bits since we may produce an executable output file.
-  int fd = open(path(), O_CREAT|O_WRONLY|O_TRUNC, 0777);
+  // Mapping the file for writing requires read access, too.
+  int fd = open(path(), O_CREAT | (options_->mmap_output ? O_RDWR : O_WRONLY) |
+                            O_TRUNC,
+                0777);
   if (fd < 0) {
     diag_warn("%s:%d: %s", __FILE__, __LINE__, path());
     return false;
@@ -273,23 +336,157 @@ bool OutputJar::Open() {
     return false;
   }
   outpos_ = 0;
-  buffer_.reset(new char[kBufferSize]);
-  setbuffer(file_, buffer_.get(), kBufferSize);
+  struct stat statbuf;
+  output_block_size_ = fstat(fd, &statbuf) ? 0 : statbuf.st_blksize;
+  patch_buffer_.reset(new uint8_t[kPatchBufferSize]);
+  if (options_->mmap_output) {
+    // Unless the entries are decompressed, the output is roughly as large
+    // as the inputs. If it turns out larger, the mapping grows.
+    size_t size = kMinMappedSize;
+    if (!options_->java_launcher.empty() &&
+        !stat(options_->java_launcher.c_str(), &statbuf)) {
+      size += statbuf.st_size;
+    }
+    for (auto &input_jar : options_->input_jars) {
+      if (!stat(input_jar.c_str(), &statbuf)) {
+        size += statbuf.st_size;
+      }
+    }
+    if (!MapOutput(size)) {
+      diag_warn("%s:%d: Cannot map %s, writing it instead", __FILE__,
+                __LINE__, path());
+      if (ftruncate(fd, 0)) {
+        diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path());
+      }
+    }
+  }
   if (options_->verbose) {
-    fprintf(stderr, "Writing to %s\n", path());
+    fprintf(stderr, "Writing to %s%s\n", path(),
+            mapped_output_ ? " (mapped)" : "");
   }
   return true;
 }
 
-bool OutputJar::AddJar(int jar_path_index) {
-  const std::string& input_jar_path = options_->input_jars[jar_path_index];
-  InputJar input_jar;
+bool OutputJar::AddJars() {
+  const int jar_count = options_->input_jars.size();
+  if (options_->threads <= 1 || jar_count <= 1) {
+    for (int ix = 0; ix < jar_count; ++ix) {
+      ScannedJar scanned_jar;
+      if (!ScanJar(ix, &scanned_jar) || !AddJar(ix, &scanned_jar)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The worker threads open input jars and scan their Central Directories
+  // while the main thread adds already scanned jars to the output. The jars
+  // are added strictly in the command line order, so that the first input
+  // jar containing given entry still wins, and the combiners see the
+  // entries in the same order. Scanning ahead is limited to keep the number
+  // of the simultaneously open input jars in check.
+  enum ScanState { kScanPending, kScanDone, kScanFailed };
+  const int scan_ahead = 4 * options_->threads;
+  std::vector<std::unique_ptr<ScannedJar>> scanned_jars(jar_count);
+  std::vector<ScanState> scan_states(jar_count, kScanPending);
+  std::mutex mutex;
+  std::condition_variable state_changed;
+  int next_to_scan = 0;
+  int next_to_add = 0;
+  bool stop = false;
+
+  auto scanner = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      state_changed.wait(lock, [&]() {
+        return stop || next_to_scan >= jar_count ||
+               next_to_scan < next_to_add + scan_ahead;
+      });
+      if (stop || next_to_scan >= jar_count) {
+        return;
+      }
+      int ix = next_to_scan++;
+      lock.unlock();
+      std::unique_ptr<ScannedJar> scanned_jar(new ScannedJar());
+      bool ok = ScanJar(ix, scanned_jar.get());
+      lock.lock();
+      if (ok) {
+        scanned_jars[ix] = std::move(scanned_jar);
+        scan_states[ix] = kScanDone;
+      } else {
+        scan_states[ix] = kScanFailed;
+      }
+      state_changed.notify_all();
+    }
+  };
+  std::vector<std::thread> scanners;
+  for (int i = 0; i < std::min(options_->threads, jar_count); ++i) {
+    scanners.emplace_back(scanner);
+  }
+
+  bool ok = true;
+  for (int ix = 0; ok && ix < jar_count; ++ix) {
+    std::unique_ptr<ScannedJar> scanned_jar;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      state_changed.wait(lock,
+                         [&]() { return scan_states[ix] != kScanPending; });
+      ok = scan_states[ix] == kScanDone;
+      scanned_jar = std::move(scanned_jars[ix]);
+      next_to_add = ix + 1;
+    }
+    state_changed.notify_all();
+    ok = ok && AddJar(ix, scanned_jar.get());
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop = true;
+  }
+  state_changed.notify_all();
+  for (auto &thread : scanners) {
+    thread.join();
+  }
+  return ok;
+}
+
+static std::string IndexOptions(const Options &options);
+
+// Returns the number of bytes an entry occupies in a jar: local header,
+// file data and data descriptor, if present.
+static size_t EntrySize(const CDH *cdh, const LH *lh) {
+  size_t num_bytes = lh->size();
+  if (cdh->no_size_in_local_header()) {
+    const DDR *ddr =
+        reinterpret_cast<const DDR *>(lh->data() + cdh->compressed_file_size());
+    num_bytes +=
+        cdh->compressed_file_size() +
+        ddr->size(ziph::zfield_has_ext64(cdh->compressed_file_size32()),
+                  ziph::zfield_has_ext64(cdh->uncompressed_file_size32()));
+  } else {
+    num_bytes += lh->compressed_file_size();
+  }
+  return num_bytes;
+}
+
+bool OutputJar::ScanJar(int jar_path_index, ScannedJar *scanned_jar) const {
+  const std::string &input_jar_path = options_->input_jars[jar_path_index];
+  auto start = std::chrono::steady_clock::now();
+  InputJar &input_jar = scanned_jar->input_jar;
   if (!input_jar.Open(input_jar_path)) {
     return false;
   }
+  // In the incremental mode, the digest of the Central Directory tells
+  // whether an input jar has changed since the previous output was created.
+  // With --cache_dir, it identifies the cache jar.
+  const bool need_digest = incremental() || !options_->cache_dir.empty();
+  blaze_util::Md5Digest md5;
   const CDH *jar_entry;
   const LH *lh;
   while ((jar_entry = input_jar.NextEntry(&lh))) {
+    if (need_digest) {
+      md5.Update(jar_entry, jar_entry->size());
+    }
     const char *file_name = jar_entry->file_name();
     auto file_name_length = jar_entry->file_name_length();
     if (!file_name_length) {
@@ -308,19 +505,83 @@ bool OutputJar::AddJar(int jar_path_index) {
       continue;
     }
 
-    bool include_entry = true;
-    if (!options_->include_prefixes.empty()) {
-      for (auto& prefix : options_->include_prefixes) {
-        if ((include_entry =
-                 (prefix.size() <= file_name_length &&
-                  0 == strncmp(file_name, prefix.c_str(), prefix.size())))) {
-          break;
-        }
+    if (!options_->include_prefix_set.empty() &&
+        !options_->include_prefix_set.Matches(file_name, file_name_length)) {
+      continue;
+    }
+
+    scanned_jar->entries.push_back(
+        {jar_entry, lh, EntrySize(jar_entry, lh), nullptr, nullptr});
+  }
+  if (need_digest) {
+    unsigned char digest[blaze_util::Md5Digest::kDigestLength];
+    md5.Finish(digest);
+    scanned_jar->digest = md5.String();
+  }
+  // The cache jar has the entries of this input jar which singlejar has
+  // created (e.g., recompressed) with the same options.
+  scanned_jar->cache_hit = false;
+  if (!options_->cache_dir.empty()) {
+    const std::string key = IndexOptions(*options_) + scanned_jar->digest;
+    blaze_util::Md5Digest key_md5;
+    key_md5.Update(key.data(), key.size());
+    unsigned char key_digest[blaze_util::Md5Digest::kDigestLength];
+    key_md5.Finish(key_digest);
+    scanned_jar->cache_path =
+        options_->cache_dir + "/" + key_md5.String() + ".jar";
+    if (access(scanned_jar->cache_path.c_str(), R_OK) == 0 &&
+        scanned_jar->cache_jar.Open(scanned_jar->cache_path)) {
+      scanned_jar->cache_hit = true;
+      const CDH *cdh;
+      while ((cdh = scanned_jar->cache_jar.NextEntry(&lh))) {
+        scanned_jar->cached_entries.Insert(cdh->file_name(),
+                                           cdh->file_name_length(), cdh);
       }
     }
-    if (!include_entry) {
-      continue;
+  }
+  scanned_jar->scan_seconds = SecondsSince(start);
+  return true;
+}
+
+bool OutputJar::AddJar(int jar_path_index, ScannedJar *scanned_jar) {
+  const std::string& input_jar_path = options_->input_jars[jar_path_index];
+  InputJar &input_jar = scanned_jar->input_jar;
+  auto start = std::chrono::steady_clock::now();
+  const int entries = entries_;
+  const uint64_t copied_bytes = copied_bytes_;
+  const uint64_t recompressed_bytes = recompressed_bytes_;
+  const int normalized_headers = normalized_headers_;
+  // When the entries are recompressed by compressor_, the entries following
+  // a recompressed one wait here until it has been written. A null pointer
+  // stands for an entry being recompressed.
+  std::deque<const ScannedJar::Entry *> pending;
+  // In the incremental mode, find out if this input jar was used to create
+  // the previous output and has not changed since.
+  int previous_jar_index = -1;
+  if (incremental()) {
+    input_jar_digests_[jar_path_index] = scanned_jar->digest;
+    for (size_t ix = 0; ix < previous_jars_.size(); ++ix) {
+      if (previous_jars_[ix].first == input_jar_path &&
+          previous_jars_[ix].second == scanned_jar->digest) {
+        previous_jar_index = static_cast<int>(ix);
+        break;
+      }
     }
+  }
+  auto write_pending = [&]() {
+    const ScannedJar::Entry *scanned_entry = pending.front();
+    pending.pop_front();
+    if (scanned_entry == nullptr) {
+      WriteEntry(compressor_->Next());
+    } else {
+      CopyEntry(input_jar_path, *scanned_jar, *scanned_entry);
+    }
+  };
+  for (auto &scanned_entry : scanned_jar->entries) {
+    const CDH *jar_entry = scanned_entry.cdh;
+    const LH *lh = scanned_entry.lh;
+    const char *file_name = jar_entry->file_name();
+    auto file_name_length = jar_entry->file_name_length();
 
     bool is_file = (file_name[file_name_length - 1] != '/');
     if (is_file &&
@@ -333,7 +594,7 @@ bool OutputJar::AddJar(int jar_path_index) {
         // The call to Merge() below will then take care of the rest.
         Concatenator *service_handler = new Concatenator(service_path);
         service_handlers_.emplace_back(service_handler);
-        known_members_.emplace(service_path, EntryInfo{service_handler});
+        known_members_.Insert(service_path, EntryInfo{service_handler});
       }
     } else {
       ExtraHandler(jar_entry);
@@ -344,15 +605,19 @@ bool OutputJar::AddJar(int jar_path_index) {
     // will add either a directory entry whose handler will ignore subsequent
     // duplicates, or an ordinary plain entry, for which we save the index of
     // the first input jar (in order to provide diagnostics on duplicate).
-    auto got =
-        known_members_.emplace(std::string(file_name, file_name_length),
-                               EntryInfo{is_file ? nullptr : &null_combiner_,
-                                         is_file ? jar_path_index: -1});
+    auto got = known_members_.Insert(
+        file_name, file_name_length,
+        EntryInfo{is_file ? nullptr : &null_combiner_,
+                  is_file ? jar_path_index : -1});
     if (!got.second) {
-      auto &entry_info = got.first->second;
+      auto &entry_info = *got.first;
       // Handle special entries (the ones that have a combiner).
       if (entry_info.combiner_ != nullptr) {
+        auto merge_start = std::chrono::steady_clock::now();
         entry_info.combiner_->Merge(jar_entry, lh);
+        auto &profile = combiner_profiles_[entry_info.combiner_];
+        ++profile.merged_entries;
+        profile.merge_seconds += SecondsSince(merge_start);
         continue;
       }
 
@@ -371,119 +636,209 @@ bool OutputJar::AddJar(int jar_path_index) {
       }
     }
 
+    // If the previous output has this entry copied from the same input jar,
+    // reuse it as is.
+    if (is_file && previous_jar_index >= 0) {
+      auto previous = previous_entries_.Find(file_name, file_name_length);
+      if (previous != nullptr && previous->jar_index == previous_jar_index &&
+          previous->cdh != nullptr) {
+        scanned_entry.previous_cdh = previous->cdh;
+      }
+    }
+
     // For the file entries, decide whether output should be compressed.
-    if (is_file) {
+    if (is_file && scanned_entry.previous_cdh == nullptr) {
       bool input_compressed =
           jar_entry->compression_method() != Z_NO_COMPRESSION;
       bool output_compressed =
           options_->force_compression ||
           (options_->preserve_compression && input_compressed);
-      if (output_compressed && !options_->nocompress_suffixes.empty()) {
-        for (auto &suffix : options_->nocompress_suffixes) {
-          if (file_name_length >= suffix.size() &&
-              !strncmp(file_name + file_name_length - suffix.size(),
-                       suffix.c_str(), suffix.size())) {
-            output_compressed = false;
-            break;
-          }
+      if (output_compressed &&
+          options_->nocompress_suffix_set.Matches(file_name,
+                                                  file_name_length)) {
+        output_compressed = false;
+      }
+      bool recompress = input_compressed != output_compressed;
+      if (recompress && !options_->cache_dir.empty()) {
+        // Reuse the entry created by an earlier run, or have it cached.
+        const CDH **cached_cdh = scanned_jar->cached_entries.Find(
+            file_name, file_name_length);
+        if (cached_cdh != nullptr) {
+          scanned_entry.cached_cdh = *cached_cdh;
+          recompress = false;
+        } else if (!scanned_jar->cache_hit) {
+          CacheMiss &cache_miss = cache_misses_[jar_path_index];
+          cache_miss.cache_path = scanned_jar->cache_path;
+          cache_miss.entries.emplace_back(file_name, file_name_length);
+        }
+      }
+      if (recompress && input_compressed &&
+          ziph::zfield_needs_ext64(jar_entry->uncompressed_file_size())) {
+        // Too large to be decompressed in memory.
+        while (!pending.empty()) {
+          write_pending();
         }
+        WriteInflatedEntry(jar_entry, lh);
+        ++recompressed_entries_;
+        recompressed_bytes_ += jar_entry->uncompressed_file_size();
+        continue;
       }
-      if (input_compressed != output_compressed) {
+      if (recompress) {
+        ++recompressed_entries_;
+        recompressed_bytes_ += jar_entry->uncompressed_file_size();
+        if (compressor_) {
+          compressor_->Submit([jar_entry, lh, output_compressed](
+              Inflater *inflater, Deflater *deflater) {
+            Concatenator combiner(jar_entry->file_name_string());
+            if (!combiner.Merge(jar_entry, lh, inflater)) {
+              diag_err(1, "%s:%d: cannot add %.*s", __FILE__, __LINE__,
+                       jar_entry->file_name_length(), jar_entry->file_name());
+            }
+            return combiner.OutputEntry(output_compressed, deflater);
+          });
+          pending.push_back(nullptr);
+          // Do not let the recompressed entries pile up in memory.
+          while (compressor_->pending() >=
+                 static_cast<size_t>(4 * options_->threads)) {
+            write_pending();
+          }
+          continue;
+        }
         Concatenator combiner(jar_entry->file_name_string());
         if (!combiner.Merge(jar_entry, lh)) {
           diag_err(1, "%s:%d: cannot add %.*s", __FILE__, __LINE__,
                    jar_entry->file_name_length(), jar_entry->file_name());
         }
-        WriteEntry(combiner.OutputEntry(output_compressed));
+        WriteEntry(combiner.OutputEntry(output_compressed, deflater_.get()));
         continue;
       }
     }
 
-    // Now we have to copy:
-    //  local header
-    //  file data
-    //  data descriptor, if present.
-    off_t copy_from = jar_entry->local_header_offset();
-    size_t num_bytes = lh->size();
-    if (jar_entry->no_size_in_local_header()) {
-      const DDR *ddr = reinterpret_cast<const DDR *>(
-          lh->data() + jar_entry->compressed_file_size());
-      num_bytes +=
-          jar_entry->compressed_file_size() +
-          ddr->size(
-              ziph::zfield_has_ext64(jar_entry->compressed_file_size32()),
-              ziph::zfield_has_ext64(jar_entry->uncompressed_file_size32()));
+    if (pending.empty()) {
+      CopyEntry(input_jar_path, *scanned_jar, scanned_entry);
     } else {
-      num_bytes += lh->compressed_file_size();
-    }
-    off_t local_header_offset = Position();
-
-    // When normalize_timestamps is set, entry's timestamp is to be set to
-    // 01/01/1980 00:00:00 (or to 01/01/1980 00:00:02, if an entry is a .class
-    // file). This is somewhat expensive because we have to copy the local
-    // header to memory as input jar is memory mapped as read-only. Try to copy
-    // as little as possible.
-    uint16_t normalized_time = 0;
-    const UnixTimeExtraField *lh_field_to_remove = nullptr;
-    bool fix_timestamp = false;
-    if (options_->normalize_timestamps) {
-      if (ends_with(file_name, file_name_length, ".class")) {
-        normalized_time = 1;
-      }
-      lh_field_to_remove = lh->unix_time_extra_field();
-      fix_timestamp = jar_entry->last_mod_file_date() != 33 ||
-                      jar_entry->last_mod_file_time() != normalized_time ||
-                      lh_field_to_remove != nullptr;
+      pending.push_back(&scanned_entry);
     }
-    if (fix_timestamp) {
-      uint8_t lh_buffer[512];
-      size_t lh_size = lh->size();
-      LH *lh_new = lh_size > sizeof(lh_buffer)
-                       ? reinterpret_cast<LH *>(malloc(lh_size))
-                       : reinterpret_cast<LH *>(lh_buffer);
-      // Remove Unix timestamp field.
-      if (lh_field_to_remove != nullptr) {
-        auto from_end = ziph::byte_ptr(lh) + lh->size();
-        size_t removed_size = lh_field_to_remove->size();
-        size_t chunk1_size =
-            ziph::byte_ptr(lh_field_to_remove) - ziph::byte_ptr(lh);
-        size_t chunk2_size = lh->size() - (chunk1_size + removed_size);
-        memcpy(lh_new, lh, chunk1_size);
-        if (chunk2_size) {
-          memcpy(reinterpret_cast<uint8_t *>(lh_new) + chunk1_size,
-                 from_end - chunk2_size, chunk2_size);
-        }
-        lh_new->extra_fields(lh_new->extra_fields(),
-                             lh->extra_fields_length() - removed_size);
-      } else {
-        memcpy(lh_new, lh, lh_size);
-      }
-      lh_new->last_mod_file_date(33);
-      lh_new->last_mod_file_time(normalized_time);
-      // Now write these few bytes and adjust read/write positions accordingly.
-      if (!WriteBytes(lh_new, lh_new->size())) {
-        diag_err(1, "%s:%d: Cannot copy modified local header for %.*s",
-                 __FILE__, __LINE__, file_name_length, file_name);
-      }
-      copy_from += lh_size;
-      num_bytes -= lh_size;
-      if (reinterpret_cast<uint8_t *>(lh_new) != lh_buffer) {
-        free(lh_new);
+  }
+  while (!pending.empty()) {
+    write_pending();
+  }
+  // The gathered output may point to this input jar, write it out before
+  // the jar is unmapped.
+  FlushInputRange();
+  if (!gather_.empty()) {
+    FlushGather();
+  }
+  JarProfile &profile = jar_profiles_[jar_path_index];
+  profile.scan_seconds = scanned_jar->scan_seconds;
+  profile.add_seconds = SecondsSince(start);
+  profile.entries = entries_ - entries;
+  profile.copied_bytes = copied_bytes_ - copied_bytes;
+  profile.recompressed_bytes = recompressed_bytes_ - recompressed_bytes;
+  profile.normalized_headers = normalized_headers_ - normalized_headers;
+  if (scanned_jar->cache_hit) {
+    scanned_jar->cache_jar.Close();
+  }
+  return input_jar.Close();
+}
+
+// Copies input jar entry as is, with the exception of the timestamp which
+// might need to be normalized.
+void OutputJar::CopyEntry(const std::string &input_jar_path,
+                          const ScannedJar &scanned_jar,
+                          const ScannedJar::Entry &scanned_entry) {
+  if (scanned_entry.previous_cdh != nullptr) {
+    ReuseEntry(previous_output_, options_->previous_output,
+               scanned_entry.previous_cdh);
+    ++reused_entries_;
+    return;
+  }
+  if (scanned_entry.cached_cdh != nullptr) {
+    ReuseEntry(scanned_jar.cache_jar, scanned_jar.cache_path,
+               scanned_entry.cached_cdh);
+    ++cached_entries_;
+    return;
+  }
+
+  const InputJar &input_jar = scanned_jar.input_jar;
+  const CDH *jar_entry = scanned_entry.cdh;
+  const LH *lh = scanned_entry.lh;
+  const char *file_name = jar_entry->file_name();
+  auto file_name_length = jar_entry->file_name_length();
+
+  // Now we have to copy the local header, file data and data descriptor.
+  off_t copy_from = jar_entry->local_header_offset();
+  size_t num_bytes = scanned_entry.num_bytes;
+  off_t local_header_offset = Position();
+  copied_bytes_ += num_bytes;
+
+  // When normalize_timestamps is set, entry's timestamp is to be set to
+  // 01/01/1980 00:00:00 (or to 01/01/1980 00:00:02, if an entry is a .class
+  // file). This is somewhat expensive because we have to copy the local
+  // header to memory as input jar is memory mapped as read-only. Try to copy
+  // as little as possible.
+  uint16_t normalized_time = 0;
+  const UnixTimeExtraField *lh_field_to_remove = nullptr;
+  bool fix_timestamp = false;
+  if (options_->normalize_timestamps) {
+    if (ends_with(file_name, file_name_length, ".class")) {
+      normalized_time = 1;
+    }
+    lh_field_to_remove = lh->unix_time_extra_field();
+    fix_timestamp = jar_entry->last_mod_file_date() != 33 ||
+                    jar_entry->last_mod_file_time() != normalized_time ||
+                    lh_field_to_remove != nullptr;
+  }
+  if (fix_timestamp) {
+    // The new local header is created in the patch buffer and written out
+    // along with the preceding and following input ranges.
+    size_t lh_size = lh->size();
+    LH *lh_new = reinterpret_cast<LH *>(ReservePatch(lh_size));
+    // Remove Unix timestamp field.
+    if (lh_field_to_remove != nullptr) {
+      auto from_end = ziph::byte_ptr(lh) + lh->size();
+      size_t removed_size = lh_field_to_remove->size();
+      size_t chunk1_size =
+          ziph::byte_ptr(lh_field_to_remove) - ziph::byte_ptr(lh);
+      size_t chunk2_size = lh->size() - (chunk1_size + removed_size);
+      memcpy(lh_new, lh, chunk1_size);
+      if (chunk2_size) {
+        memcpy(reinterpret_cast<uint8_t *>(lh_new) + chunk1_size,
+               from_end - chunk2_size, chunk2_size);
       }
+      lh_new->extra_fields(lh_new->extra_fields(),
+                           lh->extra_fields_length() - removed_size);
+    } else {
+      memcpy(lh_new, lh, lh_size);
     }
+    lh_new->last_mod_file_date(33);
+    lh_new->last_mod_file_time(normalized_time);
+    // Append the new header and skip the original one.
+    CommitPatch(lh_new->size());
+    copy_from += lh_size;
+    num_bytes -= lh_size;
+    ++normalized_headers_;
+  }
 
-    // Do the actual copy.
-    if (!WriteBytes(input_jar.mapped_start() + copy_from, num_bytes)) {
-      diag_err(1, "%s:%d: Cannot write %ld bytes of %.*s from %s", __FILE__,
-               __LINE__, num_bytes, file_name_length, file_name,
-               input_jar_path.c_str());
-    }
+  // Do the actual copy.
+  AppendInputRange(input_jar, input_jar_path, copy_from, num_bytes);
 
-    AppendToDirectoryBuffer(jar_entry, local_header_offset, normalized_time,
-                            fix_timestamp);
-    ++entries_;
-  }
-  return input_jar.Close();
+  AppendToDirectoryBuffer(jar_entry, local_header_offset, normalized_time,
+                          fix_timestamp);
+  ++entries_;
+}
+
+// The entry in the previous output or in a cache jar has been already
+// processed (its timestamp normalized, etc.), so it is copied verbatim.
+void OutputJar::ReuseEntry(const InputJar &jar, const std::string &jar_path,
+                           const CDH *cdh) {
+  const LH *lh = jar.LocalHeader(cdh);
+  off_t local_header_offset = Position();
+  size_t num_bytes = EntrySize(cdh, lh);
+  AppendInputRange(jar, jar_path, jar.LocalHeaderOffset(lh), num_bytes);
+  copied_bytes_ += num_bytes;
+  AppendToDirectoryBuffer(cdh, local_header_offset, 0, false);
+  ++entries_;
 }
 
 off_t OutputJar::Position() {
@@ -513,6 +868,16 @@ void OutputJar::WriteEntry(void *buffer) {
             entry->compressed_file_size());
   }
 
+  off_t output_position = WriteLocalHeader(entry);
+  if (!WriteBytes(entry->data(), entry->in_zip_size())) {
+    diag_err(1, "%s:%d: write", __FILE__, __LINE__);
+  }
+  AppendLocalHeaderToDirectoryBuffer(entry, output_position);
+  ++entries_;
+  free(reinterpret_cast<void *>(entry));
+}
+
+off_t OutputJar::WriteLocalHeader(LH *entry) {
   // Set this entry's timestamp.
   // MSDOS file timestamp format that Zip uses is described here:
   // https://msdn.microsoft.com/en-us/library/9kkf9tah.aspx
@@ -537,57 +902,299 @@ void OutputJar::WriteEntry(void *buffer) {
     entry->last_mod_file_date(dos_date);
   }
 
-  uint8_t *data = reinterpret_cast<uint8_t *>(entry);
   off_t output_position = Position();
-  if (!WriteBytes(data, entry->data() + entry->in_zip_size() - data)) {
+  if (!WriteBytes(entry, entry->size())) {
     diag_err(1, "%s:%d: write", __FILE__, __LINE__);
   }
-  // Data written, allocate CDH space and populate CDH.
-  // Space needed for the CDH varies depending on whether output position field
-  // fits into 32 bits (we do not handle compressed/uncompressed entry sizes
-  // exceeding 32 bits at the moment).
-  uint16_t zip64_size = ziph::zfield_needs_ext64(output_position)
-                            ? Zip64ExtraField::space_needed(1)
-                            : 0;
-  CDH *cdh = reinterpret_cast<CDH *>(
-      ReserveCdh(sizeof(CDH) + entry->file_name_length() +
-                 entry->extra_fields_length() + zip64_size));
+  return output_position;
+}
+
+void OutputJar::AppendLocalHeaderToDirectoryBuffer(const LH *entry,
+                                                   off_t output_position) {
+  // The CDH has Zip64 extra field if the uncompressed size, compressed size
+  // or output position do not fit into 32 bits. It contains 64-bit values
+  // of just these fields, in this order. The Zip64 extra field of the local
+  // header, if any, is not copied: it always has both sizes.
+  const uint64_t uncompressed_size = entry->uncompressed_file_size();
+  const uint64_t compressed_size = entry->compressed_file_size();
+  const bool uncompressed_size_needs64 =
+      ziph::zfield_needs_ext64(uncompressed_size);
+  const bool compressed_size_needs64 =
+      ziph::zfield_needs_ext64(compressed_size);
+  const bool output_position_needs64 =
+      ziph::zfield_needs_ext64(output_position);
+  const int zip64_attr_count = uncompressed_size_needs64 +
+                               compressed_size_needs64 +
+                               output_position_needs64;
+  const uint16_t zip64_size =
+      zip64_attr_count ? Zip64ExtraField::space_needed(zip64_attr_count) : 0;
+  const Zip64ExtraField *lh_zip64_ef = entry->zip64_extra_field();
+  const uint16_t lh_zip64_size =
+      lh_zip64_ef == nullptr ? 0 : lh_zip64_ef->size();
+  CDH *cdh = reinterpret_cast<CDH *>(ReserveCdh(
+      sizeof(CDH) + entry->file_name_length() + entry->extra_fields_length() -
+      lh_zip64_size + zip64_size));
   cdh->signature();
   // Note: do not set the version to Unix 3.0 spec, otherwise
   // unzip will think that 'external_attributes' field contains access mode
   cdh->version(20);
-  cdh->version_to_extract(20);  // 2.0
-  cdh->bit_flag(0x0);
+  cdh->version_to_extract(zip64_attr_count ? 45 : 20);  // 4.5 or 2.0
+  cdh->bit_flag(entry->bit_flag());
   cdh->compression_method(entry->compression_method());
   cdh->last_mod_file_time(entry->last_mod_file_time());
   cdh->last_mod_file_date(entry->last_mod_file_date());
   cdh->crc32(entry->crc32());
-  TODO(entry->compressed_file_size32() != 0xFFFFFFFF, "Handle Zip64");
-  cdh->compressed_file_size32(entry->compressed_file_size32());
-  TODO(entry->uncompressed_file_size32() != 0xFFFFFFFF, "Handle Zip64");
-  cdh->uncompressed_file_size32(entry->uncompressed_file_size32());
+  cdh->compressed_file_size32(compressed_size_needs64 ? 0xFFFFFFFF
+                                                      : compressed_size);
+  cdh->uncompressed_file_size32(uncompressed_size_needs64 ? 0xFFFFFFFF
+                                                          : uncompressed_size);
+  cdh->local_header_offset32(output_position_needs64 ? 0xFFFFFFFF
+                                                     : output_position);
   cdh->file_name(entry->file_name(), entry->file_name_length());
-  cdh->extra_fields(entry->extra_fields(), entry->extra_fields_length());
+  uint8_t *out_ef = cdh->extra_fields();
+  auto ef_end = reinterpret_cast<const ExtraField *>(
+      entry->extra_fields() + entry->extra_fields_length());
+  for (auto ef = reinterpret_cast<const ExtraField *>(entry->extra_fields());
+       ef < ef_end; ef = ef->next()) {
+    if (!ef->is_zip64()) {
+      memcpy(out_ef, ef, ef->size());
+      out_ef += ef->size();
+    }
+  }
   if (zip64_size > 0) {
-    Zip64ExtraField *zip64_ef = reinterpret_cast<Zip64ExtraField *>(
-        cdh->extra_fields() + cdh->extra_fields_length());
+    Zip64ExtraField *zip64_ef = reinterpret_cast<Zip64ExtraField *>(out_ef);
     zip64_ef->signature();
-    zip64_ef->attr_count(1);
-    zip64_ef->attr64(0, output_position);
-    cdh->local_header_offset32(0xFFFFFFFF);
-    // Field address argument points to the already existing field,
-    // so the call just updates the length.
-    cdh->extra_fields(cdh->extra_fields(),
-                      cdh->extra_fields_length() + zip64_size);
-  } else {
-    cdh->local_header_offset32(output_position);
+    zip64_ef->attr_count(zip64_attr_count);
+    int attr_no = 0;
+    if (uncompressed_size_needs64) {
+      zip64_ef->attr64(attr_no++, uncompressed_size);
+    }
+    if (compressed_size_needs64) {
+      zip64_ef->attr64(attr_no++, compressed_size);
+    }
+    if (output_position_needs64) {
+      zip64_ef->attr64(attr_no++, output_position);
+    }
+    out_ef += zip64_size;
   }
+  // Field address argument points to the already existing fields,
+  // so the call just updates the length.
+  cdh->extra_fields(cdh->extra_fields(), out_ef - cdh->extra_fields());
   cdh->comment_length(0);
   cdh->start_disk_nr(0);
   cdh->internal_attributes(0);
   cdh->external_attributes(0);
+}
+
+// Decompresses the entry straight to the output. Unlike recompressing it
+// with a Concatenator, this does not need memory for the whole contents,
+// so this is how the entries too large to be held in memory are handled.
+// The checksum and the size are known from the Central Directory.
+void OutputJar::WriteInflatedEntry(const CDH *cdh, const LH *lh) {
+  const uint64_t uncompressed_size = cdh->uncompressed_file_size();
+  uint8_t zip64_buffer[sizeof(Zip64ExtraField) + 2 * sizeof(uint64_t)];
+  Zip64ExtraField *zip64_ef =
+      reinterpret_cast<Zip64ExtraField *>(zip64_buffer);
+  zip64_ef->signature();
+  zip64_ef->attr_count(2);
+  zip64_ef->attr64(0, uncompressed_size);
+  zip64_ef->attr64(1, uncompressed_size);
+  std::unique_ptr<uint8_t[]> lh_buffer(
+      new uint8_t[sizeof(LH) + cdh->file_name_length() + sizeof(zip64_buffer)]);
+  LH *out_lh = reinterpret_cast<LH *>(lh_buffer.get());
+  out_lh->signature();
+  out_lh->version(45);  // 4.5 (Zip64 support)
+  out_lh->bit_flag(0);
+  out_lh->compression_method(Z_NO_COMPRESSION);
+  out_lh->crc32(cdh->crc32());
+  out_lh->compressed_file_size32(0xFFFFFFFF);
+  out_lh->uncompressed_file_size32(0xFFFFFFFF);
+  out_lh->file_name(cdh->file_name(), cdh->file_name_length());
+  out_lh->extra_fields(zip64_buffer, zip64_ef->size());
+  if (options_->verbose) {
+    fprintf(stderr, "%-.*s has %" PRIu64 " bytes, decompressed\n",
+            cdh->file_name_length(), cdh->file_name(), uncompressed_size);
+  }
+  off_t output_position = WriteLocalHeader(out_lh);
+
+  Inflater inflater;
+  std::unique_ptr<uint8_t[]> buffer(new uint8_t[kBufferSize]);
+  const uint8_t *data = lh->data();
+  for (uint64_t in_bytes = cdh->compressed_file_size(); in_bytes > 0;) {
+    // A single region to inflate cannot exceed 4GB-1.
+    uint32_t in_bytes_chunk =
+        std::min(in_bytes, static_cast<uint64_t>(0xFFFFFFFF));
+    inflater.DataToInflate(data, in_bytes_chunk);
+    for (;;) {
+      int ret = inflater.Inflate(buffer.get(), kBufferSize);
+      size_t inflated = kBufferSize - inflater.available_out();
+      if (inflated && !WriteBytes(buffer.get(), inflated)) {
+        diag_err(1, "%s:%d: write", __FILE__, __LINE__);
+      }
+      if (ret == Z_STREAM_END ||
+          (ret == Z_OK && inflater.available_out()) || ret == Z_BUF_ERROR) {
+        // Either done or this input chunk has been consumed.
+        break;
+      } else if (ret != Z_OK) {
+        diag_errx(2, "%s:%d: Cannot inflate %.*s: %d (%s)", __FILE__,
+                  __LINE__, cdh->file_name_length(), cdh->file_name(), ret,
+                  inflater.error_message());
+      }
+    }
+    data += in_bytes_chunk;
+    in_bytes -= in_bytes_chunk;
+  }
+  if (inflater.total_out() != uncompressed_size) {
+    diag_errx(2,
+              "%s:%d: Inflated %.*s to %" PRIu64 " bytes, expected %" PRIu64,
+              __FILE__, __LINE__, cdh->file_name_length(), cdh->file_name(),
+              inflater.total_out(), uncompressed_size);
+  }
+  AppendLocalHeaderToDirectoryBuffer(out_lh, output_position);
+  ++entries_;
+}
+
+// The combined entries at least this large are written by StreamEntry.
+static const uint64_t kMinStreamedEntrySize = 1 << 20;
+
+// Returns the output entry of the given combiner created in memory, unless
+// it is large. Then returns null, setting 'name' and 'contents' so that the
+// caller can stream the entry out.
+static void *CreateCombinedEntry(Combiner *combiner, bool compress,
+                                 Deflater *deflater, std::string *name,
+                                 TransientBytes **contents) {
+  *contents = combiner->OutputContents(name);
+  if (*contents == nullptr) {
+    return combiner->OutputEntry(compress, deflater);
+  }
+  if ((*contents)->data_size() < kMinStreamedEntrySize) {
+    void *entry =
+        Concatenator::CreateEntry(*name, *contents, compress, deflater);
+    *contents = nullptr;
+    return entry;
+  }
+  return nullptr;
+}
+
+// Writes the entry piece by piece, so that neither the compressed nor the
+// uncompressed copy of the contents is created. A deflated entry is followed
+// by the data descriptor with its checksum and sizes. A stored entry has to
+// have them in the local header, so the checksum is computed beforehand.
+// Unlike Concatenator::CreateEntry, this does not store the entry if
+// compression does not help.
+void OutputJar::StreamEntry(const std::string &name, TransientBytes *contents,
+                            bool compress, Deflater *deflater) {
+  const uint64_t uncompressed_size = contents->data_size();
+  std::unique_ptr<Deflater> own_deflater;
+  if (compress) {
+    if (deflater == nullptr) {
+      own_deflater.reset(new Deflater());
+      deflater = own_deflater.get();
+    } else {
+      deflater->reset();
+    }
+    // The data descriptor written below has 32-bit sizes.
+    compress = !ziph::zfield_needs_ext64(
+        deflateBound(deflater, uncompressed_size));
+  }
+
+  uint8_t zip64_buffer[sizeof(Zip64ExtraField) + 2 * sizeof(uint64_t)];
+  std::unique_ptr<uint8_t[]> lh_buffer(
+      new uint8_t[sizeof(LH) + name.size() + sizeof(zip64_buffer)]);
+  LH *lh = reinterpret_cast<LH *>(lh_buffer.get());
+  lh->signature();
+  lh->version(20);
+  lh->file_name(name.data(), name.size());
+  lh->extra_fields(nullptr, 0);
+  uint32_t checksum = 0;
+  if (compress) {
+    lh->bit_flag(0x08);  // The checksum and sizes follow the data.
+    lh->compression_method(Z_DEFLATED);
+    lh->crc32(0);
+    lh->compressed_file_size32(0);
+    lh->uncompressed_file_size32(0);
+  } else {
+    contents->stream_out([&checksum](const void *chunk, uint64_t chunk_size) {
+      checksum = crc32(checksum, reinterpret_cast<const Bytef *>(chunk),
+                       chunk_size);
+    });
+    lh->bit_flag(0);
+    lh->compression_method(Z_NO_COMPRESSION);
+    lh->crc32(checksum);
+    if (ziph::zfield_needs_ext64(uncompressed_size)) {
+      Zip64ExtraField *zip64_ef =
+          reinterpret_cast<Zip64ExtraField *>(zip64_buffer);
+      zip64_ef->signature();
+      zip64_ef->attr_count(2);
+      zip64_ef->attr64(0, uncompressed_size);
+      zip64_ef->attr64(1, uncompressed_size);
+      lh->version(45);  // 4.5 (Zip64 support)
+      lh->compressed_file_size32(0xFFFFFFFF);
+      lh->uncompressed_file_size32(0xFFFFFFFF);
+      lh->extra_fields(zip64_buffer, zip64_ef->size());
+    } else {
+      lh->compressed_file_size32(uncompressed_size);
+      lh->uncompressed_file_size32(uncompressed_size);
+    }
+  }
+  off_t output_position = WriteLocalHeader(lh);
+
+  uint64_t compressed_size = uncompressed_size;
+  if (compress) {
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[kBufferSize]);
+    // Deflates given bytes, writing out the compressed ones as the buffer
+    // fills up.
+    auto deflate_chunk = [this, deflater, &buffer, &name](
+                             const uint8_t *data, uint32_t data_size,
+                             int flush) {
+      deflater->next_in = const_cast<uint8_t *>(data);
+      deflater->avail_in = data_size;
+      do {
+        deflater->next_out = buffer.get();
+        deflater->avail_out = kBufferSize;
+        int ret = deflate(deflater, flush);
+        if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+          diag_errx(2, "%s:%d: Cannot deflate %s: %d (%s)", __FILE__,
+                    __LINE__, name.c_str(), ret, deflater->msg);
+        }
+        size_t deflated = kBufferSize - deflater->avail_out;
+        if (deflated && !WriteBytes(buffer.get(), deflated)) {
+          diag_err(1, "%s:%d: write", __FILE__, __LINE__);
+        }
+      } while (deflater->avail_out == 0);
+    };
+    contents->stream_out([&checksum, &deflate_chunk](const void *chunk,
+                                                     uint64_t chunk_size) {
+      const uint8_t *data = reinterpret_cast<const uint8_t *>(chunk);
+      checksum = crc32(checksum, data, chunk_size);
+      deflate_chunk(data, chunk_size, Z_NO_FLUSH);
+    });
+    deflate_chunk(nullptr, 0, Z_FINISH);
+    compressed_size = deflater->total_out;
+    const uint32_t data_descriptor[] = {
+        htole32(0x08074b50), htole32(checksum),
+        htole32(static_cast<uint32_t>(compressed_size)),
+        htole32(static_cast<uint32_t>(uncompressed_size))};
+    if (!WriteBytes(data_descriptor, sizeof(data_descriptor))) {
+      diag_err(1, "%s:%d: write", __FILE__, __LINE__);
+    }
+    lh->crc32(checksum);
+    lh->compressed_file_size32(compressed_size);
+    lh->uncompressed_file_size32(uncompressed_size);
+  } else {
+    contents->stream_out([this](const void *chunk, uint64_t chunk_size) {
+      if (!WriteBytes(chunk, chunk_size)) {
+        diag_err(1, "%s:%d: write", __FILE__, __LINE__);
+      }
+    });
+  }
+  if (options_->verbose) {
+    fprintf(stderr, "%s combiner has %" PRIu64 " bytes, %s to %" PRIu64 "\n",
+            name.c_str(), uncompressed_size,
+            compress ? "streamed compressed" : "streamed", compressed_size);
+  }
+  AppendLocalHeaderToDirectoryBuffer(lh, output_position);
   ++entries_;
-  free(reinterpret_cast<void *>(entry));
 }
 
 void OutputJar::WriteMetaInf() {
@@ -618,7 +1225,7 @@ void OutputJar::WriteDirEntry(const std::string &name,
   lh->uncompressed_file_size32(0);
   lh->file_name(name.c_str(), name.size());
   lh->extra_fields(extra_fields, n_extra_fields);
-  known_members_.emplace(name, EntryInfo{&null_combiner_});
+  known_members_.Insert(name, EntryInfo{&null_combiner_});
   WriteEntry(lh);
 }
 
@@ -641,11 +1248,24 @@ void OutputJar::AppendToDirectoryBuffer(const CDH *cdh, off_t lh_pos,
     }
   }
 
+  // Usually the extra fields remain the same, and the CDH is copied at once.
+  const Zip64ExtraField *zip64_ef = cdh->zip64_extra_field();
+  const bool lh_pos_needs64 = ziph::zfield_needs_ext64(lh_pos);
+  if (removed_unix_time_field_size == 0 && zip64_ef == nullptr &&
+      !lh_pos_needs64) {
+    CDH *out_cdh = reinterpret_cast<CDH *>(ReserveCdr(cdh->size()));
+    memcpy(out_cdh, cdh, cdh->size());
+    out_cdh->local_header_offset32(lh_pos);
+    if (fix_timestamp) {
+      out_cdh->last_mod_file_time(normalized_time);
+      out_cdh->last_mod_file_date(33);
+    }
+    return;
+  }
+
   // 2. Figure out how many attributes input entry has and how many
   // the output entry is going to have.
-  const Zip64ExtraField *zip64_ef = cdh->zip64_extra_field();
   const int zip64_attr_count = zip64_ef == nullptr ? 0 : zip64_ef->attr_count();
-  const bool lh_pos_needs64 = ziph::zfield_needs_ext64(lh_pos);
   size_t out_zip64_attr_count;
   if (zip64_attr_count > 0) {
     out_zip64_attr_count = zip64_attr_count;
@@ -731,8 +1351,21 @@ void OutputJar::AppendToDirectoryBuffer(const CDH *cdh, off_t lh_pos,
 }
 
 uint8_t *OutputJar::ReserveCdr(size_t chunk_size) {
+  // With --cen_buffer_mb, the buffer does not grow beyond given size,
+  // the records which are already there are moved to a temporary file
+  // instead. Thus the pointers returned by this method are valid only
+  // until it is called again.
+  const size_t cen_buffer_limit =
+      static_cast<size_t>(options_->cen_buffer_mb) << 20;
+  if (cen_buffer_limit && cen_size_ &&
+      cen_size_ + chunk_size > cen_buffer_limit) {
+    SpillCen();
+  }
   if (cen_size_ + chunk_size > cen_capacity_) {
     cen_capacity_ += 1000000;
+    if (cen_buffer_limit && cen_capacity_ > cen_buffer_limit) {
+      cen_capacity_ = std::max(cen_buffer_limit, cen_size_ + chunk_size);
+    }
     cen_ = reinterpret_cast<uint8_t *>(realloc(cen_, cen_capacity_));
     if (!cen_) {
       diag_errx(1, "%s:%d: Cannot allocate %ld bytes for the directory",
@@ -748,32 +1381,109 @@ uint8_t *OutputJar::ReserveCdh(size_t size) {
   return static_cast<uint8_t *>(memset(ReserveCdr(size), 0, size));
 }
 
+int OutputJar::CreateTempFile(const char *suffix) {
+  // Create it next to the output rather than in /tmp, which may well be
+  // in memory.
+  std::string path = options_->output_jar + suffix + ".XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0 || unlink(path.c_str())) {
+    diag_err(1, "%s:%d: Cannot create %s", __FILE__, __LINE__, path.c_str());
+  }
+  return fd;
+}
+
+void OutputJar::SpillCen() {
+  if (cen_spill_ == nullptr &&
+      (cen_spill_ = fdopen(CreateTempFile(".cen"), "w+")) == nullptr) {
+    diag_err(1, "%s:%d: Cannot spill central directory", __FILE__, __LINE__);
+  }
+  if (fwrite(cen_, 1, cen_size_, cen_spill_) != cen_size_) {
+    diag_err(1, "%s:%d: Cannot spill central directory", __FILE__, __LINE__);
+  }
+  cen_spilled_ += cen_size_;
+  cen_size_ = 0;
+}
+
 // Write out combined jar.
 bool OutputJar::Close() {
   if (file_ == nullptr) {
     return true;
   }
 
+  std::vector<Combiner *> combiners;
   for (auto &service_handler : service_handlers_) {
-    WriteEntry(service_handler->OutputEntry(options_->force_compression));
+    combiners.push_back(service_handler.get());
   }
   for (auto &extra_combiner : extra_combiners_) {
-    WriteEntry(extra_combiner->OutputEntry(options_->force_compression));
+    combiners.push_back(extra_combiner.get());
   }
-  WriteEntry(spring_handlers_.OutputEntry(options_->force_compression));
-  WriteEntry(spring_schemas_.OutputEntry(options_->force_compression));
-  WriteEntry(protobuf_meta_handler_.OutputEntry(options_->force_compression));
+  combiners.push_back(&spring_handlers_);
+  combiners.push_back(&spring_schemas_);
+  combiners.push_back(&protobuf_meta_handler_);
+  const bool compress = options_->force_compression;
+  auto phase_start = std::chrono::steady_clock::now();
+  if (compressor_) {
+    // Combiners are independent of each other, so their output entries can
+    // be created concurrently.
+    struct StreamedEntry {
+      std::string name;
+      TransientBytes *contents;
+    };
+    // A deque, so that the workers' pointers to its elements stay valid.
+    std::deque<StreamedEntry> streamed;
+    for (auto combiner : combiners) {
+      // The profile entries are created here so that the workers do not
+      // modify combiner_profiles_.
+      CombinerProfile *profile = &combiner_profiles_[combiner];
+      streamed.emplace_back();
+      StreamedEntry *streamed_entry = &streamed.back();
+      compressor_->Submit([combiner, compress, profile, streamed_entry](
+                              Inflater *, Deflater *deflater) {
+        auto start = std::chrono::steady_clock::now();
+        void *entry = CreateCombinedEntry(combiner, compress, deflater,
+                                          &streamed_entry->name,
+                                          &streamed_entry->contents);
+        profile->output_seconds += SecondsSince(start);
+        return entry;
+      });
+    }
+    // The large entries are streamed out here, in order.
+    for (size_t i = 0; i < combiners.size(); ++i) {
+      void *entry = compressor_->Next();
+      if (streamed[i].contents != nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        StreamEntry(streamed[i].name, streamed[i].contents, compress,
+                    deflater_.get());
+        combiner_profiles_[combiners[i]].output_seconds += SecondsSince(start);
+      } else {
+        WriteEntry(entry);
+      }
+    }
+    compressor_.reset();
+  } else {
+    for (auto combiner : combiners) {
+      WriteCombinedEntry(combiner, compress, deflater_.get());
+    }
+  }
+  phase_times_.combine = SecondsSince(phase_start);
+  phase_start = std::chrono::steady_clock::now();
   // TODO(asmundak): handle manifest;
   off_t output_position = Position();
+  // Save it before ReserveCdh updates it.
+  size_t cen_size = cen_spilled_ + cen_size_;
   bool write_zip64_ecd = output_position >= 0xFFFFFFFF || entries_ >= 0xFFFF ||
-                         cen_size_ >= 0xFFFFFFFF;
+                         cen_size >= 0xFFFFFFFF;
 
-  size_t cen_size = cen_size_;  // Save it before ReserveCdh updates it.
   if (write_zip64_ecd) {
-    ECD64 *ecd64 = reinterpret_cast<ECD64 *>(ReserveCdh(sizeof(ECD64)));
+    // Reserve all three records at once: the buffer may be spilled
+    // between the calls to ReserveCdh.
+    uint8_t *ecd_records = ReserveCdh(sizeof(ECD64) + sizeof(ECD64Locator) +
+                                      sizeof(ECD));
+    ECD64 *ecd64 = reinterpret_cast<ECD64 *>(ecd_records);
     ECD64Locator *ecd64_locator =
-        reinterpret_cast<ECD64Locator *>(ReserveCdh(sizeof(ECD64Locator)));
-    ECD *ecd = reinterpret_cast<ECD *>(ReserveCdh(sizeof(ECD)));
+        reinterpret_cast<ECD64Locator *>(ecd_records + sizeof(ECD64));
+    ECD *ecd = reinterpret_cast<ECD *>(ecd_records + sizeof(ECD64) +
+                                       sizeof(ECD64Locator));
     ecd64->signature();
     ecd64->remaining_size(sizeof(ECD64) - 12);
     ecd64->version(0x031E);         // Unix, version 3.0
@@ -807,29 +1517,432 @@ bool OutputJar::Close() {
   }
 
   // Save Central Directory and wrap up.
+  if (cen_spill_ != nullptr) {
+    ssize_t written = fflush(cen_spill_)
+                          ? -1
+                          : AppendFile(fileno(cen_spill_), 0, cen_spilled_);
+    if (written < 0 || static_cast<size_t>(written) != cen_spilled_) {
+      diag_err(1, "%s:%d: Cannot write central directory", __FILE__,
+               __LINE__);
+    }
+    fclose(cen_spill_);
+    cen_spill_ = nullptr;
+  }
   if (!WriteBytes(cen_, cen_size_)) {
     diag_err(1, "%s:%d: Cannot write central directory", __FILE__, __LINE__);
   }
+  FlushGather();
+  if (mapped_output_ != nullptr) {
+    UnmapOutput();
+  }
   free(cen_);
+  previous_output_.Close();
 
   if (fclose(file_)) {
     diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path());
   }
   file_ = nullptr;
-  // Free the buffer only after fclose(); stdio may flush data from the
-  // buffer on close.
-  buffer_.reset();
+  patch_buffer_.reset();
+
+  if (!options_->output_index.empty()) {
+    WriteIndex();
+  }
+  if (!options_->cache_dir.empty()) {
+    WriteCache();
+  }
+  phase_times_.write_cen = SecondsSince(phase_start);
 
   if (options_->verbose) {
     fprintf(stderr, "Wrote %s with %d entries", path(), entries_);
     if (duplicate_entries_) {
       fprintf(stderr, ", skipped %d entries", duplicate_entries_);
     }
+    if (reused_entries_) {
+      fprintf(stderr, ", reused %d entries of %s", reused_entries_,
+              options_->previous_output.c_str());
+    }
+    if (cached_entries_) {
+      fprintf(stderr, ", %d entries from the cache", cached_entries_);
+    }
+    if (kernel_copied_bytes_) {
+      fprintf(stderr, ", %" PRIu64 " bytes copied by the kernel",
+              kernel_copied_bytes_);
+    }
     fprintf(stderr, "\n");
+    fprintf(stderr,
+            "Entry index: %zu names, %d duplicates, peak %zu bytes, "
+            "%zu bytes of names in a file\n",
+            known_members_.size(), duplicate_entries_,
+            known_members_.peak_bytes(), known_members_.arena_file_bytes());
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr,
+            "Peak memory: %ld KB, central directory buffer %zu bytes, "
+            "%zu bytes spilled\n",
+            usage.ru_maxrss, cen_capacity_, cen_spilled_);
+    fprintf(stderr,
+            "Phase times: open %.3fs, scan %.3fs, combine %.3fs, "
+            "write central directory %.3fs\n",
+            phase_times_.open, phase_times_.scan, phase_times_.combine,
+            phase_times_.write_cen);
+  }
+  return true;
+}
+
+// The first line of an index file.
+static const char kIndexHeader[] = "singlejar_index 1";
+
+// The options affecting the contents of the entries copied from the input
+// jars. The entries of the previous output can be reused only if these were
+// the same.
+static std::string IndexOptions(const Options &options) {
+  std::string result;
+  result += options.force_compression ? "compression " : "";
+  result += options.preserve_compression ? "dont_change_compression " : "";
+  result += options.normalize_timestamps ? "normalize " : "";
+  result += "compression_level=" + std::to_string(options.compression_level) +
+            " compression_strategy=" +
+            std::to_string(options.compression_strategy) + " ";
+  for (auto &suffix : options.nocompress_suffixes) {
+    result += "nocompress_suffix=" + suffix + " ";
+  }
+  return result;
+}
+
+// The index file has the following lines:
+//   singlejar_index 1
+//   options <IndexOptions()>
+//   jar <digest> <input jar path>    (for each input jar)
+//   entry <jar number> <entry name>  (for each entry copied from an input jar)
+bool OutputJar::LoadPreviousOutput() {
+  MappedFile index;
+  if (!index.Open(options_->previous_index)) {
+    return false;
+  }
+  const char *data = reinterpret_cast<const char *>(index.start());
+  const char *data_end = reinterpret_cast<const char *>(index.end());
+  std::string line;
+  auto next_line = [&]() {
+    if (data >= data_end) {
+      return false;
+    }
+    const char *line_end =
+        static_cast<const char *>(memchr(data, '\n', data_end - data));
+    if (line_end == nullptr) {
+      line_end = data_end;
+    }
+    line.assign(data, line_end - data);
+    data = line_end + 1;
+    return true;
+  };
+  if (!next_line() || line != kIndexHeader) {
+    diag_warnx("%s:%d: %s is not a singlejar index", __FILE__, __LINE__,
+               options_->previous_index.c_str());
+    return false;
+  }
+  if (!next_line() || line != "options " + IndexOptions(*options_)) {
+    diag_warnx("%s:%d: %s was created with different options", __FILE__,
+               __LINE__, options_->previous_output.c_str());
+    return false;
+  }
+  const size_t digest_length = 2 * blaze_util::Md5Digest::kDigestLength;
+  while (next_line()) {
+    if (!line.compare(0, 4, "jar ") && line.size() > 5 + digest_length) {
+      previous_jars_.emplace_back(line.substr(5 + digest_length),
+                                  line.substr(4, digest_length));
+      continue;
+    }
+    if (!line.compare(0, 6, "entry ")) {
+      char *name;
+      long jar_index = strtol(line.c_str() + 6, &name, 10);
+      if (*name == ' ' && jar_index >= 0 &&
+          static_cast<size_t>(jar_index) < previous_jars_.size()) {
+        previous_entries_.Insert(
+            name + 1, line.c_str() + line.size() - (name + 1),
+            PreviousEntry{static_cast<int>(jar_index), nullptr});
+        continue;
+      }
+    }
+    diag_warnx("%s:%d: %s: bad line %s", __FILE__, __LINE__,
+               options_->previous_index.c_str(), line.c_str());
+    return false;
+  }
+
+  if (!previous_output_.Open(options_->previous_output)) {
+    return false;
+  }
+  const CDH *cdh;
+  const LH *lh;
+  while ((cdh = previous_output_.NextEntry(&lh))) {
+    auto previous =
+        previous_entries_.Find(cdh->file_name(), cdh->file_name_length());
+    if (previous != nullptr) {
+      previous->cdh = cdh;
+    }
   }
   return true;
 }
 
+void OutputJar::WriteIndex() {
+  FILE *fp = fopen(options_->output_index.c_str(), "w");
+  if (fp == nullptr) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__,
+             options_->output_index.c_str());
+  }
+  fprintf(fp, "%s\noptions %s\n", kIndexHeader,
+          IndexOptions(*options_).c_str());
+  for (size_t ix = 0; ix < options_->input_jars.size(); ++ix) {
+    fprintf(fp, "jar %s %s\n", input_jar_digests_[ix].c_str(),
+            options_->input_jars[ix].c_str());
+  }
+  // List the entries in the output order, so that the index is
+  // reproducible. The Central Directory is read back from the output,
+  // as it may not have been kept in memory.
+  InputJar output;
+  if (!output.Open(options_->output_jar)) {
+    diag_errx(1, "%s:%d: Cannot read back %s", __FILE__, __LINE__,
+              options_->output_jar.c_str());
+  }
+  const CDH *cdh;
+  const LH *lh;
+  while ((cdh = output.NextEntry(&lh))) {
+    const char *name = cdh->file_name();
+    size_t name_length = cdh->file_name_length();
+    auto member = known_members_.Find(name, name_length);
+    if (member == nullptr || member->combiner_ != nullptr ||
+        member->input_jar_index_ < 0 ||
+        memchr(name, '\n', name_length) != nullptr) {
+      continue;
+    }
+    fprintf(fp, "entry %d ", member->input_jar_index_);
+    fwrite(name, 1, name_length, fp);
+    fputc('\n', fp);
+  }
+  output.Close();
+  if (ferror(fp) || fclose(fp)) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__,
+             options_->output_index.c_str());
+  }
+}
+
+// Writes a jar with given entries of the output jar to the given cache
+// path. The jar is written to a temporary file which is then renamed, so
+// that the concurrent runs sharing the cache see either a complete jar or
+// none. Returns false if the jar cannot be written.
+static bool WriteCacheJar(const InputJar &output,
+                          const std::vector<const CDH *> &cdhs,
+                          const std::string &cache_path) {
+  // The cache jars are not expected to be large enough to need Zip64
+  // End of Central Directory records.
+  if (cdhs.size() >= 0xFFFF) {
+    return false;
+  }
+  const std::string temp_path =
+      cache_path + ".tmp" + std::to_string(getpid());
+  FILE *fp = fopen(temp_path.c_str(), "w");
+  if (fp == nullptr) {
+    return false;
+  }
+  std::vector<uint8_t> cen;
+  uint64_t offset = 0;
+  bool ok = true;
+  for (auto cdh : cdhs) {
+    const LH *lh = output.LocalHeader(cdh);
+    const size_t num_bytes = EntrySize(cdh, lh);
+    size_t cen_size = cen.size();
+    cen.resize(cen_size + cdh->size());
+    CDH *cache_cdh = reinterpret_cast<CDH *>(cen.data() + cen_size);
+    memcpy(cache_cdh, cdh, cdh->size());
+    if (ziph::zfield_has_ext64(cdh->local_header_offset32())) {
+      // The offset is the last attribute of the Zip64 extra field.
+      Zip64ExtraField *zip64_ef =
+          const_cast<Zip64ExtraField *>(cache_cdh->zip64_extra_field());
+      zip64_ef->attr64(zip64_ef->attr_count() - 1, offset);
+    } else if (ziph::zfield_needs_ext64(offset)) {
+      ok = false;
+      break;
+    } else {
+      cache_cdh->local_header_offset32(offset);
+    }
+    if (fwrite(lh, num_bytes, 1, fp) != 1) {
+      ok = false;
+      break;
+    }
+    offset += num_bytes;
+  }
+  ECD ecd;
+  memset(&ecd, 0, sizeof(ecd));
+  ecd.signature();
+  ecd.this_disk_entries16(cdhs.size());
+  ecd.total_entries16(cdhs.size());
+  ecd.cen_size32(cen.size());
+  ecd.cen_offset32(offset);
+  ok = ok && !ziph::zfield_needs_ext64(offset + cen.size()) &&
+       fwrite(cen.data(), cen.size(), 1, fp) == 1 &&
+       fwrite(&ecd, sizeof(ecd), 1, fp) == 1;
+  if (fclose(fp) || !ok || rename(temp_path.c_str(), cache_path.c_str())) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void OutputJar::WriteCache() {
+  NameIndex<size_t> cached_names;  // Entry name to its input jar index.
+  for (size_t ix = 0; ix < cache_misses_.size(); ++ix) {
+    for (auto &name : cache_misses_[ix].entries) {
+      cached_names.Insert(name, ix);
+    }
+  }
+  if (cached_names.size() == 0) {
+    return;
+  }
+  // The cache directory may not exist yet.
+  mkdir(options_->cache_dir.c_str(), 0777);
+  // The entries are copied from the output, where they are found in the
+  // Central Directory read back from it.
+  InputJar output;
+  if (!output.Open(options_->output_jar)) {
+    diag_errx(1, "%s:%d: Cannot read back %s", __FILE__, __LINE__,
+              options_->output_jar.c_str());
+  }
+  std::vector<std::vector<const CDH *> > cdhs(cache_misses_.size());
+  const CDH *cdh;
+  const LH *lh;
+  while ((cdh = output.NextEntry(&lh))) {
+    size_t *ix = cached_names.Find(cdh->file_name(), cdh->file_name_length());
+    if (ix != nullptr) {
+      cdhs[*ix].push_back(cdh);
+    }
+  }
+  for (size_t ix = 0; ix < cache_misses_.size(); ++ix) {
+    if (!cdhs[ix].empty() &&
+        !WriteCacheJar(output, cdhs[ix], cache_misses_[ix].cache_path)) {
+      diag_warnx("%s:%d: Cannot add %s to the cache", __FILE__, __LINE__,
+                 options_->input_jars[ix].c_str());
+    }
+  }
+  output.Close();
+}
+
+void OutputJar::WriteCombinedEntry(Combiner *combiner, bool compress,
+                                   Deflater *deflater) {
+  auto start = std::chrono::steady_clock::now();
+  std::string name;
+  TransientBytes *contents;
+  void *entry =
+      CreateCombinedEntry(combiner, compress, deflater, &name, &contents);
+  if (contents != nullptr) {
+    StreamEntry(name, contents, compress, deflater);
+  } else {
+    WriteEntry(entry);
+  }
+  combiner_profiles_[combiner].output_seconds += SecondsSince(start);
+}
+
+// Returns the string as a JSON string literal.
+static std::string JsonString(const std::string &str) {
+  std::string result = "\"";
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+static const char *CombinerType(const Combiner *combiner) {
+  if (dynamic_cast<const PropertyCombiner *>(combiner)) {
+    return "PropertyCombiner";
+  } else if (dynamic_cast<const Concatenator *>(combiner)) {
+    return "Concatenator";
+  } else if (dynamic_cast<const XmlCombiner *>(combiner)) {
+    return "XmlCombiner";
+  }
+  return "Combiner";
+}
+
+// The profile is a JSON object with the phase times, the totals, and the
+// statistics for each input jar (in the command line order) and for each
+// combiner (in the entry name order).
+void OutputJar::WriteProfile() {
+  FILE *fp = fopen(options_->profile.c_str(), "w");
+  if (fp == nullptr) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__, options_->profile.c_str());
+  }
+  fprintf(fp, "{\n  \"output\": %s,\n", JsonString(path()).c_str());
+  fprintf(fp,
+          "  \"phases\": {\"open_seconds\": %.6f, \"scan_seconds\": %.6f, "
+          "\"combine_seconds\": %.6f, \"write_cen_seconds\": %.6f},\n",
+          phase_times_.open, phase_times_.scan, phase_times_.combine,
+          phase_times_.write_cen);
+  fprintf(fp,
+          "  \"entries\": %d,\n  \"duplicate_entries\": %d,\n"
+          "  \"reused_entries\": %d,\n  \"cached_entries\": %d,\n"
+          "  \"recompressed_entries\": %d,\n"
+          "  \"copied_bytes\": %" PRIu64 ",\n"
+          "  \"kernel_copied_bytes\": %" PRIu64 ",\n"
+          "  \"recompressed_bytes\": %" PRIu64 ",\n"
+          "  \"normalized_headers\": %d,\n",
+          entries_, duplicate_entries_, reused_entries_, cached_entries_,
+          recompressed_entries_, copied_bytes_, kernel_copied_bytes_,
+          recompressed_bytes_, normalized_headers_);
+
+  fprintf(fp, "  \"input_jars\": [");
+  for (size_t ix = 0; ix < jar_profiles_.size(); ++ix) {
+    const JarProfile &profile = jar_profiles_[ix];
+    fprintf(fp,
+            "%s\n    {\"path\": %s, \"scan_seconds\": %.6f, "
+            "\"add_seconds\": %.6f, \"entries\": %d, "
+            "\"copied_bytes\": %" PRIu64 ", \"recompressed_bytes\": %" PRIu64
+            ", \"normalized_headers\": %d}",
+            ix ? "," : "", JsonString(options_->input_jars[ix]).c_str(),
+            profile.scan_seconds, profile.add_seconds, profile.entries,
+            profile.copied_bytes, profile.recompressed_bytes,
+            profile.normalized_headers);
+  }
+  fprintf(fp, "\n  ],\n");
+
+  // Only the combiners registered in known_members_ have a name.
+  std::unordered_map<const Combiner *, std::string> names;
+  known_members_.ForEach(
+      [&names](const char *name, size_t name_length, const EntryInfo &info) {
+        if (info.combiner_ != nullptr) {
+          names[info.combiner_].assign(name, name_length);
+        }
+      });
+  std::vector<std::pair<std::string, const Combiner *> > combiners;
+  for (auto &combiner_profile : combiner_profiles_) {
+    const Combiner *combiner = combiner_profile.first;
+    auto concatenator = dynamic_cast<const Concatenator *>(combiner);
+    combiners.emplace_back(
+        concatenator ? concatenator->filename() : names[combiner], combiner);
+  }
+  std::sort(combiners.begin(), combiners.end());
+  fprintf(fp, "  \"combiners\": [");
+  for (size_t i = 0; i < combiners.size(); ++i) {
+    const CombinerProfile &profile = combiner_profiles_[combiners[i].second];
+    fprintf(fp,
+            "%s\n    {\"entry\": %s, \"type\": \"%s\", "
+            "\"merged_entries\": %d, \"merge_seconds\": %.6f, "
+            "\"output_seconds\": %.6f}",
+            i ? "," : "", JsonString(combiners[i].first).c_str(),
+            CombinerType(combiners[i].second), profile.merged_entries,
+            profile.merge_seconds, profile.output_seconds);
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  if (ferror(fp) || fclose(fp)) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__, options_->profile.c_str());
+  }
+}
+
 bool IsDir(const std::string &path) {
   struct stat st;
   if (stat(path.c_str(), &st)) {
@@ -841,7 +1954,7 @@ bool IsDir(const std::string &path) {
 
 void OutputJar::ClasspathResource(const std::string &resource_name,
                                   const std::string &resource_path) {
-  if (known_members_.count(resource_name)) {
+  if (known_members_.Find(resource_name) != nullptr) {
     if (options_->warn_duplicate_resources) {
       diag_warnx(
           "%s:%d: Duplicate resource name %s in the --classpath_resource or "
@@ -860,12 +1973,12 @@ void OutputJar::ClasspathResource(const std::string &resource_name,
         reinterpret_cast<const char *>(mapped_file.start()),
         mapped_file.size());
     classpath_resources_.emplace_back(classpath_resource);
-    known_members_.emplace(resource_name, EntryInfo{classpath_resource});
+    known_members_.Insert(resource_name, EntryInfo{classpath_resource});
   } else if (IsDir(resource_path)) {
     // add an empty entry for the directory so its path ends up in the
     // manifest
     classpath_resources_.emplace_back(new Concatenator(resource_name + "/"));
-    known_members_.emplace(resource_name, EntryInfo{&null_combiner_});
+    known_members_.Insert(resource_name, EntryInfo{&null_combiner_});
   } else {
     diag_err(1, "%s:%d: %s", __FILE__, __LINE__, resource_path.c_str());
   }
@@ -875,11 +1988,16 @@ ssize_t OutputJar::AppendFile(int in_fd, off_t offset, size_t count) {
   if (count == 0) {
     return 0;
   }
+  FlushInputRange();
+  size_t total_written = KernelCopy(in_fd, offset, Position(), count);
+  outpos_ += total_written;
+  if (total_written == count) {
+    return total_written;
+  }
   std::unique_ptr<void, decltype(free)*> buffer(malloc(kBufferSize), free);
   if (buffer == nullptr) {
     diag_err(1, "%s:%d: malloc", __FILE__, __LINE__);
   }
-  ssize_t total_written = 0;
 
   while (total_written < count) {
     size_t len = std::min(kBufferSize, count - total_written);
@@ -902,13 +2020,257 @@ ssize_t OutputJar::AppendFile(int in_fd, off_t offset, size_t count) {
 void OutputJar::ExtraCombiner(const std::string &entry_name,
                               Combiner *combiner) {
   extra_combiners_.emplace_back(combiner);
-  known_members_.emplace(entry_name, EntryInfo{combiner});
+  known_members_.Insert(entry_name, EntryInfo{combiner});
+}
+
+void OutputJar::AppendInputRange(const InputJar &input_jar,
+                                 const std::string &input_jar_path,
+                                 off_t offset, size_t count) {
+  if (input_range_.count > 0 && input_range_.input_jar == &input_jar &&
+      input_range_.offset + static_cast<off_t>(input_range_.count) == offset) {
+    input_range_.count += count;
+  } else {
+    FlushInputRange();
+    input_range_ = {&input_jar, &input_jar_path, offset, count};
+  }
+  outpos_ += count;
+}
+
+// Input ranges shorter than this are not worth a flush of the output
+// buffer and a system call, copying them is cheaper.
+static const size_t kMinKernelCopySize = kBufferSize;
+
+void OutputJar::FlushInputRange() {
+  if (input_range_.count == 0) {
+    return;
+  }
+  const InputRange range = input_range_;
+  input_range_.count = 0;
+  off_t out_offset = outpos_ - range.count;
+  size_t copied = 0;
+  if (range.count >= kMinKernelCopySize) {
+    copied = KernelCopy(range.input_jar->fd(), range.offset, out_offset,
+                        range.count);
+  }
+  Gather(range.input_jar->mapped_start() + range.offset + copied,
+         range.count - copied);
+}
+
+// The number of the iovec's writev() accepts (IOV_MAX on Linux).
+static const size_t kMaxGather = 1024;
+
+// Writing lots of short iovec's costs the kernel more than copying them to
+// a buffer, so the pieces shorter than this are copied to the patch buffer.
+static const size_t kMinGatherSize = 4096;
+
+uint8_t *OutputJar::ReservePatch(size_t size) {
+  FlushInputRange();
+  if (mapped_output_ != nullptr) {
+    return ReserveMapped(size);
+  }
+  if (patch_size_ + size > kPatchBufferSize) {
+    FlushGather();
+  }
+  return patch_buffer_.get() + patch_size_;
+}
+
+void OutputJar::CommitPatch(size_t count) {
+  if (mapped_output_ != nullptr) {
+    // ReservePatch() has returned the place in the mapping.
+    mapped_pos_ += count;
+    outpos_ += count;
+    return;
+  }
+  const uint8_t *patch = patch_buffer_.get() + patch_size_;
+  patch_size_ += count;
+  outpos_ += count;
+  AppendIovec(patch, count);
+}
+
+void OutputJar::Gather(const uint8_t *data, size_t count) {
+  if (count < kMinGatherSize && mapped_output_ == nullptr) {
+    if (patch_size_ + count > kPatchBufferSize) {
+      FlushGather();
+    }
+    uint8_t *patch = patch_buffer_.get() + patch_size_;
+    memcpy(patch, data, count);
+    patch_size_ += count;
+    data = patch;
+  }
+  AppendIovec(data, count);
+}
+
+void OutputJar::AppendIovec(const uint8_t *data, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  if (mapped_output_ != nullptr) {
+    memcpy(ReserveMapped(count), data, count);
+    mapped_pos_ += count;
+    return;
+  }
+  if (!gather_.empty()) {
+    struct iovec &last = gather_.back();
+    if (static_cast<const uint8_t *>(last.iov_base) + last.iov_len == data) {
+      last.iov_len += count;
+      return;
+    }
+  }
+  gather_.push_back({const_cast<uint8_t *>(data), count});
+  if (gather_.size() >= kMaxGather) {
+    FlushGather();
+  }
+}
+
+void OutputJar::FlushGather() {
+  struct iovec *iov = gather_.data();
+  int iov_count = gather_.size();
+  while (iov_count > 0) {
+    ssize_t written = writev(fileno(file_), iov, iov_count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path());
+    }
+    // Skip what has been written, a partial write may end mid-iovec.
+    while (iov_count > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --iov_count;
+    }
+    if (iov_count > 0) {
+      iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  gather_.clear();
+  patch_size_ = 0;
+}
+
+bool OutputJar::MapOutput(size_t size) {
+  int fd = fileno(file_);
+#if defined(__linux__)
+  // Allocate the blocks upfront, so that running out of space fails here
+  // rather than raises SIGBUS on a store to the mapping.
+  if (fallocate(fd, 0, 0, size) &&
+      (errno != EOPNOTSUPP || ftruncate(fd, size))) {
+    return false;
+  }
+#else
+  if (ftruncate(fd, size)) {
+    return false;
+  }
+#endif
+  void *mapped =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  mapped_output_ = static_cast<uint8_t *>(mapped);
+  mapped_size_ = size;
+  return true;
+}
+
+uint8_t *OutputJar::ReserveMapped(size_t count) {
+  if (mapped_pos_ + count > mapped_size_) {
+    // The written pages stay in the page cache, remapping does not copy.
+    munmap(mapped_output_, mapped_size_);
+    mapped_output_ = nullptr;
+    if (!MapOutput(std::max(mapped_pos_ + std::max(count, kMinMappedSize),
+                            2 * mapped_size_))) {
+      diag_err(1, "%s:%d: Cannot map %s", __FILE__, __LINE__, path());
+    }
+  }
+  return mapped_output_ + mapped_pos_;
+}
+
+void OutputJar::UnmapOutput() {
+  if (munmap(mapped_output_, mapped_size_) ||
+      ftruncate(fileno(file_), mapped_pos_)) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path());
+  }
+  mapped_output_ = nullptr;
+  mapped_size_ = 0;
+}
+
+size_t OutputJar::KernelCopy(int in_fd, off_t in_offset, off_t out_offset,
+                             size_t count) {
+#if defined(__linux__)
+  if (!kernel_copy_ && !kernel_clone_) {
+    return 0;
+  }
+  // Both system calls below write to the file directly, so write out
+  // whatever has been gathered first.
+  FlushGather();
+  int out_fd = fileno(file_);
+  size_t copied = 0;
+#if defined(FICLONERANGE)
+  // Cloning shares the extents between the files, but the offsets and the
+  // size have to be multiples of the filesystem block size.
+  const size_t block_size = output_block_size_;
+  if (kernel_clone_ && block_size > 0 && in_offset % block_size == 0 &&
+      out_offset % block_size == 0 && count >= block_size) {
+    struct file_clone_range clone_range;
+    clone_range.src_fd = in_fd;
+    clone_range.src_offset = in_offset;
+    clone_range.src_length = count - count % block_size;
+    clone_range.dest_offset = out_offset;
+    if (ioctl(out_fd, FICLONERANGE, &clone_range) == 0) {
+      copied = clone_range.src_length;
+    } else {
+      kernel_clone_ = false;
+    }
+  }
+#endif
+#if defined(__NR_copy_file_range)
+  while (kernel_copy_ && copied < count) {
+    loff_t in_off = in_offset + copied;
+    loff_t out_off = out_offset + copied;
+    ssize_t n = syscall(__NR_copy_file_range, in_fd, &in_off, out_fd, &out_off,
+                        count - copied, 0);
+    if (n <= 0) {
+      // The kernel is too old, or the files are on different filesystems,
+      // or the filesystem does not support it. Do not try again.
+      if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                    errno == EOPNOTSUPP || errno == EBADF)) {
+        kernel_copy_ = false;
+      }
+      break;
+    }
+    copied += n;
+  }
+#else
+  kernel_copy_ = false;
+#endif
+  // The calls above do not move output file position.
+  if (copied > 0) {
+    if (mapped_output_ != nullptr) {
+      mapped_pos_ = out_offset + copied;
+    } else if (lseek(out_fd, out_offset + copied, SEEK_SET) < 0) {
+      diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path());
+    }
+  }
+  kernel_copied_bytes_ += copied;
+  return copied;
+#else
+  return 0;
+#endif
 }
 
 bool OutputJar::WriteBytes(const void *buffer, size_t count) {
-  size_t written = fwrite(buffer, 1, count, file_);
-  outpos_ += written;
-  return written == count;
+  FlushInputRange();
+  const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+  if (count < kMinGatherSize) {
+    Gather(bytes, count);
+  } else {
+    // The caller may reuse the buffer, so write it out now, along with
+    // the output gathered so far.
+    AppendIovec(bytes, count);
+    FlushGather();
+  }
+  outpos_ += count;
+  return true;
 }
 
 void OutputJar::ExtraHandler(const CDH *) {}
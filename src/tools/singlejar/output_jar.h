@@ -17,12 +17,16 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "src/tools/singlejar/combiners.h"
+#include "src/tools/singlejar/entry_compressor.h"
+#include "src/tools/singlejar/input_jar.h"
+#include "src/tools/singlejar/name_index.h"
 #include "src/tools/singlejar/options.h"
 
 /*
@@ -43,6 +47,14 @@ class OutputJar {
   virtual void ExtraHandler(const CDH *entry);
   // Return jar path.
   const char *path() const { return options_->output_jar.c_str(); }
+  // Time spent in the phases of Doit(), in seconds.
+  struct PhaseTimes {
+    double open;       // Opening the output, adding launcher and resources.
+    double scan;       // Scanning the input jars and copying their entries.
+    double combine;    // Writing the entries created by the combiners.
+    double write_cen;  // Writing the Central Directory and closing the output.
+  };
+  const PhaseTimes &phase_times() const { return phase_times_; }
 
  protected:
   // The purpose  of these two tiny utility methods is to avoid creating a
@@ -59,18 +71,62 @@ class OutputJar {
   }
   // True if an entry with given name have not been added to this archive.
   bool NewEntry(const std::string& entry_name) {
-    return known_members_.count(entry_name) == 0;
+    return known_members_.Find(entry_name) == nullptr;
   }
 
  private:
+  // An input jar which has been opened and whose Central Directory has been
+  // scanned, ready to be added to the output.
+  struct ScannedJar {
+    struct Entry {
+      const CDH *cdh;
+      const LH *lh;
+      size_t num_bytes;  // Local header, data and data descriptor size.
+      // The same entry in the previous output jar if it can be reused.
+      const CDH *previous_cdh;
+      // The same entry in the cache jar if it can be reused.
+      const CDH *cached_cdh;
+    };
+    InputJar input_jar;
+    std::vector<Entry> entries;  // In the Central Directory order.
+    // Central Directory digest (incremental mode or --cache_dir only).
+    std::string digest;
+    double scan_seconds;
+    // With --cache_dir, the path of the cache jar for this input jar, and
+    // the entries of the cache jar if it exists.
+    std::string cache_path;
+    bool cache_hit;
+    InputJar cache_jar;
+    NameIndex<const CDH *> cached_entries;
+  };
+
   // Open output jar.
   bool Open();
-  // Add the contents of the given input jar.
-  bool AddJar(int jar_path_index);
+  // Add the contents of all input jars.
+  bool AddJars();
+  // Open given input jar and collect the entries which are candidates for
+  // the output. May run on a worker thread, so it only reads options_.
+  bool ScanJar(int jar_path_index, ScannedJar *scanned_jar) const;
+  // Add the contents of the given scanned input jar.
+  bool AddJar(int jar_path_index, ScannedJar *scanned_jar);
+  // Copy given input jar entry to the output.
+  void CopyEntry(const std::string &input_jar_path,
+                 const ScannedJar &scanned_jar,
+                 const ScannedJar::Entry &scanned_entry);
+  // Copy the entry of the previous output or of a cache jar verbatim.
+  void ReuseEntry(const InputJar &jar, const std::string &jar_path,
+                  const CDH *cdh);
   // Returns the current output position.
   off_t Position();
   // Write Jar entry.
   void WriteEntry(void *local_header_and_payload);
+  // Set the timestamp of an entry created by singlejar and write its local
+  // header. Returns its output position.
+  off_t WriteLocalHeader(LH *lh);
+  // Create output Central Directory entry for the entry created by singlejar.
+  void AppendLocalHeaderToDirectoryBuffer(const LH *lh, off_t lh_pos);
+  // Decompress given input jar entry straight to the output, storing it.
+  void WriteInflatedEntry(const CDH *cdh, const LH *lh);
   // Write META_INF/ entry (the first entry on output).
   void WriteMetaInf();
   // Write a directory entry.
@@ -84,6 +140,11 @@ class OutputJar {
   uint8_t *ReserveCdr(size_t chunk_size);
   // Reserve space for the Central Directory Header in CEN buffer.
   uint8_t *ReserveCdh(size_t size);
+  // Move the contents of CEN buffer to the temporary file.
+  void SpillCen();
+  // Create an unlinked temporary file next to the output, return its
+  // descriptor.
+  int CreateTempFile(const char *suffix);
   // Close output.
   bool Close();
   // Set classpath resource with given resource name and path.
@@ -91,27 +152,111 @@ class OutputJar {
                          const std::string& resource_path);
   // Copy 'count' bytes starting at 'offset' from the given file.
   ssize_t AppendFile(int in_fd, off_t offset, size_t count);
+  // Append 'count' bytes starting at 'offset' of the given input jar. The
+  // contiguous ranges of the same input jar are coalesced and copied later.
+  void AppendInputRange(const InputJar &input_jar,
+                        const std::string &input_jar_path, off_t offset,
+                        size_t count);
+  // Write out the coalesced input jar range, if any.
+  void FlushInputRange();
+  // Return the space for up to 'size' bytes of the output that will be
+  // created in memory (e.g., a local header with normalized timestamp).
+  // The space is valid until the next call of any of the write methods.
+  uint8_t *ReservePatch(size_t size);
+  // Append first 'count' bytes of the space returned by ReservePatch().
+  void CommitPatch(size_t count);
+  // Append the given bytes to the output, which will be written out by
+  // FlushGather(). Short pieces are copied to the patch buffer, the longer
+  // ones have to stay intact till then.
+  void Gather(const uint8_t *data, size_t count);
+  // Append an iovec for the given bytes to gather_.
+  void AppendIovec(const uint8_t *data, size_t count);
+  // Write out the gathered output.
+  void FlushGather();
+  // With --mmap_output, map the output file, preallocating 'size' bytes.
+  // Return false if it cannot be mapped.
+  bool MapOutput(size_t size);
+  // Grow the output file and its mapping so that the next 'count' bytes
+  // of the output fit into it. Return the pointer to their place.
+  uint8_t *ReserveMapped(size_t count);
+  // Unmap the output file and truncate it to the written size.
+  void UnmapOutput();
+  // Copy up to 'count' bytes starting at 'in_offset' of the given file to
+  // the output file at 'out_offset' without passing them through the user
+  // space. Return the number of bytes copied.
+  size_t KernelCopy(int in_fd, off_t in_offset, off_t out_offset,
+                    size_t count);
   // Write bytes to the output file, return true on success.
   bool WriteBytes(const void *buffer, size_t count);
+  // True if the input jar digests are needed for the incremental mode.
+  bool incremental() const {
+    return !options_->output_index.empty() ||
+           !options_->previous_output.empty();
+  }
+  // Load the previous output jar and its index. Return false if they
+  // cannot be used.
+  bool LoadPreviousOutput();
+  // Write the index of the output jar.
+  void WriteIndex();
+  // Add the entries created for the input jars missing from the cache to
+  // the cache.
+  void WriteCache();
+  // Write the output entry of the given combiner, accounting for the time
+  // it takes.
+  void WriteCombinedEntry(Combiner *combiner, bool compress,
+                          Deflater *deflater);
+  // Write the entry with given name and contents without creating it in
+  // memory first.
+  void StreamEntry(const std::string &name, TransientBytes *contents,
+                   bool compress, Deflater *deflater);
+  // Write the profile requested by --profile.
+  void WriteProfile();
 
 
   Options *options_;
   struct EntryInfo {
-    EntryInfo(Combiner *combiner, int index = -1)
+    EntryInfo(Combiner *combiner = nullptr, int index = -1)
         : combiner_(combiner), input_jar_index_(index) {}
     Combiner *combiner_;
     int input_jar_index_;  // Input jar index for the plain entry or -1.
   };
 
-  std::unordered_map<std::string, struct EntryInfo> known_members_;
+  NameIndex<EntryInfo> known_members_;
+  int known_names_fd_;  // With --cen_buffer_mb, the known_members_ names.
   FILE *file_;
   off_t outpos_;
-  std::unique_ptr<char[]> buffer_;
+  // The input jar range which has been appended to the output by
+  // AppendInputRange but has not been written yet. Its bytes are already
+  // accounted for in outpos_.
+  struct InputRange {
+    const InputJar *input_jar;
+    const std::string *input_jar_path;
+    off_t offset;
+    size_t count;
+  } input_range_;
+  // The output appended by Gather(), in the output order. It points to the
+  // mapped input jars and to patch_buffer_, and is written to the output
+  // file by a single writev() call.
+  std::vector<struct iovec> gather_;
+  std::unique_ptr<uint8_t[]> patch_buffer_;
+  size_t patch_size_;
+  bool kernel_copy_;   // False once copy_file_range() turns out unusable.
+  bool kernel_clone_;  // False once FICLONERANGE turns out unusable.
+  size_t output_block_size_;
+  // With --mmap_output, the output file mapping, its size and the offset
+  // of the next byte to be written to it. All the output goes there rather
+  // than through gather_, except for the ranges copied by KernelCopy().
+  uint8_t *mapped_output_;
+  size_t mapped_size_;
+  off_t mapped_pos_;
+  uint64_t kernel_copied_bytes_;
   int entries_;
   int duplicate_entries_;
   uint8_t *cen_;
   size_t cen_size_;
   size_t cen_capacity_;
+  FILE *cen_spill_;  // Central Directory records which did not fit in cen_.
+  size_t cen_spilled_;
   Concatenator spring_handlers_;
   Concatenator spring_schemas_;
   Concatenator protobuf_meta_handler_;
@@ -121,6 +266,52 @@ class OutputJar {
   std::vector<std::unique_ptr<Concatenator> > service_handlers_;
   std::vector<std::unique_ptr<Concatenator> > classpath_resources_;
   std::vector<std::unique_ptr<Combiner> > extra_combiners_;
+  // In the incremental mode, the previous output jar and the input jars it
+  // was created from (path and digest), and for each its entry copied from
+  // an input jar, the index of the latter in previous_jars_.
+  struct PreviousEntry {
+    int jar_index;
+    const CDH *cdh;
+  };
+  InputJar previous_output_;
+  std::vector<std::pair<std::string, std::string> > previous_jars_;
+  NameIndex<PreviousEntry> previous_entries_;
+  std::vector<std::string> input_jar_digests_;
+  int reused_entries_;
+  // With --cache_dir, for each input jar missing from the cache, its cache
+  // jar path and the entries that singlejar has created (rather than
+  // copied) for it.
+  struct CacheMiss {
+    std::string cache_path;
+    std::vector<std::string> entries;
+  };
+  std::vector<CacheMiss> cache_misses_;
+  int cached_entries_;
+  // Recompresses entries on the worker threads if --threads is set.
+  std::unique_ptr<EntryCompressor> compressor_;
+  // Compresses the entries when compressor_ is not used.
+  std::unique_ptr<Deflater> deflater_;
+  PhaseTimes phase_times_;
+  // The statistics written to the --profile file.
+  struct JarProfile {
+    double scan_seconds;
+    double add_seconds;
+    int entries;                  // Entries written to the output.
+    uint64_t copied_bytes;        // Input bytes copied as is.
+    uint64_t recompressed_bytes;  // Uncompressed size of recompressed entries.
+    int normalized_headers;       // Local headers rewritten by --normalize.
+  };
+  struct CombinerProfile {
+    int merged_entries;
+    double merge_seconds;
+    double output_seconds;
+  };
+  std::vector<JarProfile> jar_profiles_;
+  std::unordered_map<const Combiner *, CombinerProfile> combiner_profiles_;
+  uint64_t copied_bytes_;
+  uint64_t recompressed_bytes_;
+  int recompressed_entries_;
+  int normalized_headers_;
 };
 
 #endif  //   SRC_TOOLS_SINGLEJAR_COMBINED_JAR_H_
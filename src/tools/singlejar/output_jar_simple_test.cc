@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <stdlib.h>
+#include <algorithm>
 
 #include "src/main/cpp/util/file.h"
 #include "src/main/cpp/util/port.h"
@@ -72,6 +73,11 @@ class CustomOutputJar : public OutputJar {
 class OutputJarSimpleTest : public ::testing::Test {
  protected:
   void CreateOutput(const string &out_path, const std::vector<string> &args) {
+    CreateOutput(&output_jar_, &options_, out_path, args);
+  }
+
+  void CreateOutput(OutputJar *output_jar, Options *options,
+                    const string &out_path, const std::vector<string> &args) {
     const char *option_list[100] = {"--output", out_path.c_str()};
     int nargs = 2;
     for (auto &arg : args) {
@@ -86,11 +92,116 @@ class OutputJarSimpleTest : public ::testing::Test {
       }
     }
     fprintf(stderr, "\n");
-    options_.ParseCommandLine(nargs, option_list);
-    ASSERT_EQ(0, output_jar_.Doit(&options_));
+    options->ParseCommandLine(nargs, option_list);
+    ASSERT_EQ(0, output_jar->Doit(options));
     EXPECT_EQ(0, VerifyZip(out_path));
   }
 
+  // Creates output from more input jars than the threads scan ahead, with
+  // duplicate entries and entries to be combined, and checks that the
+  // output created with --threads is byte-identical to the serial one.
+  void CheckThreadsOutput(const std::vector<string> &extra_args) {
+    std::vector<string> args = extra_args;
+    args.push_back("--normalize");
+    args.push_back("--extra_build_info");
+    args.push_back("property1=value1");
+    args.push_back("--classpath_resources");
+    args.push_back(CreateTextFile("cp_res", "line1\nline2\n"));
+    args.push_back("--sources");
+    for (int i = 0; i < 20; ++i) {
+      string n = std::to_string(i);
+      string dir = "threads" + n;
+      // Duplicates: the first jar's copy has to win.
+      CreateTextFile(dir + "/com/example/Shared.class", ("jar" + n).c_str());
+      CreateTextFile(dir + "/com/example/Class" + n + ".class",
+                     ("class" + n).c_str());
+      CreateTextFile(dir + "/META-INF/services/com.example.Service",
+                     ("com.example.ServiceImpl" + n + "\n").c_str());
+      CreateTextFile(dir + "/META-INF/spring.handlers",
+                     ("handler" + n + "\n").c_str());
+      CreateTextFile(dir + "/build-data.properties",
+                     ("property" + n + "=value" + n + "\n").c_str());
+      string jar_path = OutputFilePath(dir + ".jar");
+      unlink(jar_path.c_str());
+      string command = "cd " + OutputFilePath(dir) + " && zip -qr " +
+                       jar_path + " com META-INF build-data.properties";
+      ASSERT_EQ(0, system(command.c_str()));
+      args.push_back(jar_path);
+    }
+    args.push_back(kPathLibData1);
+    args.push_back(kPathLibData2);
+
+    string out_path = OutputFilePath("out.jar");
+    CreateOutput(out_path, args);
+    string serial;
+    ASSERT_TRUE(blaze_util::ReadFile(out_path, &serial));
+    EXPECT_EQ("jar0", GetEntryContents(out_path, "com/example/Shared.class"));
+
+    for (const char *threads : {"2", "3", "8"}) {
+      std::vector<string> threads_args = args;
+      threads_args.push_back("--threads");
+      threads_args.push_back(threads);
+      OutputJar output_jar;
+      Options options;
+      CreateOutput(&output_jar, &options, out_path, threads_args);
+      string parallel;
+      ASSERT_TRUE(blaze_util::ReadFile(out_path, &parallel));
+      EXPECT_TRUE(serial == parallel) << "--threads " << threads;
+    }
+  }
+
+  // Creates output from two jars with a large service file each and a
+  // large classpath resource, then checks the combined entries.
+  void CheckLargeCombinedEntries(const std::vector<string> &extra_args) {
+    string contents;
+    for (int i = 0; contents.size() < (3 << 20); ++i) {
+      contents += "com.example.ServiceImpl" + std::to_string(i) + "\n";
+    }
+    std::vector<string> args = extra_args;
+    args.push_back("--classpath_resources");
+    args.push_back(CreateTextFile("large_cp_res", contents.c_str()));
+    args.push_back("--sources");
+    for (int i = 0; i < 2; ++i) {
+      string dir = "large" + std::to_string(i);
+      CreateTextFile(dir + "/META-INF/services/com.example.Service",
+                     contents.c_str());
+      string jar_path = OutputFilePath(dir + ".jar");
+      unlink(jar_path.c_str());
+      string command = "cd " + OutputFilePath(dir) + " && zip -qr " +
+                       jar_path + " META-INF";
+      ASSERT_EQ(0, system(command.c_str()));
+      args.push_back(jar_path);
+    }
+    string out_path = OutputFilePath("out.jar");
+    CreateOutput(out_path, args);
+    EXPECT_EQ(contents, GetEntryContents(out_path, "large_cp_res"));
+    EXPECT_EQ(contents + contents,
+              GetEntryContents(out_path,
+                               "META-INF/services/com.example.Service"));
+
+    // The compressed entries have data descriptors.
+    const bool compressed =
+        std::find(extra_args.begin(), extra_args.end(), "--compression") !=
+        extra_args.end();
+    InputJar input_jar;
+    ASSERT_TRUE(input_jar.Open(out_path));
+    const LH *lh;
+    const CDH *cdh;
+    int large_entries = 0;
+    while ((cdh = input_jar.NextEntry(&lh))) {
+      if (cdh->file_name_is("large_cp_res") ||
+          cdh->file_name_is("META-INF/services/com.example.Service")) {
+        ++large_entries;
+        EXPECT_EQ(compressed ? Z_DEFLATED : Z_NO_COMPRESSION,
+                  cdh->compression_method());
+        EXPECT_EQ(compressed, cdh->no_size_in_local_header());
+        EXPECT_EQ(cdh->bit_flag(), lh->bit_flag());
+      }
+    }
+    EXPECT_EQ(2, large_entries);
+    input_jar.Close();
+  }
+
   string CompressionOptionsTestingJar(const string &compression_option) {
     string cp_res_path =
         CreateTextFile("cp_res", "line1\nline2\nline3\nline4\n");
@@ -220,6 +331,142 @@ TEST_F(OutputJarSimpleTest, Source) {
   input_jar.Close();
 }
 
+// --output_index, then --previous_output and --previous_index.
+TEST_F(OutputJarSimpleTest, Incremental) {
+  string out1_path = OutputFilePath("out1.jar");
+  string index_path = OutputFilePath("out1.index");
+  CreateOutput(out1_path,
+               {"--normalize", "--output_index", index_path, "--sources",
+                DATA_DIR_TOP "src/tools/singlejar/libtest1.jar",
+                DATA_DIR_TOP "src/tools/singlejar/libtest2.jar"});
+
+  string out2_path = OutputFilePath("out2.jar");
+  OutputJar output_jar2;
+  Options options2;
+  const char *option_list[] = {
+      "--output", out2_path.c_str(), "--normalize", "--previous_output",
+      out1_path.c_str(), "--previous_index", index_path.c_str(), "--sources",
+      DATA_DIR_TOP "src/tools/singlejar/libtest1.jar",
+      DATA_DIR_TOP "src/tools/singlejar/libtest2.jar"};
+  options2.ParseCommandLine(arraysize(option_list), option_list);
+  ASSERT_EQ(0, output_jar2.Doit(&options2));
+  EXPECT_EQ(0, VerifyZip(out2_path));
+
+  // Both outputs should have the same entries with the same contents.
+  InputJar input_jar1, input_jar2;
+  ASSERT_TRUE(input_jar1.Open(out1_path));
+  ASSERT_TRUE(input_jar2.Open(out2_path));
+  const LH *lh1, *lh2;
+  const CDH *cdh1, *cdh2;
+  while ((cdh1 = input_jar1.NextEntry(&lh1))) {
+    cdh2 = input_jar2.NextEntry(&lh2);
+    ASSERT_NE(nullptr, cdh2);
+    string name = cdh1->file_name_string();
+    EXPECT_EQ(name, cdh2->file_name_string());
+    if (name != "build-data.properties") {
+      EXPECT_EQ(cdh1->crc32(), cdh2->crc32()) << "Entry: " << name;
+      EXPECT_EQ(GetEntryContents(out1_path, name),
+                GetEntryContents(out2_path, name))
+          << "Entry: " << name;
+    }
+  }
+  EXPECT_EQ(nullptr, input_jar2.NextEntry(&lh2));
+  input_jar1.Close();
+  input_jar2.Close();
+}
+
+// Verify --profile argument.
+TEST_F(OutputJarSimpleTest, Profile) {
+  string out_path = OutputFilePath("out.jar");
+  string profile_path = OutputFilePath("profile.json");
+  CreateOutput(out_path,
+               {"--normalize", "--profile", profile_path, "--sources",
+                DATA_DIR_TOP "src/tools/singlejar/libtest1.jar",
+                DATA_DIR_TOP "src/tools/singlejar/libtest2.jar"});
+  string profile;
+  ASSERT_TRUE(blaze_util::ReadFile(profile_path, &profile));
+  EXPECT_EQ('{', profile.front());
+  EXPECT_NE(string::npos, profile.find("\"write_cen_seconds\": "));
+  EXPECT_NE(string::npos, profile.find("\"normalized_headers\": "));
+  EXPECT_NE(string::npos,
+            profile.find("{\"path\": \"" DATA_DIR_TOP
+                         "src/tools/singlejar/libtest2.jar\", "));
+  EXPECT_NE(string::npos,
+            profile.find("{\"entry\": \"META-INF/MANIFEST.MF\", "
+                         "\"type\": \"Concatenator\", "));
+  EXPECT_NE(string::npos,
+            profile.find("{\"entry\": \"build-data.properties\", "
+                         "\"type\": \"PropertyCombiner\", "));
+}
+
+// Verify that the entries created by singlejar are cached and reused.
+TEST_F(OutputJarSimpleTest, CacheDir) {
+  string cache_dir = OutputFilePath("cache");
+  ASSERT_EQ(0, system(("rm -rf " + cache_dir).c_str()));
+  string out_path = OutputFilePath("out.jar");
+  string profile_path = OutputFilePath("profile.json");
+  // Without --compression, the compressed entries are decompressed.
+  CreateOutput(out_path,
+               {"--normalize", "--cache_dir", cache_dir, "--profile",
+                profile_path, "--sources",
+                DATA_DIR_TOP "src/tools/singlejar/libtest1.jar"});
+  string profile;
+  ASSERT_TRUE(blaze_util::ReadFile(profile_path, &profile));
+  EXPECT_NE(string::npos, profile.find("\"cached_entries\": 0,"));
+  EXPECT_EQ(string::npos, profile.find("\"recompressed_entries\": 0,"));
+
+  string out_contents;
+  ASSERT_TRUE(blaze_util::ReadFile(out_path, &out_contents));
+
+  // The second run copies these entries from the cache, creating the same
+  // output.
+  const char *args[] = {"--output", out_path.c_str(), "--normalize",
+                        "--cache_dir", cache_dir.c_str(), "--profile",
+                        profile_path.c_str(), "--sources",
+                        DATA_DIR_TOP "src/tools/singlejar/libtest1.jar"};
+  Options options2;
+  options2.ParseCommandLine(sizeof(args) / sizeof(args[0]), args);
+  OutputJar output_jar2;
+  ASSERT_EQ(0, output_jar2.Doit(&options2));
+  ASSERT_TRUE(blaze_util::ReadFile(profile_path, &profile));
+  EXPECT_EQ(string::npos, profile.find("\"cached_entries\": 0,"));
+  EXPECT_NE(string::npos, profile.find("\"recompressed_entries\": 0,"));
+  string out2_contents;
+  ASSERT_TRUE(blaze_util::ReadFile(out_path, &out2_contents));
+  EXPECT_EQ(out_contents, out2_contents);
+}
+
+// Verify that the output written to the mapping is the same.
+TEST_F(OutputJarSimpleTest, MmapOutput) {
+  string out_path = OutputFilePath("out.jar");
+  string cp_res_path = CreateTextFile("cp_res", "line1\nline2\n");
+  CreateOutput(out_path,
+               {"--normalize", "--mmap_output", "--java_launcher",
+                DATA_DIR_TOP "src/tools/singlejar/libtest1.jar",
+                "--classpath_resources", cp_res_path, "--sources",
+                DATA_DIR_TOP "src/tools/singlejar/libtest1.jar",
+                DATA_DIR_TOP "src/tools/singlejar/stored.jar"});
+  string out_contents;
+  ASSERT_TRUE(blaze_util::ReadFile(out_path, &out_contents));
+
+  // Write it again, to the same path, so that build-data.properties is the
+  // same.
+  const char *args[] = {"--output", out_path.c_str(), "--normalize",
+                        "--java_launcher",
+                        DATA_DIR_TOP "src/tools/singlejar/libtest1.jar",
+                        "--classpath_resources", cp_res_path.c_str(),
+                        "--sources",
+                        DATA_DIR_TOP "src/tools/singlejar/libtest1.jar",
+                        DATA_DIR_TOP "src/tools/singlejar/stored.jar"};
+  Options options2;
+  options2.ParseCommandLine(sizeof(args) / sizeof(args[0]), args);
+  OutputJar output_jar2;
+  ASSERT_EQ(0, output_jar2.Doit(&options2));
+  string out2_contents;
+  ASSERT_TRUE(blaze_util::ReadFile(out_path, &out2_contents));
+  EXPECT_EQ(out_contents, out2_contents);
+}
+
 // Verify --java_launcher argument
 TEST_F(OutputJarSimpleTest, JavaLauncher) {
   string out_path = OutputFilePath("out.jar");
@@ -297,6 +544,20 @@ TEST_F(OutputJarSimpleTest, BuildInfoFile) {
   EXPECT_PRED2(HasSubstr, build_properties, "property=value\n");
 }
 
+// The properties defined more than once in build info.
+TEST_F(OutputJarSimpleTest, BuildInfoDuplicates) {
+  string build_info_path = CreateTextFile(
+      "buildinfo", "# comment\nproperty1=value2\nproperty2=value3\n");
+  string out_path = OutputFilePath("out.jar");
+  CreateOutput(out_path, {"--extra_build_info", "property1=value1",
+                          "--build_info_file", build_info_path,
+                          "--extra_build_info", "property2=value4"});
+  string build_properties = GetEntryContents(out_path, "build-data.properties");
+  EXPECT_EQ("build.target=" + out_path +
+                "\nproperty1=value2\nproperty2=value3\n",
+            build_properties);
+}
+
 // --resources option.
 TEST_F(OutputJarSimpleTest, Resources) {
   string res11_path = CreateTextFile("res11", "res11.line1\nres11.line2\n");
@@ -385,6 +646,34 @@ TEST_F(OutputJarSimpleTest, ClasspathResources) {
   EXPECT_EQ("line1\nline2\n", res);
 }
 
+// Verify that the large combined entries, which are streamed out rather
+// than created in memory, are written correctly.
+TEST_F(OutputJarSimpleTest, LargeCombinedEntries) {
+  CheckLargeCombinedEntries({});
+}
+
+TEST_F(OutputJarSimpleTest, LargeCombinedEntriesCompressed) {
+  CheckLargeCombinedEntries({"--compression"});
+}
+
+TEST_F(OutputJarSimpleTest, LargeCombinedEntriesCompressedThreads) {
+  CheckLargeCombinedEntries({"--compression", "--threads", "2"});
+}
+
+// The output mapping has to grow for these.
+TEST_F(OutputJarSimpleTest, LargeCombinedEntriesMmapOutput) {
+  CheckLargeCombinedEntries({"--mmap_output"});
+}
+
+// --threads N
+TEST_F(OutputJarSimpleTest, ThreadsOutputMatchesSerial) {
+  CheckThreadsOutput({});
+}
+
+TEST_F(OutputJarSimpleTest, ThreadsOutputMatchesSerialCompressed) {
+  CheckThreadsOutput({"--compression"});
+}
+
 // Duplicate entries for --resources or --classpath_resources
 TEST_F(OutputJarSimpleTest, DuplicateResources) {
   string cp_res_path = CreateTextFile("cp_res", "line1\nline2\n");
@@ -0,0 +1,321 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Generates a set of synthetic input jars and reports how fast singlejar
+// combines them.
+// Usage:
+//   singlejar_benchmark [--jars N] [--entries N] [--entry_size BYTES]
+//                       [--duplicates FRACTION] [--stored FRACTION]
+//                       [--services N] [--runs N] [-- SINGLEJAR_OPTION...]
+// Each jar has --entries class files of about --entry_size bytes and
+// --services META-INF/services files (which singlejar has to combine).
+// The --duplicates fraction of the class files have the same names in all
+// the jars, the --stored fraction of them are stored rather than deflated.
+// The options after -- are passed to singlejar.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "src/tools/singlejar/diag.h"
+#include "src/tools/singlejar/options.h"
+#include "src/tools/singlejar/output_jar.h"
+#include "src/tools/singlejar/zip_headers.h"
+#include "src/tools/singlejar/zlib_interface.h"
+
+#include <zlib.h>
+
+namespace {
+
+// Writes a jar without Zip64 extensions, so it can have at most 65535
+// entries of less than 4GB each.
+class JarWriter {
+ public:
+  explicit JarWriter(const std::string &path)
+      : path_(path),
+        file_(fopen(path.c_str(), "wb")),
+        offset_(0),
+        entries_(0) {
+    if (file_ == nullptr) {
+      diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path.c_str());
+    }
+  }
+
+  void AddEntry(const std::string &name, const std::string &contents,
+                bool compress) {
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef *>(contents.data()),
+                         contents.size());
+    std::string data = compress ? Deflate(contents) : contents;
+
+    std::vector<uint8_t> lh_buffer(sizeof(LH) + name.size());
+    LH *lh = reinterpret_cast<LH *>(lh_buffer.data());
+    lh->signature();
+    lh->version(20);
+    lh->bit_flag(0);
+    lh->compression_method(compress ? Z_DEFLATED : Z_NO_COMPRESSION);
+    lh->last_mod_file_time(0);
+    lh->last_mod_file_date(0x4A21);  // 2017-01-01
+    lh->crc32(crc);
+    lh->compressed_file_size32(data.size());
+    lh->uncompressed_file_size32(contents.size());
+    lh->file_name(name.data(), name.size());
+    lh->extra_fields(nullptr, 0);
+
+    size_t cen_size = cen_.size();
+    cen_.resize(cen_size + sizeof(CDH) + name.size());
+    CDH *cdh = reinterpret_cast<CDH *>(&cen_[cen_size]);
+    cdh->signature();
+    cdh->version(20);
+    cdh->version_to_extract(20);
+    cdh->bit_flag(0);
+    cdh->compression_method(lh->compression_method());
+    cdh->last_mod_file_time(lh->last_mod_file_time());
+    cdh->last_mod_file_date(lh->last_mod_file_date());
+    cdh->crc32(crc);
+    cdh->compressed_file_size32(data.size());
+    cdh->uncompressed_file_size32(contents.size());
+    cdh->file_name(name.data(), name.size());
+    cdh->extra_fields(nullptr, 0);
+    cdh->comment_length(0);
+    cdh->start_disk_nr(0);
+    cdh->internal_attributes(0);
+    cdh->external_attributes(0);
+    cdh->local_header_offset32(offset_);
+
+    Write(lh_buffer.data(), lh_buffer.size());
+    Write(data.data(), data.size());
+    ++entries_;
+  }
+
+  void Close() {
+    if (entries_ > 0xFFFF) {
+      diag_errx(1, "%s:%d: %s: too many entries", __FILE__, __LINE__,
+                path_.c_str());
+    }
+    ECD ecd;
+    memset(&ecd, 0, sizeof(ecd));
+    ecd.signature();
+    ecd.this_disk_entries16(entries_);
+    ecd.total_entries16(entries_);
+    ecd.cen_size32(cen_.size());
+    ecd.cen_offset32(offset_);
+    Write(cen_.data(), cen_.size());
+    Write(&ecd, sizeof(ecd));
+    if (fclose(file_)) {
+      diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path_.c_str());
+    }
+    file_ = nullptr;
+  }
+
+  // Bytes written so far.
+  off_t size() const { return offset_; }
+
+ private:
+  std::string Deflate(const std::string &contents) {
+    deflater_.reset();
+    std::string data(deflateBound(&deflater_, contents.size()), '\0');
+    deflater_.next_out = reinterpret_cast<Bytef *>(&data[0]);
+    deflater_.avail_out = data.size();
+    if (deflater_.Deflate(reinterpret_cast<const uint8_t *>(contents.data()),
+                          contents.size(), Z_FINISH) != Z_STREAM_END) {
+      diag_errx(1, "%s:%d: deflate failed", __FILE__, __LINE__);
+    }
+    data.resize(data.size() - deflater_.avail_out);
+    return data;
+  }
+
+  void Write(const void *data, size_t size) {
+    if (size && fwrite(data, size, 1, file_) != 1) {
+      diag_err(1, "%s:%d: %s", __FILE__, __LINE__, path_.c_str());
+    }
+    offset_ += size;
+  }
+
+  const std::string path_;
+  FILE *file_;
+  off_t offset_;
+  int entries_;
+  std::vector<uint8_t> cen_;
+  Deflater deflater_;
+};
+
+// Returns deterministic text of the given size which compresses roughly as
+// well as the class files do.
+std::string Contents(uint32_t seed, size_t size) {
+  static const char *words[] = {
+      "java/lang/Object", "java/lang/String", "<init>", "()V", "Code",
+      "LineNumberTable", "LocalVariableTable", "this", "SourceFile",
+      "java/util/List", "get", "(I)Ljava/lang/Object;", "StackMapTable",
+      "com/example/", "Exceptions", "InnerClasses"};
+  std::string result;
+  result.reserve(size + 32);
+  uint32_t x = seed * 2654435761u + 1;
+  while (result.size() < size) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    if (x & 1) {
+      result += words[(x >> 1) % (sizeof(words) / sizeof(words[0]))];
+    } else {
+      result += static_cast<char>(x >> 8);
+    }
+  }
+  result.resize(size);
+  return result;
+}
+
+double ParseNumber(const char *flag, const char *value, double max) {
+  char *end;
+  double result = strtod(value, &end);
+  if (*end || result < 0 || result > max) {
+    diag_errx(1, "%s:%d: bad %s value: %s", __FILE__, __LINE__, flag, value);
+  }
+  return result;
+}
+
+long PeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  int jars = 10;
+  int entries = 10000;
+  int entry_size = 4096;
+  double duplicates = 0.1;
+  double stored = 0.5;
+  int services = 2;
+  int runs = 3;
+  std::vector<std::string> singlejar_options;
+  for (int i = 1; i < argc; ++i) {
+    const char *flag = argv[i];
+    if (!strcmp(flag, "--")) {
+      singlejar_options.assign(argv + i + 1, argv + argc);
+      break;
+    }
+    if (i + 1 == argc) {
+      diag_errx(1, "%s:%d: %s requires a value", __FILE__, __LINE__, flag);
+    }
+    const char *value = argv[++i];
+    if (!strcmp(flag, "--jars")) {
+      jars = ParseNumber(flag, value, 1 << 20);
+    } else if (!strcmp(flag, "--entries")) {
+      entries = ParseNumber(flag, value, 0xFFFF);
+    } else if (!strcmp(flag, "--entry_size")) {
+      entry_size = ParseNumber(flag, value, 1 << 30);
+    } else if (!strcmp(flag, "--duplicates")) {
+      duplicates = ParseNumber(flag, value, 1);
+    } else if (!strcmp(flag, "--stored")) {
+      stored = ParseNumber(flag, value, 1);
+    } else if (!strcmp(flag, "--services")) {
+      services = ParseNumber(flag, value, 1000);
+    } else if (!strcmp(flag, "--runs")) {
+      runs = ParseNumber(flag, value, 1000);
+    } else {
+      diag_errx(1, "%s:%d: unknown option %s", __FILE__, __LINE__, flag);
+    }
+  }
+
+  const char *tmpdir = getenv("TEST_TMPDIR");
+  std::string dir = std::string(tmpdir ? tmpdir : "/tmp") +
+                    "/singlejar_benchmark.XXXXXX";
+  if (mkdtemp(&dir[0]) == nullptr) {
+    diag_err(1, "%s:%d: %s", __FILE__, __LINE__, dir.c_str());
+  }
+
+  // The entries whose index is below shared_entries have the same name in
+  // every jar; every stored_step-th entry is stored.
+  const int shared_entries = entries * duplicates;
+  const int stored_step = stored > 0 ? 1 / stored + 0.5 : 0;
+  std::vector<std::string> jar_paths;
+  off_t input_bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int j = 0; j < jars; ++j) {
+    jar_paths.push_back(dir + "/input" + std::to_string(j) + ".jar");
+    JarWriter writer(jar_paths.back());
+    for (int i = 0; i < entries; ++i) {
+      std::string package = i < shared_entries
+                                ? "shared"
+                                : "jar" + std::to_string(j);
+      writer.AddEntry(
+          "com/example/" + package + "/C" + std::to_string(i) + ".class",
+          Contents(j * entries + i, entry_size),
+          stored_step == 0 || i % stored_step != 0);
+    }
+    for (int i = 0; i < services; ++i) {
+      writer.AddEntry(
+          "META-INF/services/com.example.Service" + std::to_string(i),
+          "com.example.jar" + std::to_string(j) + ".Service" +
+              std::to_string(i) + "Impl\n",
+          true);
+    }
+    writer.Close();
+    input_bytes += writer.size();
+  }
+  const long input_entries = static_cast<long>(jars) * (entries + services);
+  printf("Generated %d jars, %ld entries, %lld bytes in %.3fs\n", jars,
+         input_entries, static_cast<long long>(input_bytes),
+         std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+             .count());
+
+  const std::string output = dir + "/out.jar";
+  printf("%-4s %9s %12s %9s %9s %9s %9s %9s %11s\n", "run", "seconds",
+         "entries/s", "MB/s", "open", "scan", "combine", "write_cen",
+         "peak_rss_kb");
+  for (int run = 0; run < runs; ++run) {
+    std::vector<std::string> args = {"--output", output};
+    args.insert(args.end(), singlejar_options.begin(),
+                singlejar_options.end());
+    args.push_back("--sources");
+    args.insert(args.end(), jar_paths.begin(), jar_paths.end());
+    std::vector<const char *> singlejar_argv;
+    for (auto &arg : args) {
+      singlejar_argv.push_back(arg.c_str());
+    }
+    Options options;
+    options.ParseCommandLine(singlejar_argv.size(), singlejar_argv.data());
+    OutputJar output_jar;
+    auto run_start = std::chrono::steady_clock::now();
+    if (output_jar.Doit(&options)) {
+      diag_errx(1, "%s:%d: singlejar failed", __FILE__, __LINE__);
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - run_start)
+                         .count();
+    auto &phase_times = output_jar.phase_times();
+    printf("%-4d %9.3f %12.0f %9.1f %9.3f %9.3f %9.3f %9.3f %11ld\n", run,
+           seconds, input_entries / seconds,
+           input_bytes / seconds / (1 << 20), phase_times.open,
+           phase_times.scan, phase_times.combine, phase_times.write_cen,
+           PeakRssKb());
+    unlink(output.c_str());
+  }
+
+  for (auto &jar_path : jar_paths) {
+    unlink(jar_path.c_str());
+  }
+  rmdir(dir.c_str());
+  return 0;
+}
@@ -15,6 +15,7 @@
 #ifndef THIRD_PARTY_BAZEL_SRC_TOOLS_SINGLEJAR_TOKEN_STREAM_H_
 #define THIRD_PARTY_BAZEL_SRC_TOOLS_SINGLEJAR_TOKEN_STREAM_H_ 1
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -207,6 +208,30 @@ class ArgTokenStream {
     return true;
   }
 
+  // Process --OPTION NUMBER
+  // If the current token is --OPTION, set OPTARG to the value of the next
+  // token (which should be a decimal integer), proceed to the next token after
+  // it and return true.
+  bool MatchAndSet(const char *option, int *optarg) {
+    if (token_.compare(option) != 0) {
+      return false;
+    }
+    next();
+    if (AtEnd()) {
+      diag_errx(1, "%s requires argument", option);
+    }
+    char *endptr;
+    long value = strtol(token_.c_str(), &endptr, 10);
+    if (token_.empty() || *endptr != '\0' || value < INT_MIN ||
+        value > INT_MAX) {
+      diag_errx(1, "%s requires an integer argument, got %s", option,
+                token_.c_str());
+    }
+    *optarg = static_cast<int>(value);
+    next();
+    return true;
+  }
+
   // Process --OPTION OPTARG1 OPTARG2 ...
   // If a current token is --OPTION, push_back all subsequent tokens up to the
   // next option to the OPTARGS array, proceed to the next option and return
@@ -115,3 +115,16 @@ TEST(TokenStreamTest, OptargMulti) {
 
   EXPECT_TRUE(token_stream.AtEnd());
 }
+
+// '--arg1 42 --arg2 -1' command line.
+TEST(TokenStreamTest, OptargInt) {
+  const char *args[] = {"--arg1", "42", "--arg2", "-1"};
+  ArgTokenStream token_stream(ARRAY_SIZE(args), args);
+  int optval = 0;
+  EXPECT_FALSE(token_stream.MatchAndSet("--arg2", &optval));
+  ASSERT_TRUE(token_stream.MatchAndSet("--arg1", &optval));
+  EXPECT_EQ(42, optval);
+  ASSERT_TRUE(token_stream.MatchAndSet("--arg2", &optval));
+  EXPECT_EQ(-1, optval);
+  EXPECT_TRUE(token_stream.AtEnd());
+}
@@ -16,6 +16,7 @@
 
 #include <inttypes.h>
 #include <algorithm>
+#include <memory>
 #include <ostream>
 
 #include "src/tools/singlejar/diag.h"
@@ -142,9 +143,11 @@ class TransientBytes {
   // Writes the contents bytes to the given buffer in an optimal way, i.e., the
   // shorter of compressed or uncompressed. Sets the checksum and number of
   // bytes written and returns Z_DEFLATED if compression took place or
-  // Z_NO_COMPRESSION otherwise.
+  // Z_NO_COMPRESSION otherwise. Uses given deflater (resetting it first)
+  // if it is not null, or creates a new one.
   uint16_t CompressOut(uint8_t *buffer, uint32_t *checksum,
-                       uint64_t *bytes_written) {
+                       uint64_t *bytes_written,
+                       Deflater *reusable_deflater = nullptr) {
     *checksum = 0;
     uint64_t to_compress = data_size();
     if (to_compress == 0) {
@@ -152,7 +155,14 @@ class TransientBytes {
       return Z_NO_COMPRESSION;
     }
 
-    Deflater deflater;
+    std::unique_ptr<Deflater> own_deflater;
+    if (reusable_deflater == nullptr) {
+      own_deflater.reset(new Deflater());
+      reusable_deflater = own_deflater.get();
+    } else {
+      reusable_deflater->reset();
+    }
+    Deflater &deflater = *reusable_deflater;
     deflater.next_out = buffer;
     uint16_t compression_method = Z_DEFLATED;
 
@@ -162,7 +172,8 @@ class TransientBytes {
          data_block && compression_method != Z_NO_COMPRESSION;
          data_block = data_block->next_block_) {
       // The compressed size should not exceed the original size less the number
-      // of bytes already compressed. And, it should not exceed 4GB-1.
+      // of bytes already compressed. A single deflate() call cannot write
+      // more than 4GB-1, but the total may well exceed that.
       deflater.avail_out = std::min(data_size() - deflater.total_out,
                                     static_cast<uint64_t>(0xFFFFFFFF));
       // Out of the total number of bytes that remain to be compressed, we
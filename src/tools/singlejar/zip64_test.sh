@@ -56,6 +56,41 @@ function test_65Kentries() {
   local -ir n_entries=$("$jartool" -tf "$outzip" | wc -l)
   ((${n_entries:-0} > 65536)) || \
     { echo Expected 65536 entries, got "$n_entries" >&2; exit 1; }
+
+  # Spilling the central directory to a file should not change the output.
+  local -r outzip_spilled="$TEST_TMPDIR/out65K_spilled.zip"
+  rm -f "$outzip"
+  "$singlejar" --normalize --output "$outzip" --sources "$inzip"
+  mv "$outzip" "$outzip_spilled"
+  "$singlejar" --normalize --cen_buffer_mb 1 --output "$outzip" \
+    --sources "$inzip"
+  cmp "$outzip" "$outzip_spilled" || \
+    { echo Spilling the central directory changed the output >&2; exit 1; }
+}
+
+# Test that an entry larger than 4GB can be copied and decompressed. The
+# input is created from a sparse file, and singlejar streams the contents,
+# so neither holds it in memory.
+function test_entry_above_4G() {
+  local -r top="$TEST_TMPDIR/entry_above_4G"
+  local -r inzip="$TEST_TMPDIR/in_huge.zip"
+  local -r outzip="$TEST_TMPDIR/out_huge.zip"
+  local -r size=5368709120  # 5GB
+  mkdir -p "$top"
+  truncate -s "$size" "$top/huge"
+  rm -f "$inzip" "$outzip"
+  (cd "$top" && "$jartool" -cf "$inzip" huge)
+  rm -f "$top/huge"
+
+  # Copied as is with --dont_change_compression, decompressed otherwise.
+  for option in --dont_change_compression --normalize; do
+    "$singlejar" "$option" --output "$outzip" --sources "$inzip"
+    local out_size=$("$jartool" -tvf "$outzip" | awk '$NF == "huge" {print $1}')
+    [[ "$out_size" == "$size" ]] || \
+      { echo Expected "$size" bytes entry, got "$out_size" >&2; exit 1; }
+    rm -f "$outzip"
+  done
+  rm -f "$inzip"
 }
 
 run_suite "singlejar Zip64 handling"
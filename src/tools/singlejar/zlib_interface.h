@@ -79,7 +79,8 @@ class Inflater {
 // NOTE that the size of the data to inflate by a single call cannot exceed
 // 4GB-1.
 struct Deflater : z_stream {
-  Deflater() {
+  Deflater(int level = Z_DEFAULT_COMPRESSION,
+           int strategy = Z_DEFAULT_STRATEGY) {
     zalloc = Z_NULL;
     zfree = Z_NULL;
     opaque = Z_NULL;
@@ -87,8 +88,8 @@ struct Deflater : z_stream {
     avail_in = 0;
     next_out = nullptr;
     avail_out = 0;
-    int ret = deflateInit2(this, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
-                           8, Z_DEFAULT_STRATEGY);
+    int ret =
+        deflateInit2(this, level, Z_DEFLATED, -MAX_WBITS, 8, strategy);
     if (ret != Z_OK) {
       diag_errx(2, "deflateInit returned %d (%s)", ret, msg);
     }
@@ -96,6 +97,8 @@ struct Deflater : z_stream {
 
   ~Deflater() { deflateEnd(this); }
 
+  void reset() { deflateReset(this); }
+
   int Deflate(const uint8_t *data, uint32_t data_size, int flag) {
     next_in = const_cast<uint8_t *>(data);
     avail_in = data_size;
@@ -110,11 +110,94 @@ enum TARGET_TYPE {
 
 struct Constant;
 
+// A bump allocator for the objects describing the class being stripped,
+// which are all released at once when it has been written. The memory is
+// kept for the next class, so stripping a class does not call malloc() for
+// these objects once the arena has grown to fit the largest class.
+class Arena {
+ public:
+  Arena() : next_(NULL), available_(0) {}
+
+  ~Arena() {
+    for (const auto &block : blocks_) {
+      free(block.start);
+    }
+  }
+
+  void *Allocate(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    if (size > available_) {
+      AddBlock(size);
+    }
+    void *result = next_;
+    next_ += size;
+    available_ -= size;
+    return result;
+  }
+
+  // Releases all the memory allocated so far. If it took more than one
+  // block, they are replaced by a single one of their total size.
+  void Reset() {
+    if (blocks_.size() > 1) {
+      size_t total_size = 0;
+      for (const auto &block : blocks_) {
+        total_size += block.size;
+        free(block.start);
+      }
+      blocks_.clear();
+      AddBlock(total_size);
+    }
+    if (!blocks_.empty()) {
+      next_ = blocks_[0].start;
+      available_ = blocks_[0].size;
+    }
+  }
+
+ private:
+  struct Block {
+    u1 *start;
+    size_t size;
+  };
+
+  static const size_t kAlignment = 16;
+  static const size_t kMinBlockSize = 64 * 1024;
+
+  void AddBlock(size_t size) {
+    if (size < kMinBlockSize) {
+      size = kMinBlockSize;
+    }
+    Block block = {reinterpret_cast<u1 *>(malloc(size)), size};
+    if (block.start == NULL) {
+      fprintf(stderr, "Cannot allocate %zu bytes.\n", size);
+      abort();
+    }
+    blocks_.push_back(block);
+    next_ = block.start;
+    available_ = size;
+  }
+
+  std::vector<Block> blocks_;
+  u1 *next_;
+  size_t available_;
+};
+
+// Every thread strips its own classes.
+static thread_local Arena arena;
+
+// The objects of the classes derived from this one are allocated in the
+// arena. Deleting them only runs the destructor, the memory is released by
+// Arena::Reset() after the class has been written.
+struct ArenaAllocated {
+  static void *operator new(size_t size) { return arena.Allocate(size); }
+  static void operator delete(void *) {}
+};
+
 // TODO(adonovan) these globals are unfortunate
-static std::vector<Constant*>        const_pool_in; // input constant pool
-static std::vector<Constant*>        const_pool_out; // output constant_pool
-static std::set<std::string>         used_class_names;
-static Constant *                    class_name;
+// They are thread-local, so that the classes can be stripped concurrently.
+static thread_local std::vector<Constant*> const_pool_in;  // input pool
+static thread_local std::vector<Constant*> const_pool_out;  // output pool
+static thread_local std::set<std::string>  used_class_names;
+static thread_local Constant *             class_name;
 
 // Returns the Constant object, given an index into the input constant pool.
 // Note: constant(0) == NULL; this invariant is exploited by the
@@ -134,7 +217,7 @@ inline Constant *constant(int idx) {
  **********************************************************************/
 
 // See sec.4.4 of JVM spec.
-struct Constant {
+struct Constant : ArenaAllocated {
 
   Constant(u1 tag) :
       slot_(0),
@@ -420,7 +503,7 @@ struct Constant_InvokeDynamic : Constant
  **********************************************************************/
 
 // See sec.4.7 of JVM spec.
-struct Attribute {
+struct Attribute : ArenaAllocated {
 
   virtual ~Attribute() {}
   virtual void Write(u1 *&p) = 0;
@@ -461,7 +544,7 @@ struct ExceptionsAttribute : Attribute {
 // See sec.4.7.6 of JVM spec.
 struct InnerClassesAttribute : Attribute {
 
-  struct Entry {
+  struct Entry : ArenaAllocated {
     Constant *inner_class_info;
     Constant *outer_class_info;
     Constant *inner_name;
@@ -582,7 +665,7 @@ struct EnclosingMethodAttribute : Attribute {
 
 // See sec.4.7.16.1 of JVM spec.
 // Used by AnnotationDefault and other attributes.
-struct ElementValue {
+struct ElementValue : ArenaAllocated {
   virtual ~ElementValue() {}
   virtual void Write(u1 *&p) = 0;
   virtual void ExtractClassNames() {}
@@ -671,7 +754,7 @@ struct ArrayTypeElementValue : ElementValue {
 };
 
 // See sec.4.7.16 of JVM spec.
-struct Annotation {
+struct Annotation : ArenaAllocated {
   virtual ~Annotation() {
     for (size_t i = 0; i < element_value_pairs_.size(); i++) {
       delete element_value_pairs_[i]->element_value_;
@@ -706,7 +789,7 @@ struct Annotation {
     return value;
   }
   Constant *type_;
-  struct ElementValuePair {
+  struct ElementValuePair : ArenaAllocated {
     Constant *element_name_;
     ElementValue *element_value_;
   };
@@ -743,7 +826,7 @@ struct Annotation {
 //   element_value_pairs[num_element_value_pairs];
 // }
 //
-struct TypeAnnotation {
+struct TypeAnnotation : ArenaAllocated {
   virtual ~TypeAnnotation() {
     delete target_info_;
     delete type_path_;
@@ -770,7 +853,7 @@ struct TypeAnnotation {
     return value;
   }
 
-  struct TargetInfo {
+  struct TargetInfo : ArenaAllocated {
     virtual ~TargetInfo() {}
     virtual void Write(u1 *&p) = 0;
   };
@@ -870,7 +953,7 @@ struct TypeAnnotation {
     }
   }
 
-  struct TypePath {
+  struct TypePath : ArenaAllocated {
     void Write(u1 *&p) {
       put_u1(p, path_.size());
       for (TypePathEntry entry : path_) {
@@ -1184,7 +1267,7 @@ struct MethodParametersAttribute : Attribute {
     put_u4be(payload_start, p - 4 - payload_start);  // backpatch length
   }
 
-  struct MethodParameter {
+  struct MethodParameter : ArenaAllocated {
     Constant *name_;
     u2 access_flags_;
   };
@@ -1218,7 +1301,7 @@ struct GeneralAttribute : Attribute {
  *                                                                    *
  **********************************************************************/
 
-struct HasAttrs {
+struct HasAttrs : ArenaAllocated {
   std::vector<Attribute*> attributes;
 
   void WriteAttrs(u1 *&p);
@@ -1790,6 +1873,7 @@ bool StripClass(u1 *&classdata_out, const u1 *classdata_in, size_t in_length) {
     put_n(classdata_out, classdata_in, in_length);
   } else if (clazz->IsLocalOrAnonymous()) {
     keep = false;
+    delete clazz;
   } else {
 
     // Constant pool item zero is a dummy entry.  Setting it marks the
@@ -1809,6 +1893,7 @@ bool StripClass(u1 *&classdata_out, const u1 *classdata_in, size_t in_length) {
 
   const_pool_in.clear();
   const_pool_out.clear();
+  arena.Reset();
   return keep;
 }
 
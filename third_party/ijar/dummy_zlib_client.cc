@@ -21,6 +21,8 @@ namespace devtools_ijar {
 
 u4 ComputeCrcChecksum(u1* buf, size_t length) { return 0; }
 
+u4 UpdateCrcChecksum(u4 crc, const u1* buf, size_t length) { return 0; }
+
 size_t TryDeflate(u1* buf, size_t length) { return 0; }
 
 Decompressor::Decompressor() {}
@@ -31,6 +33,15 @@ DecompressedFile* Decompressor::UncompressFile(const u1* buffer,
   return NULL;
 }
 
+bool Decompressor::StartStream(const u1* buffer, size_t bytes_avail,
+                               size_t chunk_size) {
+  return false;
+}
+
+int Decompressor::NextChunk(const u1** data, size_t* size) { return -1; }
+
+size_t Decompressor::StreamCompressedSize() { return 0; }
+
 char* Decompressor::GetError() { return NULL; }
 
 int Decompressor::error(const char* fmt, ...) { return 0; }
@@ -20,9 +20,22 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "src/main/cpp/util/md5.h"
+#include "third_party/ijar/platform_utils.h"
 #include "third_party/ijar/zip.h"
+#include "third_party/ijar/zlib_client.h"
 
 namespace devtools_ijar {
 
@@ -36,22 +49,281 @@ bool StripClass(u1*& classdata_out, const u1* classdata_in, size_t in_length);
 const char* CLASS_EXTENSION = ".class";
 const size_t CLASS_EXTENSION_LENGTH = strlen(CLASS_EXTENSION);
 
+// A directory caching the stripped classes of the input jars, in one file
+// per jar named after the digest of the jar's path. The file packs the
+// stripped classes of the last run on the jar, keyed by their name, CRC-32
+// and size in the jar's central directory, so that a class is looked up
+// before it is even uncompressed. Each run replaces the file with the
+// classes of the current jar, so the cache holds a single version of each
+// jar. The file is written to a temporary name and renamed, so concurrent
+// ijar processes may share the directory.
+//
+// The file holds kMagic followed by a record per class:
+//   u4 name length, name, u4 CRC-32, u4 size, u1 'K' (kept) or 'D' (dropped),
+//   u4 stripped length, stripped class
+// with the numbers in native byte order. A file that cannot be parsed is
+// ignored.
+class ClassCache {
+ public:
+  ClassCache(const char* dir, const char* jar)
+      : dir_(dir), jar_(jar), hits_(0), misses_(0) {}
+
+  // Creates the directory unless it exists, and loads the classes cached for
+  // the jar. Returns false upon failure.
+  bool Init() {
+    Stat file_stat;
+    if (stat_file(dir_.c_str(), &file_stat)) {
+      if (!file_stat.is_directory) {
+        return false;
+      }
+    } else {
+      std::string path = dir_ + "/";
+      if (path[0] != '/') {
+        path = get_cwd() + "/" + path;
+      }
+      if (!make_dirs(path.c_str(), 0755)) {
+        return false;
+      }
+    }
+    packed_.assign(kMagic, sizeof(kMagic));
+    Load();
+    return true;
+  }
+
+  // Looks up the class with given name, CRC-32 and size. Upon a hit, points
+  // *classdata (owned by the cache) to the stripped class, sets *length and
+  // *keep, and returns true.
+  bool Lookup(const std::string& name, u4 crc32, size_t size,
+              const u1** classdata, size_t* length, bool* keep) {
+    auto it = entries_.find(name);
+    if (it == entries_.end() || it->second.crc32 != crc32 ||
+        it->second.size != size) {
+      ++misses_;
+      return false;
+    }
+    *classdata = reinterpret_cast<const u1*>(loaded_.data()) +
+                 it->second.offset;
+    *length = it->second.length;
+    *keep = it->second.keep;
+    Add(name, crc32, size, *classdata, *length, *keep);
+    ++hits_;
+    return true;
+  }
+
+  // Adds the stripped class to the file written by Save(). Called by the
+  // worker threads as well.
+  void Add(const std::string& name, u4 crc32, size_t size,
+           const u1* classdata, size_t length, bool keep) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    AppendU4(name.size());
+    packed_.append(name);
+    AppendU4(crc32);
+    AppendU4(size);
+    packed_.push_back(keep ? 'K' : 'D');
+    AppendU4(keep ? length : 0);
+    if (keep) {
+      packed_.append(reinterpret_cast<const char*>(classdata), length);
+    }
+  }
+
+  // Replaces the file of the jar by the classes added since Init(), unless
+  // they are all taken from it. Failures are ignored, the classes are
+  // stripped again next time.
+  void Save() {
+    if (misses_ == 0 && static_cast<size_t>(hits_) == entries_.size()) {
+      return;
+    }
+    std::string path = Path();
+    // Unique among the processes writing the same jar.
+    std::string tmp =
+        path + ".tmp." + std::to_string(get_pid()) + "." +
+        std::to_string(
+            std::chrono::steady_clock::now().time_since_epoch().count());
+    // A failed write may leave a partial file behind, remove it as well.
+    if (!write_file(tmp.c_str(), 0644, packed_.data(), packed_.size()) ||
+        rename(tmp.c_str(), path.c_str()) != 0) {
+      remove(tmp.c_str());
+    }
+  }
+
+  int hits() const { return hits_; }
+  int misses() const { return misses_; }
+
+ private:
+  // Bump the version when StripClass output or the file format changes.
+  static constexpr char kMagic[] = "ijar-class-cache-2";
+
+  struct Entry {
+    u4 crc32;
+    size_t size;
+    bool keep;
+    // The stripped class in loaded_.
+    size_t offset;
+    size_t length;
+  };
+
+  std::string Path() const {
+    blaze_util::Md5Digest digest;
+    digest.Update(jar_.data(), jar_.size());
+    unsigned char sum[blaze_util::Md5Digest::kDigestLength];
+    digest.Finish(sum);
+    return dir_ + "/" + digest.String();
+  }
+
+  // Reads the file of the jar into loaded_ and indexes its classes in
+  // entries_. Leaves entries_ empty if there is no valid file.
+  void Load() {
+    std::string path = Path();
+    Stat file_stat;
+    if (!stat_file(path.c_str(), &file_stat) || file_stat.is_directory ||
+        file_stat.total_size < sizeof(kMagic)) {
+      return;
+    }
+    loaded_.resize(file_stat.total_size);
+    if (!read_file(path.c_str(), &loaded_[0], loaded_.size()) ||
+        loaded_.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+      loaded_.clear();
+      return;
+    }
+    size_t pos = sizeof(kMagic);
+    while (pos < loaded_.size()) {
+      u4 name_length;
+      Entry entry;
+      u4 size;
+      u4 length;
+      if (!ReadU4(&pos, &name_length) ||
+          loaded_.size() - pos < name_length) {
+        break;
+      }
+      std::string name = loaded_.substr(pos, name_length);
+      pos += name_length;
+      if (!ReadU4(&pos, &entry.crc32) || !ReadU4(&pos, &size) ||
+          pos == loaded_.size()) {
+        break;
+      }
+      entry.size = size;
+      entry.keep = loaded_[pos++] == 'K';
+      if (!ReadU4(&pos, &length) || loaded_.size() - pos < length) {
+        break;
+      }
+      entry.offset = pos;
+      entry.length = length;
+      pos += length;
+      entries_[name] = entry;
+    }
+    if (pos != loaded_.size()) {
+      entries_.clear();
+      loaded_.clear();
+    }
+  }
+
+  bool ReadU4(size_t* pos, u4* value) const {
+    if (loaded_.size() - *pos < sizeof(u4)) {
+      return false;
+    }
+    memcpy(value, loaded_.data() + *pos, sizeof(u4));
+    *pos += sizeof(u4);
+    return true;
+  }
+
+  void AppendU4(u4 value) {
+    packed_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  const std::string dir_;
+  const std::string jar_;
+  // The contents of the file loaded by Init().
+  std::string loaded_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::mutex mutex_;
+  // The contents of the file written by Save().
+  std::string packed_;
+  std::atomic<int> hits_;
+  std::atomic<int> misses_;
+};
+
+constexpr char ClassCache::kMagic[];
+
 // ZipExtractorProcessor that select only .class file and use
 // StripClass to generate an interface class, storing as a new file
 // in the specified ZipBuilder.
+// With more than one thread, the classes are uncompressed and stripped on
+// worker threads, and added to the ZipBuilder in the input order by
+// Finish(), so the output is the same.
+// With a ClassCache, the classes are looked up by ProcessRaw(), before they
+// are uncompressed.
 class JarStripperProcessor : public ZipExtractorProcessor {
  public:
-  JarStripperProcessor() {}
-  virtual ~JarStripperProcessor() {}
+  explicit JarStripperProcessor(int threads = 1, ClassCache* cache = NULL)
+      : builder(NULL),
+        threads_(threads),
+        cache_(cache),
+        crc32_(0),
+        stopping_(false) {}
+  virtual ~JarStripperProcessor();
 
   virtual void Process(const char* filename, const u4 attr,
                        const u1* data, const size_t size);
+  virtual bool ProcessRaw(const char* filename, const u4 attr,
+                          const u1* data, const size_t compressed_size,
+                          const size_t size, const bool compressed,
+                          const u4 crc32);
   virtual bool Accept(const char* filename, const u4 attr);
 
+  // Add the classes still being stripped to the ZipBuilder.
+  void Finish();
+
  private:
+  // A class handed over to the worker threads.
+  struct StripTask {
+    std::string filename;
+    const u1* data;
+    size_t compressed_size;
+    size_t size;
+    bool compressed;
+    u4 crc32;
+    // Set by the worker thread.
+    bool done;
+    bool keep;
+    u1* classdata_out;  // malloc()ed
+    size_t out_length;
+    std::string error;
+  };
+
+  // Uncompresses and strips the classes in queue_ until Finish() is called.
+  void WorkerLoop();
+  // Uncompresses and strips the class of the task.
+  void Strip(StripTask* task, Decompressor* decompressor);
+  // Strips the class to classdata_out (at least in_length bytes long) and
+  // adds it to the cache. Returns true if the class should be kept.
+  bool StripAndCache(const std::string& filename, u4 crc32, size_t size,
+                     u1* classdata_out, size_t* out_length,
+                     const u1* classdata_in, size_t in_length);
+  // Takes the class from the cache if it is there. Returns false otherwise.
+  bool ProcessCached(const char* filename, size_t size, u4 crc32);
+  // Waits for the oldest task and adds its class to the ZipBuilder.
+  void WriteNext(std::unique_lock<std::mutex>* lock);
+  // Copies a class stripped by a worker thread to the ZipBuilder.
+  void WriteClass(const char* filename, const u1* classdata, size_t length);
+
   // Not owned by JarStripperProcessor, see SetZipBuilder().
   ZipBuilder* builder;
 
+  const int threads_;
+  // Not owned, NULL if the classes are not cached.
+  ClassCache* const cache_;
+  // The CRC-32 of the class passed by ProcessRaw() to Process().
+  u4 crc32_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable queued_;    // A task was added to queue_.
+  std::condition_variable finished_;  // A worker has finished a task.
+  bool stopping_;
+  // The tasks waiting for a worker thread.
+  std::deque<StripTask*> queue_;
+  // All the tasks whose classes have not been written yet, in input order.
+  std::deque<std::unique_ptr<StripTask> > pending_;
+
  public:
   // Set the ZipBuilder to add the ijar class to the output zip file.
   // This pointer should not be deleted while this class is still in use and
@@ -75,23 +347,224 @@ void JarStripperProcessor::Process(const char* filename, const u4 attr,
   if (verbose) {
     fprintf(stderr, "INFO: StripClass: %s\n", filename);
   }
-  u1* buf = reinterpret_cast<u1*>(malloc(size));
-  u1* classdata_out = buf;
-  if (!StripClass(buf, data, size)) {
-    free(classdata_out);
-    return;
-  }
-  u1* q = builder->NewFile(filename, 0);
-  size_t out_length = buf - classdata_out;
-  memcpy(q, classdata_out, out_length);
-  builder->FinishFile(out_length);
-  free(classdata_out);
+  // The class is stripped right into the output; it is never larger than
+  // the input class.
+  u1* classdata_out = builder->ReserveFile(filename, 0, size);
+  if (classdata_out == NULL) {
+    fprintf(stderr, "%s\n", builder->GetError());
+    abort();
+  }
+  size_t out_length;
+  if (StripAndCache(filename, crc32_, size, classdata_out, &out_length, data,
+                    size) &&
+      builder->CommitFile(out_length) < 0) {
+    fprintf(stderr, "%s\n", builder->GetError());
+    abort();
+  }
+}
+
+bool JarStripperProcessor::StripAndCache(const std::string& filename,
+                                         u4 crc32, size_t size,
+                                         u1* classdata_out, size_t* out_length,
+                                         const u1* classdata_in,
+                                         size_t in_length) {
+  u1* buf = classdata_out;
+  bool keep = StripClass(buf, classdata_in, in_length);
+  *out_length = buf - classdata_out;
+  if (cache_ != NULL) {
+    cache_->Add(filename, crc32, size, classdata_out, *out_length, keep);
+  }
+  return keep;
+}
+
+void JarStripperProcessor::WriteClass(const char* filename,
+                                      const u1* classdata, size_t length) {
+  u1* q = builder->ReserveFile(filename, 0, length);
+  if (q == NULL) {
+    fprintf(stderr, "%s\n", builder->GetError());
+    abort();
+  }
+  memcpy(q, classdata, length);
+  if (builder->CommitFile(length) < 0) {
+    fprintf(stderr, "%s\n", builder->GetError());
+    abort();
+  }
+}
+
+// The number of the classes per thread which may be stripped ahead of the
+// one to be written next. Limits the memory held by the stripped classes.
+static const size_t kTasksPerThread = 16;
+
+bool JarStripperProcessor::ProcessRaw(const char* filename, const u4 attr,
+                                      const u1* data,
+                                      const size_t compressed_size,
+                                      const size_t size,
+                                      const bool compressed,
+                                      const u4 crc32) {
+  if (cache_ != NULL && ProcessCached(filename, size, crc32)) {
+    return true;
+  }
+  if (threads_ <= 1) {
+    crc32_ = crc32;
+    return false;
+  }
+  if (workers_.empty()) {
+    for (int i = 0; i < threads_; ++i) {
+      workers_.emplace_back(&JarStripperProcessor::WorkerLoop, this);
+    }
+  }
+  StripTask* task = new StripTask;
+  task->filename = filename;
+  task->data = data;
+  task->compressed_size = compressed_size;
+  task->size = size;
+  task->compressed = compressed;
+  task->crc32 = crc32;
+  task->done = false;
+  task->keep = false;
+  task->classdata_out = NULL;
+  task->out_length = 0;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_.emplace_back(task);
+  queue_.push_back(task);
+  queued_.notify_one();
+  while (pending_.size() > kTasksPerThread * threads_) {
+    WriteNext(&lock);
+  }
+  return true;
+}
+
+bool JarStripperProcessor::ProcessCached(const char* filename, size_t size,
+                                         u4 crc32) {
+  const u1* classdata;
+  size_t length;
+  bool keep;
+  if (!cache_->Lookup(filename, crc32, size, &classdata, &length, &keep)) {
+    return false;
+  }
+  if (threads_ <= 1) {
+    if (verbose) {
+      fprintf(stderr, "INFO: StripClass: %s\n", filename);
+    }
+    if (keep) {
+      WriteClass(filename, classdata, length);
+    }
+    return true;
+  }
+  // Written after the classes still being stripped.
+  StripTask* task = new StripTask;
+  task->filename = filename;
+  task->done = true;
+  task->keep = keep;
+  task->classdata_out = NULL;
+  if (keep) {
+    task->classdata_out = reinterpret_cast<u1*>(malloc(length));
+    memcpy(task->classdata_out, classdata, length);
+  }
+  task->out_length = length;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  pending_.emplace_back(task);
+  while (pending_.size() > kTasksPerThread * threads_) {
+    WriteNext(&lock);
+  }
+  return true;
+}
+
+void JarStripperProcessor::Finish() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!pending_.empty()) {
+    WriteNext(&lock);
+  }
+  stopping_ = true;
+  queued_.notify_all();
+  lock.unlock();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+JarStripperProcessor::~JarStripperProcessor() {
+  Finish();
+}
+
+void JarStripperProcessor::WriteNext(std::unique_lock<std::mutex>* lock) {
+  StripTask* task = pending_.front().get();
+  finished_.wait(*lock, [task] { return task->done; });
+  std::unique_ptr<StripTask> written(pending_.front().release());
+  pending_.pop_front();
+  // The ZipBuilder is only used by this thread.
+  lock->unlock();
+  if (!task->error.empty()) {
+    fprintf(stderr, "%s\n", task->error.c_str());
+    abort();
+  }
+  if (verbose) {
+    fprintf(stderr, "INFO: StripClass: %s\n", task->filename.c_str());
+  }
+  if (task->keep) {
+    WriteClass(task->filename.c_str(), task->classdata_out, task->out_length);
+  }
+  free(task->classdata_out);
+  lock->lock();
+}
+
+void JarStripperProcessor::WorkerLoop() {
+  Decompressor decompressor;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queued_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    StripTask* task = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    Strip(task, &decompressor);
+    lock.lock();
+    task->done = true;
+    finished_.notify_all();
+  }
+}
+
+void JarStripperProcessor::Strip(StripTask* task, Decompressor* decompressor) {
+  const u1* data = task->data;
+  size_t size = task->size;
+  if (task->compressed) {
+    DecompressedFile* decompressed =
+        decompressor->UncompressFile(task->data, task->compressed_size);
+    if (decompressed == NULL) {
+      const char* error = decompressor->GetError();
+      task->error = error != NULL ? error : "Cannot uncompress " +
+                                                task->filename;
+      return;
+    }
+    data = decompressed->uncompressed_data;
+    size = decompressed->uncompressed_size;
+    free(decompressed);
+  }
+  task->classdata_out = reinterpret_cast<u1*>(malloc(size));
+  task->keep = StripAndCache(task->filename, task->crc32, task->size,
+                             task->classdata_out, &task->out_length, data,
+                             size);
 }
 
 // Opens "file_in" (a .jar file) for reading, and writes an interface
 // .jar to "file_out".
-void OpenFilesAndProcessJar(const char *file_out, const char *file_in) {
-  JarStripperProcessor processor;
+// Stripped classes are looked up in and added to "cache_dir" unless NULL.
+void OpenFilesAndProcessJar(const char *file_out, const char *file_in,
+                            int threads, const char *cache_dir) {
+  std::unique_ptr<ClassCache> cache;
+  if (cache_dir != NULL) {
+    cache.reset(new ClassCache(cache_dir, file_in));
+    if (!cache->Init()) {
+      fprintf(stderr, "Unable to create cache directory %s\n", cache_dir);
+      abort();
+    }
+  }
+  JarStripperProcessor processor(threads, cache.get());
   std::unique_ptr<ZipExtractor> in(ZipExtractor::Create(file_in, &processor));
   if (in.get() == NULL) {
     fprintf(stderr, "Unable to open Zip file %s: %s\n", file_in,
@@ -112,6 +585,10 @@ void OpenFilesAndProcessJar(const char *file_out, const char *file_in) {
     fprintf(stderr, "%s\n", in->GetError());
     abort();
   }
+  processor.Finish();
+  if (cache != NULL) {
+    cache->Save();
+  }
 
   // Add dummy file, since javac doesn't like truly empty jars.
   if (out->GetNumberFiles() == 0) {
@@ -129,6 +606,10 @@ void OpenFilesAndProcessJar(const char *file_out, const char *file_in) {
     fprintf(stderr, "INFO: produced interface jar: %s -> %s (%d%%).\n",
             file_in, file_out,
             static_cast<int>(100.0 * out_length / in_length));
+    if (cache != NULL) {
+      fprintf(stderr, "INFO: class cache: %d hits, %d misses.\n",
+              cache->hits(), cache->misses());
+    }
   }
 }
 
@@ -138,18 +619,33 @@ void OpenFilesAndProcessJar(const char *file_out, const char *file_in) {
 // main method
 //
 static void usage() {
-  fprintf(stderr, "Usage: ijar [-v] x.jar [x_interface.jar>]\n");
+  fprintf(stderr,
+          "Usage: ijar [-v] [--threads N] [--cache_dir DIR] x.jar "
+          "[x_interface.jar>]\n");
   fprintf(stderr, "Creates an interface jar from the specified jar file.\n");
+  fprintf(stderr, "With --threads, the classes are stripped by N threads.\n");
+  fprintf(stderr, "With --cache_dir, the stripped classes of the jar are kept "
+          "in DIR, and reused\nfor the classes with the same name, CRC-32 "
+          "and size next time.\n");
   exit(1);
 }
 
 int main(int argc, char **argv) {
   const char *filename_in = NULL;
   const char *filename_out = NULL;
+  int threads = 1;
+  const char *cache_dir = NULL;
 
   for (int ii = 1; ii < argc; ++ii) {
     if (strcmp(argv[ii], "-v") == 0) {
       devtools_ijar::verbose = true;
+    } else if (strcmp(argv[ii], "--threads") == 0 && ii + 1 < argc) {
+      threads = atoi(argv[++ii]);
+      if (threads < 1) {
+        usage();
+      }
+    } else if (strcmp(argv[ii], "--cache_dir") == 0 && ii + 1 < argc) {
+      cache_dir = argv[++ii];
     } else if (filename_in == NULL) {
       filename_in = argv[ii];
     } else if (filename_out == NULL) {
@@ -182,6 +678,7 @@ int main(int argc, char **argv) {
     fprintf(stderr, "INFO: writing to '%s'.\n", filename_out);
   }
 
-  devtools_ijar::OpenFilesAndProcessJar(filename_out, filename_in);
+  devtools_ijar::OpenFilesAndProcessJar(filename_out, filename_in, threads,
+                                        cache_dir);
   return 0;
 }
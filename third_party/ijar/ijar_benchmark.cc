@@ -0,0 +1,118 @@
+// Copyright 2017 The Bazel Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// ijar_benchmark.cc -- reports how fast ijar strips the classes of given
+// jars (e.g., the JDK's rt.jar).
+//
+// Usage:
+//   ijar_benchmark [--runs N] x.jar...
+// The classes are uncompressed into memory first, so only StripClass is
+// measured.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "third_party/ijar/zip.h"
+
+namespace devtools_ijar {
+
+bool verbose = false;
+
+bool StripClass(u1*& classdata_out, const u1* classdata_in, size_t in_length);
+
+// Collects the contents of the class files.
+class ClassCollector : public ZipExtractorProcessor {
+ public:
+  explicit ClassCollector(std::vector<std::string>* classes)
+      : classes_(classes) {}
+
+  virtual bool Accept(const char* filename, const u4 attr) {
+    const size_t filename_len = strlen(filename);
+    return filename_len >= 6 &&
+           strcmp(filename + filename_len - 6, ".class") == 0;
+  }
+
+  virtual void Process(const char* filename, const u4 attr,
+                       const u1* data, const size_t size) {
+    classes_->emplace_back(reinterpret_cast<const char*>(data), size);
+  }
+
+ private:
+  std::vector<std::string>* classes_;
+};
+
+}  // namespace devtools_ijar
+
+int main(int argc, char** argv) {
+  using devtools_ijar::u1;
+  int runs = 5;
+  std::vector<std::string> classes;
+  for (int ii = 1; ii < argc; ++ii) {
+    if (strcmp(argv[ii], "--runs") == 0 && ii + 1 < argc) {
+      runs = atoi(argv[++ii]);
+      continue;
+    }
+    devtools_ijar::ClassCollector collector(&classes);
+    std::unique_ptr<devtools_ijar::ZipExtractor> in(
+        devtools_ijar::ZipExtractor::Create(argv[ii], &collector));
+    if (in.get() == NULL) {
+      fprintf(stderr, "Unable to open Zip file %s: %s\n", argv[ii],
+              strerror(errno));
+      return 1;
+    }
+    if (in->ProcessAll() < 0) {
+      fprintf(stderr, "%s\n", in->GetError());
+      return 1;
+    }
+  }
+  if (classes.empty()) {
+    fprintf(stderr, "Usage: ijar_benchmark [--runs N] x.jar...\n");
+    return 1;
+  }
+  size_t total_size = 0;
+  for (const auto& clazz : classes) {
+    total_size += clazz.size();
+  }
+  printf("%zu classes, %zu bytes\n", classes.size(), total_size);
+
+  printf("%-4s %9s %12s %9s %12s\n", "run", "seconds", "classes/s", "MB/s",
+         "output");
+  for (int run = 0; run < runs; ++run) {
+    size_t output_size = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& clazz : classes) {
+      u1* buf = reinterpret_cast<u1*>(malloc(clazz.size()));
+      u1* classdata_out = buf;
+      devtools_ijar::StripClass(
+          buf, reinterpret_cast<const u1*>(clazz.data()), clazz.size());
+      output_size += buf - classdata_out;
+      free(classdata_out);
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    printf("%-4d %9.3f %12.0f %9.1f %12zu\n", run, seconds,
+           classes.size() / seconds, total_size / seconds / (1 << 20),
+           output_size);
+  }
+  return 0;
+}
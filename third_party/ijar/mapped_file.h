@@ -75,7 +75,14 @@ class MappedOutputFile {
 
   // The mapped contents of the file.
   u1* Buffer() const { return buffer_; }
-  int Close(int size);
+
+  // Change the length of the file to "size" bytes and map all of it. The
+  // contents up to the smaller of the old and new lengths are kept, but the
+  // mapping may move, so Buffer() must be called again.
+  int Resize(u8 size);
+
+  // Unmap the file, truncate it to "size" bytes and close it.
+  int Close(u8 size);
 };
 
 }  // namespace devtools_ijar
@@ -87,9 +87,30 @@ int MappedInputFile::Close() {
 
 struct MappedOutputFileImpl {
   int fd_;
-  int mmap_length_;
+  size_t mmap_length_;
 };
 
+// Maps the "size" bytes of the file, and a page beyond. Returns NULL upon
+// failure and sets errmsg.
+static void* MapOutput(int fd, u8 size, size_t* mmap_length) {
+  // Create mmap-able sparse file
+  if (ftruncate(fd, size) < 0) {
+    snprintf(errmsg, MAX_ERROR, "ftruncate(): %s", strerror(errno));
+    return NULL;
+  }
+
+  // Ensure that any buffer overflow in JarStripper will result in
+  // SIGSEGV or SIGBUS by over-allocating beyond the end of the file.
+  *mmap_length = std::min(size + sysconf(_SC_PAGESIZE),
+                          (u8) std::numeric_limits<size_t>::max());
+  void* mapped = mmap(NULL, *mmap_length, PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    snprintf(errmsg, MAX_ERROR, "mmap(): %s", strerror(errno));
+    return NULL;
+  }
+  return mapped;
+}
+
 MappedOutputFile::MappedOutputFile(const char* name, u8 estimated_size) {
   impl_ = NULL;
   opened_ = false;
@@ -100,20 +121,9 @@ MappedOutputFile::MappedOutputFile(const char* name, u8 estimated_size) {
     return;
   }
 
-  // Create mmap-able sparse file
-  if (ftruncate(fd, estimated_size) < 0) {
-    snprintf(errmsg, MAX_ERROR, "ftruncate(): %s", strerror(errno));
-    errmsg_ = errmsg;
-    return;
-  }
-
-  // Ensure that any buffer overflow in JarStripper will result in
-  // SIGSEGV or SIGBUS by over-allocating beyond the end of the file.
-  size_t mmap_length = std::min(estimated_size + sysconf(_SC_PAGESIZE),
-                                (u8) std::numeric_limits<size_t>::max());
-  void* mapped = mmap(NULL, mmap_length, PROT_WRITE, MAP_SHARED, fd, 0);
-  if (mapped == MAP_FAILED) {
-    snprintf(errmsg, MAX_ERROR, "mmap(): %s", strerror(errno));
+  size_t mmap_length;
+  void* mapped = MapOutput(fd, estimated_size, &mmap_length);
+  if (mapped == NULL) {
     errmsg_ = errmsg;
     return;
   }
@@ -130,7 +140,20 @@ MappedOutputFile::~MappedOutputFile() {
   delete impl_;
 }
 
-int MappedOutputFile::Close(int size) {
+int MappedOutputFile::Resize(u8 size) {
+  munmap(buffer_, impl_->mmap_length_);
+  void* mapped = MapOutput(impl_->fd_, size, &impl_->mmap_length_);
+  if (mapped == NULL) {
+    errmsg_ = errmsg;
+    buffer_ = NULL;
+    impl_->mmap_length_ = 0;
+    return -1;
+  }
+  buffer_ = reinterpret_cast<u1*>(mapped);
+  return 0;
+}
+
+int MappedOutputFile::Close(u8 size) {
   munmap(buffer_, impl_->mmap_length_);
   if (ftruncate(impl_->fd_, size) < 0) {
     snprintf(errmsg, MAX_ERROR, "ftruncate(): %s", strerror(errno));
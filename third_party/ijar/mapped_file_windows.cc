@@ -138,6 +138,25 @@ struct MappedOutputFileImpl {
   }
 };
 
+// Maps the "size" bytes of the file, extending it if needed. Returns NULL
+// upon failure and sets errmsg.
+static void* MapOutput(HANDLE file, u8 size, HANDLE* mapping) {
+  *mapping = CreateFileMapping(file, NULL, PAGE_READWRITE,
+      size >> 32, size & 0xffffffffUL, NULL);
+  if (*mapping == NULL || *mapping == INVALID_HANDLE_VALUE) {
+    PrintLastError("CreateFileMapping()");
+    return NULL;
+  }
+
+  void *view = MapViewOfFileEx(*mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0, NULL);
+  if (view == NULL) {
+    PrintLastError("MapViewOfFileEx()");
+    CloseHandle(*mapping);
+    return NULL;
+  }
+  return view;
+}
+
 MappedOutputFile::MappedOutputFile(const char* name, u8 estimated_size) {
   impl_ = NULL;
   opened_ = false;
@@ -155,18 +174,9 @@ MappedOutputFile::MappedOutputFile(const char* name, u8 estimated_size) {
     return;
   }
 
-  HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READWRITE,
-      estimated_size >> 32, estimated_size & 0xffffffffUL, NULL);
-  if (mapping == NULL || mapping == INVALID_HANDLE_VALUE) {
-    PrintLastError("CreateFileMapping()");
-    CloseHandle(file);
-    return;
-  }
-
-  void *view = MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0, NULL);
+  HANDLE mapping;
+  void *view = MapOutput(file, estimated_size, &mapping);
   if (view == NULL) {
-    PrintLastError("MapViewOfFileEx()");
-    CloseHandle(mapping);
     CloseHandle(file);
     return;
   }
@@ -180,7 +190,35 @@ MappedOutputFile::~MappedOutputFile() {
   delete impl_;
 }
 
-int MappedOutputFile::Close(int size) {
+int MappedOutputFile::Resize(u8 size) {
+  if (!UnmapViewOfFile(buffer_)) {
+    PrintLastError("UnmapViewOfFile()");
+    return -1;
+  }
+
+  if (!CloseHandle(impl_->mapping_)) {
+    PrintLastError("CloseHandle(mapping)");
+    return -1;
+  }
+
+  // A file mapping cannot be smaller than the file.
+  LARGE_INTEGER end;
+  end.QuadPart = size;
+  if (!SetFilePointerEx(impl_->file_, end, NULL, FILE_BEGIN) ||
+      !SetEndOfFile(impl_->file_)) {
+    PrintLastError("SetEndOfFile()");
+    return -1;
+  }
+
+  void *view = MapOutput(impl_->file_, size, &impl_->mapping_);
+  if (view == NULL) {
+    return -1;
+  }
+  buffer_ = reinterpret_cast<u1*>(view);
+  return 0;
+}
+
+int MappedOutputFile::Close(u8 size) {
   if (!UnmapViewOfFile(buffer_)) {
     PrintLastError("UnmapViewOfFile()");
     return -1;
@@ -191,8 +229,10 @@ int MappedOutputFile::Close(int size) {
     return -1;
   }
 
-  if (!SetFilePointer(impl_->file_, size, NULL, FILE_BEGIN)) {
-    PrintLastError("SetFilePointer()");
+  LARGE_INTEGER end;
+  end.QuadPart = size;
+  if (!SetFilePointerEx(impl_->file_, end, NULL, FILE_BEGIN)) {
+    PrintLastError("SetFilePointerEx()");
     return -1;
   }
 
@@ -55,9 +55,8 @@ bool stat_file(const char* path, Stat* result) {
   if (handle != INVALID_HANDLE_VALUE &&
       ::GetFileInformationByHandle(handle, &info)) {
     success = true;
-    // TODO(laszlocsomor): use info.nFileSizeHigh after we updated total_size to
-    // be u8 type.
-    result->total_size = info.nFileSizeLow;
+    result->total_size =
+        (static_cast<u8>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
     // TODO(laszlocsomor): query the actual permissions and write in file_mode.
     result->file_mode = 0777;
     result->is_directory = (info.dwFileAttributes != INVALID_FILE_ATTRIBUTES) &&
@@ -82,12 +81,68 @@ bool write_file(const char* path, unsigned int perm, const void* data,
   return blaze_util::WriteFile(data, size, path, perm);
 }
 
+struct OutputFileImpl {
+  string path_;
+  blaze_util::file_handle_type handle_;
+  bool open_;
+};
+
+OutputFile::OutputFile() : impl_(new OutputFileImpl) { impl_->open_ = false; }
+
+OutputFile::~OutputFile() {
+  if (impl_->open_) {
+    blaze_util::CloseFileHandle(impl_->handle_);
+  }
+  delete impl_;
+}
+
+bool OutputFile::Open(const char* path, unsigned int perm) {
+  if (impl_->open_ && !Close()) {
+    return false;
+  }
+  impl_->path_ = path;
+  if (!blaze_util::OpenFileForWriting(impl_->path_, perm, &impl_->handle_)) {
+    fprintf(stderr, "Cannot create %s: %s\n", path,
+            blaze_util::GetLastErrorString().c_str());
+    return false;
+  }
+  impl_->open_ = true;
+  return true;
+}
+
+bool OutputFile::Write(const void* data, size_t size) {
+  if (!blaze_util::WriteToHandle(impl_->handle_, data, size)) {
+    fprintf(stderr, "Cannot write %s: %s\n", impl_->path_.c_str(),
+            blaze_util::GetLastErrorString().c_str());
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::Close() {
+  impl_->open_ = false;
+  if (!blaze_util::CloseFileHandle(impl_->handle_)) {
+    fprintf(stderr, "Cannot close %s: %s\n", impl_->path_.c_str(),
+            blaze_util::GetLastErrorString().c_str());
+    return false;
+  }
+  return true;
+}
+
 bool read_file(const char* path, void* buffer, size_t size) {
   return blaze_util::ReadFile(path, buffer, size);
 }
 
 string get_cwd() { return blaze_util::GetCwd(); }
 
+int get_pid() {
+#if defined(COMPILER_MSVC) || defined(__CYGWIN__)
+  return static_cast<int>(::GetCurrentProcessId());
+#else   // !(defined(COMPILER_MSVC) || defined(__CYGWIN__))
+  return getpid();
+#endif  // defined(COMPILER_MSVC) || defined(__CYGWIN__)
+}
+
 bool make_dirs(const char* path, unsigned int mode) {
 #ifndef COMPILER_MSVC
   // TODO(laszlocsomor): respect `mode` on Windows/MSVC.
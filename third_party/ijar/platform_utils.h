@@ -28,7 +28,7 @@ namespace devtools_ijar {
 // Platform-independent stat data.
 struct Stat {
   // Total size of the file in bytes.
-  int total_size;
+  u8 total_size;
   // The Unix file mode from the stat.st_mode field.
   mode_t file_mode;
   // True if this is a directory.
@@ -55,6 +55,32 @@ bool stat_file(const char* path, Stat* result);
 bool write_file(const char* path, unsigned int perm, const void* data,
                 size_t size);
 
+struct OutputFileImpl;
+
+// A file written in consecutive chunks, for the files that are too large to be
+// passed to write_file() in a single buffer.
+class OutputFile {
+ public:
+  OutputFile();
+  // Closes the file if it is still open.
+  ~OutputFile();
+
+  // Creates or overwrites the file under `path`, set to have `perm`
+  // permissions.
+  // Returns false upon failure and reports the error to stderr.
+  bool Open(const char* path, unsigned int perm);
+
+  // Appends `size` bytes from `data` to the file.
+  // Returns false upon failure and reports the error to stderr.
+  bool Write(const void* data, size_t size);
+
+  // Returns false upon failure and reports the error to stderr.
+  bool Close();
+
+ private:
+  OutputFileImpl* impl_;
+};
+
 // Reads at most `size` bytes into `buffer` from the file under `path`.
 // Returns true upon success: file is opened and all data is read.
 // Returns false upon failure and reports the error to stderr.
@@ -64,6 +90,9 @@ bool read_file(const char* path, void* buffer, size_t size);
 // Returns the empty string upon failure and reports the error to stderr.
 std::string get_cwd();
 
+// Returns the ID of the current process.
+int get_pid();
+
 // Do a recursive mkdir of all folders of path except the last path
 // segment (if path ends with a / then the last path segment is empty).
 // All folders are created using "perm" for creation mode, and are writable and
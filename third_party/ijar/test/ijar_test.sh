@@ -341,6 +341,37 @@ function test_wrong_centraldir() {
   fi
 }
 
+function test_threads() {
+  # Check that the classes stripped on several threads are written in the
+  # same order, and the interface jar is the same.
+  for jar in $TYPEANN2_JAR $INVOKEDYNAMIC_JAR $METHODPARAM_JAR \
+      $JAR_WRONG_CENTRAL_DIR; do
+    $IJAR $jar $TEST_TMPDIR/ijar.jar || fail "ijar failed"
+    $IJAR --threads 4 $jar $TEST_TMPDIR/ijar_threads.jar ||
+      fail "ijar --threads failed"
+    cmp $TEST_TMPDIR/ijar.jar $TEST_TMPDIR/ijar_threads.jar ||
+      fail "ijar --threads output differs for $jar"
+  done
+}
+
+function test_cache_dir() {
+  # Check that the classes taken from the cache give the same interface jar,
+  # and that the second run finds all of them there.
+  local -r cache_dir=$TEST_TMPDIR/ijar_cache
+  rm -fr $cache_dir
+  $IJAR $TYPEANN2_JAR $TEST_TMPDIR/ijar.jar || fail "ijar failed"
+  $IJAR -v --cache_dir $cache_dir $TYPEANN2_JAR $TEST_TMPDIR/ijar_miss.jar \
+      >& $TEST_log || fail "ijar --cache_dir failed"
+  expect_log "class cache: 0 hits, [1-9][0-9]* misses"
+  $IJAR -v --cache_dir $cache_dir --threads 2 $TYPEANN2_JAR \
+      $TEST_TMPDIR/ijar_hit.jar >& $TEST_log || fail "ijar --cache_dir failed"
+  expect_log "class cache: [1-9][0-9]* hits, 0 misses"
+  cmp $TEST_TMPDIR/ijar.jar $TEST_TMPDIR/ijar_miss.jar ||
+    fail "ijar --cache_dir output differs"
+  cmp $TEST_TMPDIR/ijar.jar $TEST_TMPDIR/ijar_hit.jar ||
+    fail "ijar --cache_dir output differs when the classes are cached"
+}
+
 function test_type_annotation() {
   # Check that constant pool references used by JSR308 type annotations are
   # preserved
@@ -168,4 +168,78 @@ function test_zipper_specify_path() {
       || fail "Unzip after zipper output is not expected"
 }
 
+function test_zipper_parallel() {
+  # The files read and compressed by several threads are added in order, so
+  # the zip is the same.
+  rm -fr ${TEST_TMPDIR}/parallel
+  mkdir -p ${TEST_TMPDIR}/parallel/dir
+  for i in $(seq 1 300); do
+    seq 1 $i > ${TEST_TMPDIR}/parallel/dir/file$i
+  done
+  touch ${TEST_TMPDIR}/parallel/empty
+  filelist="$(cd ${TEST_TMPDIR}/parallel && find . | sed 's|^./||' | grep -v '^.$')"
+  for flags in c cC cf; do
+    (cd ${TEST_TMPDIR}/parallel && $ZIPPER ${flags} ${TEST_TMPDIR}/serial.zip \
+        ${filelist}) || fail "zipper ${flags} failed"
+    (cd ${TEST_TMPDIR}/parallel && $ZIPPER ${flags}j ${TEST_TMPDIR}/output.zip \
+        ${filelist}) || fail "zipper ${flags}j failed"
+    cmp ${TEST_TMPDIR}/serial.zip ${TEST_TMPDIR}/output.zip \
+        || fail "zipper ${flags}j output differs"
+  done
+}
+
+function test_zipper_unzip_large_files() {
+  # Files larger than a chunk are extracted chunk by chunk.
+  rm -fr ${TEST_TMPDIR}/large
+  mkdir -p ${TEST_TMPDIR}/large/dir
+  seq 1 1000000 > ${TEST_TMPDIR}/large/dir/seq
+  head -c 3000000 /dev/urandom > ${TEST_TMPDIR}/large/random
+  echo "toto" > ${TEST_TMPDIR}/large/small
+  filelist="dir/seq random small"
+  for flags in c cC; do
+    (cd ${TEST_TMPDIR}/large && $ZIPPER ${flags} ${TEST_TMPDIR}/output.zip \
+        ${filelist}) || fail "zipper ${flags} failed"
+    rm -fr ${TEST_TMPDIR}/out
+    mkdir -p ${TEST_TMPDIR}/out
+    (cd ${TEST_TMPDIR}/out && $ZIPPER x ${TEST_TMPDIR}/output.zip) \
+        || fail "zipper x failed"
+    diff -r ${TEST_TMPDIR}/large ${TEST_TMPDIR}/out &> $TEST_log \
+        || fail "Unzip using zipper after zipper ${flags} output differ"
+  done
+}
+
+function test_zipper_many_entries() {
+  # More than 65535 entries need the zip64 end of central directory.
+  rm -fr ${TEST_TMPDIR}/many
+  mkdir -p ${TEST_TMPDIR}/many
+  for i in $(seq 0 69999); do
+    echo "empty$i.txt="
+  done > ${TEST_TMPDIR}/many.content
+  (cd ${TEST_TMPDIR}/many && $ZIPPER c ${TEST_TMPDIR}/output.zip \
+      @${TEST_TMPDIR}/many.content) || fail "zipper failed"
+  $UNZIP -tq ${TEST_TMPDIR}/output.zip &> $TEST_log || fail "unzip -t failed"
+  (cd ${TEST_TMPDIR}/many && $UNZIP -q ${TEST_TMPDIR}/output.zip) \
+      || fail "unzip failed"
+  [ "$(ls ${TEST_TMPDIR}/many | wc -l | xargs)" = 70000 ] \
+      || fail "Unzip after zipper did not give 70000 files"
+}
+
+function test_zipper_zip64() {
+  # A file of more than 4GB needs zip64 sizes, and the file after it a zip64
+  # offset. The file is sparse, but the zip is not.
+  rm -fr ${TEST_TMPDIR}/zip64
+  mkdir -p ${TEST_TMPDIR}/zip64
+  truncate -s 4300000000 ${TEST_TMPDIR}/zip64/large
+  echo "toto" > ${TEST_TMPDIR}/zip64/small
+  (cd ${TEST_TMPDIR}/zip64 && $ZIPPER c ${TEST_TMPDIR}/output.zip large small) \
+      || fail "zipper failed"
+  rm -fr ${TEST_TMPDIR}/zip64
+  $UNZIP -tq ${TEST_TMPDIR}/output.zip &> $TEST_log || fail "unzip -t failed"
+  $UNZIP -l ${TEST_TMPDIR}/output.zip > $TEST_log
+  expect_log "4300000000 .* large"
+  $UNZIP -p ${TEST_TMPDIR}/output.zip small > $TEST_log
+  expect_log "toto"
+  rm -f ${TEST_TMPDIR}/output.zip
+}
+
 run_suite "zipper tests"
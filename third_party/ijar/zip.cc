@@ -31,7 +31,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <algorithm>
 #include <limits>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "third_party/ijar/mapped_file.h"
@@ -50,6 +54,8 @@
 #define U2_MAX 0xffff
 #define U4_MAX 0xffffffffUL
 
+// local file header without the file name and the extra field
+#define LOCAL_FILE_HEADER_FIXED_SIZE 30
 #define ZIP64_EOCD_LOCATOR_SIZE 20
 // zip64 eocd is fixed size in the absence of a zip64 extensible data sector
 #define ZIP64_EOCD_FIXED_SIZE 56
@@ -57,6 +63,16 @@
 // version to extract: 1.0 - default value from APPNOTE.TXT.
 // Output JAR files contain no extra ZIP features, so this is enough.
 #define ZIP_VERSION_TO_EXTRACT                10
+// version to extract: 4.5 - for the entries with zip64 extra fields.
+#define ZIP64_VERSION_TO_EXTRACT              45
+// zip64 extended information extra field, which holds the sizes and offsets
+// that do not fit in 32 bits.
+#define ZIP64_EXTRA_FIELD_ID                  0x0001
+// zip64 extra field of a local header, with both the sizes
+#define ZIP64_LOCAL_EXTRA_FIELD_SIZE          20
+// extra field that only pads the header, which the zip readers skip (it is
+// the one zipalign uses).
+#define PADDING_EXTRA_FIELD_ID                0xD935
 #define COMPRESSION_METHOD_STORED             0   // no compression
 #define COMPRESSION_METHOD_DEFLATED           8
 
@@ -69,12 +85,11 @@
   | GENERAL_PURPOSE_BIT_FLAG_COMPRESSION_SPEED)
 
 namespace devtools_ijar {
-// In the absence of ZIP64 support, zip files are limited to 4GB.
-// http://www.info-zip.org/FAQ.html#limits
-static const u8 kMaximumOutputSize = std::numeric_limits<uint32_t>::max();
-
 static const u4 kDosEpoch = 1 << 21 | 1 << 16;  // January 1, 1980 in DOS time
 
+// The fewest files worth a thread of their own in ZipBuilder::EstimateSize().
+static const int kMinFilesPerThread = 256;
+
 //
 // A class representing a ZipFile for reading. Its public API is exposed
 // using the ZipExtractor abstract class.
@@ -103,7 +118,7 @@ class InputZipFile : public ZipExtractor {
   virtual bool ProcessCentralDirEntry(const u1 *&p, size_t *compressed_size,
                                       size_t *uncompressed_size, char *filename,
                                       size_t filename_size, u4 *attr,
-                                      u4 *offset);
+                                      u4 *offset, u4 *crc32);
 
  private:
   ZipExtractorProcessor *processor;
@@ -119,6 +134,10 @@ class InputZipFile : public ZipExtractor {
 
   size_t in_offset_;  // offset  the input file
 
+  // Set once the processor keeps pointers to the input, which then must not
+  // be unmapped before the destruction.
+  bool keep_mapped_;
+
   const u1 *p;  // input cursor
 
   const u1* central_dir_current_;  // central dir input cursor
@@ -141,6 +160,8 @@ class InputZipFile : public ZipExtractor {
   u2 compression_method_;
   u4 uncompressed_size_;
   u4 compressed_size_;
+  // From the central directory, since it may be zero in the local header.
+  u4 crc32_;
   u2 file_name_length_;
   u2 extra_field_length_;
   const u1 *file_name_;
@@ -193,6 +214,15 @@ class InputZipFile : public ZipExtractor {
   // cursor to the first byte after the compressed data.
   u1* UncompressFile();
 
+  // Pass a file to the processor chunk by chunk, see
+  // ZipExtractorProcessor::StartStream(). Advances the input cursor to the
+  // first byte after the file data.
+  int StreamFile(const bool compressed);
+
+  // Unmap the input that has been processed up to "processed_end", in
+  // regions of MAX_MAPPED_REGION, unless the processor keeps pointers to it.
+  void DiscardProcessed(const u1* processed_end);
+
   // Skip a file
   int SkipFile(const bool compressed);
 
@@ -209,7 +239,10 @@ class OutputZipFile : public ZipBuilder {
       output_file_(NULL),
       filename_(filename),
       estimated_size_(estimated_size),
-      finished_(false) {
+      finished_(false),
+      zip64_sizes_ptr_(NULL),
+      reserved_attr_(0),
+      reserved_zip64_(false) {
     errmsg[0] = 0;
   }
 
@@ -224,6 +257,13 @@ class OutputZipFile : public ZipBuilder {
   virtual u1* NewFile(const char* filename, const u4 attr);
   virtual int FinishFile(size_t filelength, bool compress = false,
                          bool compute_crc = false);
+  virtual u1* ReserveFile(const char* filename, const u4 attr,
+                          size_t max_length);
+  virtual int CommitFile(size_t filelength, bool compress = false,
+                         bool compute_crc = false);
+  virtual int WriteCompressedFile(const char* filename, const u4 attr,
+                                  const u1* data, size_t compressed_size,
+                                  size_t filelength, u4 crc);
   virtual int WriteEmptyFile(const char *filename);
   virtual size_t GetSize() {
     return Offset(q);
@@ -237,11 +277,11 @@ class OutputZipFile : public ZipBuilder {
  private:
   struct LocalFileEntry {
     // Start of the local header (in the output buffer).
-    size_t local_header_offset;
+    u8 local_header_offset;
 
     // Sizes of the file entry
-    size_t uncompressed_length;
-    size_t compressed_length;
+    u8 uncompressed_length;
+    u8 compressed_length;
 
     // Compression method
     u2 compression_method;
@@ -259,11 +299,16 @@ class OutputZipFile : public ZipBuilder {
     // Start/length of the extra_field in the local header.
     const u1 *extra_field;
     u2 extra_field_length;
+
+    // Whether the sizes are in the zip64 extra field of the local header. The
+    // central directory header has them both in its zip64 extra field as
+    // well, so that the headers match.
+    bool zip64_sizes;
   };
 
   MappedOutputFile* output_file_;
   const char* filename_;
-  u8 estimated_size_;
+  u8 estimated_size_;  // The size of the file, grown as needed.
   bool finished_;
 
   // OutputZipFile is responsible for maintaining the following
@@ -273,6 +318,14 @@ class OutputZipFile : public ZipBuilder {
   u1 *q;  // output cursor
 
   u1 *header_ptr;  // Current pointer to "compression method" entry.
+  // Current pointer to the sizes in the zip64 extra field of the local
+  // header, or NULL if the header has none.
+  u1 *zip64_sizes_ptr_;
+
+  // The file of the last ReserveFile() call.
+  std::string reserved_filename_;
+  u4 reserved_attr_;
+  bool reserved_zip64_;
 
   // List of entries to write the central directory
   std::vector<LocalFileEntry*> entries_;
@@ -288,9 +341,16 @@ class OutputZipFile : public ZipBuilder {
     return -1;
   }
 
+  // Make sure that "length" more bytes can be written at the output
+  // cursor, growing the file if needed. The pointers into the output,
+  // except for the cursor, are invalid afterwards.
+  // On failure, returns false and sets errmsg.
+  bool EnsureRoom(u8 length);
+
   // Write the ZIP central directory structure for each local file
   // entry in "entries".
-  void WriteCentralDirectory();
+  // On failure, returns -1 and sets errmsg.
+  int WriteCentralDirectory();
 
   // Returns the offset of the pointer relative to the start of the
   // output zip file.
@@ -301,15 +361,21 @@ class OutputZipFile : public ZipBuilder {
   // Write ZIP file header in the output. Since the compressed size is not
   // known in advance, it must be recorded later. This method returns a pointer
   // to "compressed size" in the file header that should be passed to
-  // WriteFileSizeInLocalFileHeader() later.
-  u1* WriteLocalFileHeader(const char *filename, const u4 attr);
+  // WriteFileSizeInLocalFileHeader() later. If "zip64" is true, the header
+  // has a zip64 extra field for the sizes, so the file may be 4GB or larger.
+  u1* WriteLocalFileHeader(const char *filename, const u4 attr,
+                           bool zip64 = false);
 
   // Fill in the "compressed size" and "uncompressed size" fields in a local
   // file header previously written by WriteLocalFileHeader().
-  size_t WriteFileSizeInLocalFileHeader(u1 *header_ptr,
-                                        size_t out_length,
-                                        bool compress = false,
-                                        const u4 crc = 0);
+  void WriteFileSizeInLocalFileHeader(u1 *header_ptr,
+                                      size_t compressed_size,
+                                      size_t out_length,
+                                      const u4 crc = 0);
+
+  // Record the sizes of the file whose local header was written last, and
+  // whose data, "compressed_size" bytes, is at the output cursor.
+  void FinishEntry(size_t compressed_size, size_t filelength, u4 crc);
 };
 
 //
@@ -321,7 +387,7 @@ bool InputZipFile::ProcessNext() {
   size_t compressed, uncompressed;
   u4 offset;
   if (!ProcessCentralDirEntry(central_dir_current_, &compressed, &uncompressed,
-                              filename, PATH_MAX, &attr, &offset)) {
+                              filename, PATH_MAX, &attr, &offset, &crc32_)) {
     return false;
   }
 
@@ -432,13 +498,19 @@ int InputZipFile::ProcessLocalFileEntry(
     }
   }
 
-  size_t bytes_processed = p - zipdata_in_;
-  if (bytes_processed > bytes_unmapped_ + MAX_MAPPED_REGION) {
+  DiscardProcessed(p);
+  return 0;
+}
+
+void InputZipFile::DiscardProcessed(const u1* processed_end) {
+  if (keep_mapped_) {
+    return;
+  }
+  size_t bytes_processed = processed_end - zipdata_in_;
+  while (bytes_processed > bytes_unmapped_ + MAX_MAPPED_REGION) {
     input_file_->Discard(MAX_MAPPED_REGION);
     bytes_unmapped_ += MAX_MAPPED_REGION;
   }
-
-  return 0;
 }
 
 int InputZipFile::SkipFile(const bool compressed) {
@@ -479,6 +551,23 @@ u1* InputZipFile::UncompressFile() {
 }
 
 int InputZipFile::ProcessFile(const bool compressed) {
+  if (!compressed && compressed_size_ != uncompressed_size_) {
+    return error("compressed size != uncompressed size, although the file "
+                 "is uncompressed.\n");
+  }
+  if (EnsureRemaining(compressed_size_, "file_data") < 0) {
+    return -1;
+  }
+  if (processor->ProcessRaw(filename, attr, p, compressed_size_,
+                            uncompressed_size_, compressed, crc32_)) {
+    keep_mapped_ = true;
+    p += compressed_size_;
+    return 0;
+  }
+  if (processor->StartStream(filename, attr, uncompressed_size_)) {
+    return StreamFile(compressed);
+  }
+
   const u1 *file_data;
   if (compressed) {
     file_data = UncompressFile();
@@ -488,14 +577,6 @@ int InputZipFile::ProcessFile(const bool compressed) {
   } else {
     // In this case, compressed_size_ == uncompressed_size_ (since the file is
     // uncompressed), so we can use either.
-    if (compressed_size_ != uncompressed_size_) {
-      return error("compressed size != uncompressed size, although the file "
-                   "is uncompressed.\n");
-    }
-
-    if (EnsureRemaining(compressed_size_, "file_data") < 0) {
-      return -1;
-    }
     file_data = p;
     p += compressed_size_;
   }
@@ -503,6 +584,44 @@ int InputZipFile::ProcessFile(const bool compressed) {
   return 0;
 }
 
+int InputZipFile::StreamFile(const bool compressed) {
+  const size_t chunk_size = ZipExtractorProcessor::STREAM_CHUNK_SIZE;
+  if (!compressed) {
+    const u1 *end = p + compressed_size_;
+    while (p < end) {
+      size_t length = std::min(static_cast<size_t>(end - p), chunk_size);
+      processor->ProcessChunk(p, length);
+      p += length;
+      DiscardProcessed(p);
+    }
+    processor->FinishStream();
+    return 0;
+  }
+
+  size_t in_offset = p - zipdata_in_;
+  size_t remaining = input_file_->Length() - in_offset;
+  if (!decompressor_->StartStream(p, remaining, chunk_size)) {
+    return error("%s", decompressor_->GetError());
+  }
+  size_t uncompressed_size = 0;
+  const u1 *chunk;
+  size_t length;
+  int ret;
+  while ((ret = decompressor_->NextChunk(&chunk, &length)) > 0) {
+    processor->ProcessChunk(chunk, length);
+    uncompressed_size += length;
+    DiscardProcessed(p + decompressor_->StreamCompressedSize());
+  }
+  if (ret < 0) {
+    return error("%s", decompressor_->GetError());
+  }
+  compressed_size_ = decompressor_->StreamCompressedSize();
+  uncompressed_size_ = uncompressed_size;
+  p += compressed_size_;
+  processor->FinishStream();
+  return 0;
+}
+
 
 // Reads and returns some metadata of the next file from the central directory:
 // - compressed size
@@ -517,7 +636,7 @@ int InputZipFile::ProcessFile(const bool compressed) {
 bool InputZipFile::ProcessCentralDirEntry(const u1 *&p, size_t *compressed_size,
                                           size_t *uncompressed_size,
                                           char *filename, size_t filename_size,
-                                          u4 *attr, u4 *offset) {
+                                          u4 *attr, u4 *offset, u4 *crc32) {
   u4 signature = get_u4le(p);
 
   if (signature != CENTRAL_FILE_HEADER_SIGNATURE) {
@@ -528,7 +647,8 @@ bool InputZipFile::ProcessCentralDirEntry(const u1 *&p, size_t *compressed_size,
     return false;
   }
 
-  p += 16;  // skip to 'compressed size' field
+  p += 12;  // skip to 'crc-32' field
+  *crc32 = get_u4le(p);
   *compressed_size = get_u4le(p);
   *uncompressed_size = get_u4le(p);
   u2 file_name_length = get_u2le(p);
@@ -561,13 +681,14 @@ u8 InputZipFile::CalculateOutputLength() {
   u8 skipped_compressed_size = 0;
   u4 attr;
   u4 offset;
+  u4 crc32;
   char filename[PATH_MAX];
 
   while (true) {
     size_t file_compressed, file_uncompressed;
     if (!ProcessCentralDirEntry(current,
                                 &file_compressed, &file_uncompressed,
-                                filename, PATH_MAX, &attr, &offset)) {
+                                filename, PATH_MAX, &attr, &offset, &crc32)) {
       break;
     }
 
@@ -783,6 +904,8 @@ void InputZipFile::Reset() {
   p = zipdata_in_ + in_offset_;
 }
 
+const size_t ZipExtractorProcessor::STREAM_CHUNK_SIZE;
+
 int ZipExtractor::ProcessAll() {
   while (ProcessNext()) {}
   if (GetError() != NULL) {
@@ -808,7 +931,7 @@ ZipExtractor* ZipExtractor::Create(const char* filename,
 InputZipFile::InputZipFile(ZipExtractorProcessor *processor,
                            const char* filename)
     : processor(processor), filename_(filename), input_file_(NULL),
-      bytes_unmapped_(0) {
+      bytes_unmapped_(0), keep_mapped_(false) {
   decompressor_ = new Decompressor();
   errmsg[0] = 0;
 }
@@ -862,6 +985,9 @@ InputZipFile::~InputZipFile() {
 int OutputZipFile::WriteEmptyFile(const char *filename) {
   const u1* file_name = (const u1*) filename;
   size_t file_name_length = strlen(filename);
+  if (!EnsureRoom(LOCAL_FILE_HEADER_FIXED_SIZE + file_name_length)) {
+    return -1;
+  }
 
   LocalFileEntry *entry = new LocalFileEntry;
   entry->local_header_offset = Offset(q);
@@ -893,45 +1019,85 @@ int OutputZipFile::WriteEmptyFile(const char *filename) {
   return 0;
 }
 
-void OutputZipFile::WriteCentralDirectory() {
+int OutputZipFile::WriteCentralDirectory() {
+  // The central directory headers are 46 bytes, and at most 28 bytes of zip64
+  // extra field, besides the file name and the extra field.
+  u8 central_directory_max_size =
+      ZIP64_EOCD_FIXED_SIZE + ZIP64_EOCD_LOCATOR_SIZE + 22;
+  for (size_t ii = 0; ii < entries_.size(); ++ii) {
+    central_directory_max_size += 46 + 28 + entries_[ii]->file_name_length +
+                                  entries_[ii]->extra_field_length;
+  }
+  if (!EnsureRoom(central_directory_max_size)) {
+    return -1;
+  }
+
   // central directory:
   const u1 *central_directory_start = q;
   for (size_t ii = 0; ii < entries_.size(); ++ii) {
     LocalFileEntry *entry = entries_[ii];
+    // The values which do not fit in the header go in the zip64 extra field.
+    bool zip64_uncompressed =
+        entry->zip64_sizes || entry->uncompressed_length >= U4_MAX;
+    bool zip64_compressed =
+        entry->zip64_sizes || entry->compressed_length >= U4_MAX;
+    bool zip64_offset = entry->local_header_offset >= U4_MAX;
+    u2 zip64_data_length =
+        8 * (zip64_uncompressed + zip64_compressed + zip64_offset);
+    u2 zip64_extra_field_length =
+        zip64_data_length > 0 ? 4 + zip64_data_length : 0;
+
     put_u4le(q, CENTRAL_FILE_HEADER_SIGNATURE);
     put_u2le(q, 0);  // version made by
 
-    put_u2le(q, ZIP_VERSION_TO_EXTRACT);  // version to extract
+    // version to extract
+    put_u2le(q, zip64_extra_field_length > 0 ? ZIP64_VERSION_TO_EXTRACT
+                                             : ZIP_VERSION_TO_EXTRACT);
     put_u2le(q, 0);  // general purpose bit flag
     put_u2le(q, entry->compression_method);  // compression method:
     put_u4le(q, kDosEpoch);                  // last_mod_file date and time
     put_u4le(q, entry->crc32);  // crc32
-    put_u4le(q, entry->compressed_length);    // compressed_size
-    put_u4le(q, entry->uncompressed_length);  // uncompressed_size
+    // compressed_size
+    put_u4le(q, zip64_compressed ? U4_MAX : entry->compressed_length);
+    // uncompressed_size
+    put_u4le(q, zip64_uncompressed ? U4_MAX : entry->uncompressed_length);
     put_u2le(q, entry->file_name_length);
-    put_u2le(q, entry->extra_field_length);
+    put_u2le(q, zip64_extra_field_length + entry->extra_field_length);
 
     put_u2le(q, 0);  // file comment length
     put_u2le(q, 0);  // disk number start
     put_u2le(q, 0);  // internal file attributes
     put_u4le(q, entry->external_attr);  // external file attributes
     // relative offset of local header:
-    put_u4le(q, entry->local_header_offset);
+    put_u4le(q, zip64_offset ? U4_MAX : entry->local_header_offset);
 
     put_n(q, entry->file_name, entry->file_name_length);
+    if (zip64_extra_field_length > 0) {
+      put_u2le(q, ZIP64_EXTRA_FIELD_ID);
+      put_u2le(q, zip64_data_length);
+      if (zip64_uncompressed) {
+        put_u8le(q, entry->uncompressed_length);
+      }
+      if (zip64_compressed) {
+        put_u8le(q, entry->compressed_length);
+      }
+      if (zip64_offset) {
+        put_u8le(q, entry->local_header_offset);
+      }
+    }
     put_n(q, entry->extra_field, entry->extra_field_length);
   }
   u8 central_directory_size = q - central_directory_start;
 
-  if (entries_.size() > U2_MAX || central_directory_size > U4_MAX ||
-      Offset(central_directory_start) > U4_MAX) {
+  if (entries_.size() >= U2_MAX || central_directory_size >= U4_MAX ||
+      Offset(central_directory_start) >= U4_MAX) {
     u1 *zip64_end_of_central_directory_start = q;
 
     put_u4le(q, ZIP64_EOCD_SIGNATURE);
     // signature and size field doesn't count towards size
     put_u8le(q, ZIP64_EOCD_FIXED_SIZE - 12);
-    put_u2le(q, 0);  // version made by
-    put_u2le(q, 0);  // version needed to extract
+    put_u2le(q, ZIP64_VERSION_TO_EXTRACT);  // version made by
+    put_u2le(q, ZIP64_VERSION_TO_EXTRACT);  // version needed to extract
     put_u4le(q, 0);  // number of this disk
     put_u4le(q, 0);  // # of the disk with the start of the central directory
     put_u8le(q, entries_.size());  // # central dir entries on this disk
@@ -952,9 +1118,9 @@ void OutputZipFile::WriteCentralDirectory() {
     put_u2le(q, 0);  // number of this disk
     put_u2le(q, 0);  // # of disk with the start of the central directory
     // # central dir entries on this disk
-    put_u2le(q, entries_.size() > 0xffff ? 0xffff : entries_.size());
+    put_u2le(q, entries_.size() > U2_MAX ? U2_MAX : entries_.size());
     // total # entries in the central directory
-    put_u2le(q, entries_.size() > 0xffff ? 0xffff : entries_.size());
+    put_u2le(q, entries_.size() > U2_MAX ? U2_MAX : entries_.size());
     // size of the central directory
     put_u4le(q,
              central_directory_size > U4_MAX ? U4_MAX : central_directory_size);
@@ -975,9 +1141,11 @@ void OutputZipFile::WriteCentralDirectory() {
     put_u4le(q, Offset(central_directory_start));
     put_u2le(q, 0);  // .ZIP file comment length
   }
+  return 0;
 }
 
-u1* OutputZipFile::WriteLocalFileHeader(const char* filename, const u4 attr) {
+u1* OutputZipFile::WriteLocalFileHeader(const char* filename, const u4 attr,
+                                        bool zip64) {
   off_t file_name_length_ = strlen(filename);
   LocalFileEntry *entry = new LocalFileEntry;
   entry->local_header_offset = Offset(q);
@@ -988,10 +1156,12 @@ u1* OutputZipFile::WriteLocalFileHeader(const char* filename, const u4 attr) {
   entry->extra_field_length = 0;
   entry->extra_field = (const u1 *)"";
   entry->crc32 = 0;
+  entry->zip64_sizes = zip64;
 
   // Output the ZIP local_file_header:
   put_u4le(q, LOCAL_FILE_HEADER_SIGNATURE);
-  put_u2le(q, ZIP_VERSION_TO_EXTRACT);     // version to extract
+  // version to extract
+  put_u2le(q, zip64 ? ZIP64_VERSION_TO_EXTRACT : ZIP_VERSION_TO_EXTRACT);
   put_u2le(q, 0);                          // general purpose bit flag
   u1 *header_ptr = q;
   put_u2le(q, COMPRESSION_METHOD_STORED);  // compression method = placeholder
@@ -1000,22 +1170,40 @@ u1* OutputZipFile::WriteLocalFileHeader(const char* filename, const u4 attr) {
   put_u4le(q, 0);  // compressed_size = placeholder
   put_u4le(q, 0);  // uncompressed_size = placeholder
   put_u2le(q, entry->file_name_length);
-  put_u2le(q, entry->extra_field_length);
+  put_u2le(q, (zip64 ? ZIP64_LOCAL_EXTRA_FIELD_SIZE : 0) +
+                  entry->extra_field_length);
 
   put_n(q, entry->file_name, entry->file_name_length);
+  zip64_sizes_ptr_ = NULL;
+  if (zip64) {
+    put_u2le(q, ZIP64_EXTRA_FIELD_ID);
+    put_u2le(q, ZIP64_LOCAL_EXTRA_FIELD_SIZE - 4);
+    zip64_sizes_ptr_ = q;
+    put_u8le(q, 0);  // uncompressed_size = placeholder
+    put_u8le(q, 0);  // compressed_size = placeholder
+  }
   put_n(q, entry->extra_field, entry->extra_field_length);
   entries_.push_back(entry);
 
   return header_ptr;
 }
 
-size_t OutputZipFile::WriteFileSizeInLocalFileHeader(u1 *header_ptr,
-                                                     size_t out_length,
-                                                     bool compress,
-                                                     const u4 crc) {
-  size_t compressed_size = out_length;
-  if (compress) {
-    compressed_size = TryDeflate(q, out_length);
+void OutputZipFile::WriteFileSizeInLocalFileHeader(u1 *header_ptr,
+                                                   size_t compressed_size,
+                                                   size_t out_length,
+                                                   const u4 crc) {
+  if (zip64_sizes_ptr_ != NULL && compressed_size < U4_MAX &&
+      out_length < U4_MAX) {
+    // The header was written for a file which may have been 4GB or larger,
+    // but the sizes fit in it after all. The zip64 extra field becomes
+    // padding, so that the header matches the central directory one.
+    u1 *version_ptr = header_ptr - 4;
+    put_u2le(version_ptr, ZIP_VERSION_TO_EXTRACT);
+    u1 *extra_field_ptr = zip64_sizes_ptr_ - 4;
+    put_u2le(extra_field_ptr, PADDING_EXTRA_FIELD_ID);
+    memset(zip64_sizes_ptr_, 0, ZIP64_LOCAL_EXTRA_FIELD_SIZE - 4);
+    zip64_sizes_ptr_ = NULL;
+    entries_.back()->zip64_sizes = false;
   }
   // compression method
   if (compressed_size < out_length) {
@@ -1025,9 +1213,16 @@ size_t OutputZipFile::WriteFileSizeInLocalFileHeader(u1 *header_ptr,
   }
   header_ptr += 4;
   put_u4le(header_ptr, crc);              // crc32
-  put_u4le(header_ptr, compressed_size);  // compressed_size
-  put_u4le(header_ptr, out_length);       // uncompressed_size
-  return compressed_size;
+  if (zip64_sizes_ptr_ != NULL) {
+    // The sizes are in the zip64 extra field.
+    put_u4le(header_ptr, U4_MAX);  // compressed_size
+    put_u4le(header_ptr, U4_MAX);  // uncompressed_size
+    put_u8le(zip64_sizes_ptr_, out_length);       // uncompressed_size
+    put_u8le(zip64_sizes_ptr_, compressed_size);  // compressed_size
+  } else {
+    put_u4le(header_ptr, compressed_size);  // compressed_size
+    put_u4le(header_ptr, out_length);       // uncompressed_size
+  }
 }
 
 int OutputZipFile::Finish() {
@@ -1036,7 +1231,9 @@ int OutputZipFile::Finish() {
   }
 
   finished_ = true;
-  WriteCentralDirectory();
+  if (WriteCentralDirectory() < 0) {
+    return -1;
+  }
   if (output_file_->Close(GetSize()) < 0) {
     return error("%s", output_file_->Error());
   }
@@ -1045,13 +1242,62 @@ int OutputZipFile::Finish() {
   return 0;
 }
 
+bool OutputZipFile::EnsureRoom(u8 length) {
+  u8 size = Offset(q) + length;
+  if (size <= estimated_size_) {
+    return true;
+  }
+  size = std::max(size, 2 * estimated_size_);
+  size_t offset = Offset(q);
+  if (output_file_->Resize(size) < 0) {
+    error("cannot grow %s to %llu bytes: %s", filename_, size,
+          output_file_->Error());
+    return false;
+  }
+  estimated_size_ = size;
+  zipdata_out_ = output_file_->Buffer();
+  q = zipdata_out_ + offset;
+  return true;
+}
+
 u1* OutputZipFile::NewFile(const char* filename, const u4 attr) {
+  // Only the header is known to fit, the file data must have been counted
+  // in the estimated size.
+  if (!EnsureRoom(LOCAL_FILE_HEADER_FIXED_SIZE + strlen(filename))) {
+    return NULL;
+  }
   header_ptr = WriteLocalFileHeader(filename, attr);
   return q;
 }
 
+u1* OutputZipFile::ReserveFile(const char* filename, const u4 attr,
+                               size_t max_length) {
+  // The data goes after the local file header, written by CommitFile().
+  reserved_zip64_ = max_length >= U4_MAX;
+  size_t header_length = LOCAL_FILE_HEADER_FIXED_SIZE + strlen(filename) +
+                         (reserved_zip64_ ? ZIP64_LOCAL_EXTRA_FIELD_SIZE : 0);
+  if (!EnsureRoom(header_length + max_length)) {
+    return NULL;
+  }
+  reserved_filename_ = filename;
+  reserved_attr_ = attr;
+  return q + header_length;
+}
+
+int OutputZipFile::CommitFile(size_t filelength, bool compress,
+                              bool compute_crc) {
+  header_ptr = WriteLocalFileHeader(reserved_filename_.c_str(),
+                                    reserved_attr_, reserved_zip64_);
+  return FinishFile(filelength, compress, compute_crc);
+}
+
 int OutputZipFile::FinishFile(size_t filelength, bool compress,
                               bool compute_crc) {
+  if (filelength >= U4_MAX && zip64_sizes_ptr_ == NULL) {
+    return error("%.*s is 4GB or larger, it must be added with ReserveFile()",
+                 entries_.back()->file_name_length,
+                 entries_.back()->file_name);
+  }
   u4 crc = 0;
   if (compute_crc) {
     crc = ComputeCrcChecksum(q, filelength);
@@ -1061,14 +1307,37 @@ int OutputZipFile::FinishFile(size_t filelength, bool compress,
       return -1;
     }
   }
-  size_t compressed_size =
-      WriteFileSizeInLocalFileHeader(header_ptr, filelength, compress, crc);
+  size_t compressed_size = filelength;
+  if (compress) {
+    compressed_size = TryDeflate(q, filelength);
+  }
 
   if (compressed_size == 0 && filelength > 0) {
     fprintf(stderr, "Error compressing files.\n");
     return -1;
   }
+  FinishEntry(compressed_size, filelength, crc);
+  return 0;
+}
+
+int OutputZipFile::WriteCompressedFile(const char* filename, const u4 attr,
+                                       const u1* data, size_t compressed_size,
+                                       size_t filelength, u4 crc) {
+  bool zip64 = filelength >= U4_MAX;
+  size_t header_length = LOCAL_FILE_HEADER_FIXED_SIZE + strlen(filename) +
+                         (zip64 ? ZIP64_LOCAL_EXTRA_FIELD_SIZE : 0);
+  if (!EnsureRoom(header_length + compressed_size)) {
+    return -1;
+  }
+  header_ptr = WriteLocalFileHeader(filename, attr, zip64);
+  memcpy(q, data, compressed_size);
+  FinishEntry(compressed_size, filelength, crc);
+  return 0;
+}
 
+void OutputZipFile::FinishEntry(size_t compressed_size, size_t filelength,
+                                u4 crc) {
+  WriteFileSizeInLocalFileHeader(header_ptr, compressed_size, filelength, crc);
   entries_.back()->crc32 = crc;
   entries_.back()->compressed_length = compressed_size;
   entries_.back()->uncompressed_length = filelength;
@@ -1078,19 +1347,9 @@ int OutputZipFile::FinishFile(size_t filelength, bool compress,
     entries_.back()->compression_method = COMPRESSION_METHOD_STORED;
   }
   q += compressed_size;
-  return 0;
 }
 
 bool OutputZipFile::Open() {
-  if (estimated_size_ > kMaximumOutputSize) {
-    fprintf(stderr,
-            "Uncompressed input jar has size %llu, "
-            "which exceeds the maximum supported output size %llu.\n"
-            "Assuming that ijar will be smaller and hoping for the best.\n",
-            estimated_size_, kMaximumOutputSize);
-    estimated_size_ = kMaximumOutputSize;
-  }
-
   MappedOutputFile* output_file = new MappedOutputFile(
       filename_, estimated_size_);
   if (!output_file->Opened()) {
@@ -1116,30 +1375,78 @@ ZipBuilder* ZipBuilder::Create(const char* zip_file, u8 estimated_size) {
   return result;
 }
 
-u8 ZipBuilder::EstimateSize(char const* const* files,
-                            char const* const* zip_paths,
-                            int nb_entries) {
+// Adds the estimated sizes of the files [begin, end) in the ZIP to "*size".
+// Returns the index of the first file that cannot be stat'ed, or -1.
+static int EstimateFileSizes(char const* const* files,
+                             char const* const* zip_paths, int begin, int end,
+                             u8* size) {
   Stat file_stat;
-  // Digital signature field size = 6, End of central directory = 22, Total = 28
-  u8 size = 28;
   // Count the size of all the files in the input to estimate the size of the
   // output.
-  for (int i = 0; i < nb_entries; i++) {
+  for (int i = begin; i < end; i++) {
     file_stat.total_size = 0;
     if (files[i] != NULL && !stat_file(files[i], &file_stat)) {
-      fprintf(stderr, "File %s does not seem to exist.", files[i]);
-      return 0;
+      return i;
     }
-    size += file_stat.total_size;
+    *size += file_stat.total_size;
     // Add sizes of Zip meta data
     // local file header = 30 bytes
     // data descriptor = 12 bytes
     // central directory descriptor = 46 bytes
     //    Total: 88bytes
-    size += 88;
+    *size += 88;
+    if (file_stat.total_size >= U4_MAX) {
+      // zip64 extra fields: local file header = 20 bytes, central directory
+      // descriptor = 20 bytes (28 with the offset, counted below).
+      *size += 40;
+    }
     // The filename is stored twice (once in the central directory
     // and once in the local file header).
-    size += strlen((zip_paths[i] != NULL) ? zip_paths[i] : files[i]) * 2;
+    *size += strlen((zip_paths[i] != NULL) ? zip_paths[i] : files[i]) * 2;
+  }
+  return -1;
+}
+
+u8 ZipBuilder::EstimateSize(char const* const* files,
+                            char const* const* zip_paths,
+                            int nb_entries, int threads) {
+  // Each thread stats a contiguous range of the files, the last one is done
+  // by this thread.
+  threads = std::max(1, std::min(threads, nb_entries / kMinFilesPerThread));
+  std::vector<u8> sizes(threads, 0);
+  std::vector<int> failed(threads, -1);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    int begin = static_cast<u8>(nb_entries) * t / threads;
+    int end = static_cast<u8>(nb_entries) * (t + 1) / threads;
+    if (t == threads - 1) {
+      failed[t] = EstimateFileSizes(files, zip_paths, begin, end, &sizes[t]);
+    } else {
+      workers.emplace_back([=, &sizes, &failed] {
+        failed[t] =
+            EstimateFileSizes(files, zip_paths, begin, end, &sizes[t]);
+      });
+    }
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  // Digital signature field size = 6, End of central directory = 22, Total = 28
+  // zip64 end of central directory = 56, and its locator = 20, Total = 76
+  u8 size = 28 + 76;
+  for (int t = 0; t < threads; t++) {
+    // Report the first missing file only, as when the files are stat'ed in
+    // order by a single thread.
+    if (failed[t] >= 0) {
+      fprintf(stderr, "File %s does not seem to exist.", files[failed[t]]);
+      return 0;
+    }
+    size += sizes[t];
+  }
+  if (size >= U4_MAX) {
+    // zip64 extra field for the local header offsets = 8 bytes per file
+    size += 8 * nb_entries;
   }
   return size;
 }
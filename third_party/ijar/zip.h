@@ -51,7 +51,9 @@ class ZipBuilder {
   // to a memory buffer to write the data of the file into. This buffer
   // is owned by ZipBuilder and should not be free'd by the caller. The
   // file length is then specified when the files is finished written
-  // using the FinishFile(size_t) function.
+  // using the FinishFile(size_t) function. The file must be smaller than 4GB
+  // and fit in the estimated size given to Create(); see ReserveFile() for
+  // the files of unknown size.
   // On failure, returns NULL and GetError() will return an non-empty message.
   virtual u1* NewFile(const char* filename, const u4 attr) = 0;
 
@@ -65,6 +67,34 @@ class ZipBuilder {
                          bool compress = false,
                          bool compute_crc = false) = 0;
 
+  // Reserve room for the data of a new file, of at most "max_length" bytes,
+  // and return a pointer to write the data into, like NewFile(). Nothing is
+  // added to the ZIP until CommitFile() is called with the actual length,
+  // so the data can be produced in place even before it is known whether
+  // the file is kept; a reservation that is not committed is reused by the
+  // next file. The output grows if the estimated size is exceeded, and files
+  // of 4GB or more get zip64 extra fields.
+  // On failure (e.g. the output cannot grow), returns NULL and
+  // GetError() will return an non-empty message.
+  virtual u1* ReserveFile(const char* filename, const u4 attr,
+                          size_t max_length) = 0;
+
+  // Add the file reserved by the last call to ReserveFile() to the ZIP, with
+  // the first "filelength" bytes written to the reservation as its data.
+  // See FinishFile() for `compress` and `compute_crc`.
+  // On failure, returns -1 and GetError() will return an non-empty message.
+  virtual int CommitFile(size_t filelength, bool compress = false,
+                         bool compute_crc = false) = 0;
+
+  // Add a file of "filelength" bytes with given CRC32, whose data has been
+  // compressed already, e.g. on another thread: the "compressed_size" bytes
+  // at "data" are deflated data if compressed_size < filelength, or the file
+  // itself otherwise (see TryDeflate()). The data is copied.
+  // On failure, returns -1 and GetError() will return an non-empty message.
+  virtual int WriteCompressedFile(const char* filename, const u4 attr,
+                                  const u1* data, size_t compressed_size,
+                                  size_t filelength, u4 crc) = 0;
+
   // Write an empty file, it is equivalent to:
   //   NewFile(filename, 0);
   //   FinishFile(0);
@@ -89,17 +119,19 @@ class ZipBuilder {
   virtual int GetNumberFiles() = 0;
 
   // Create a new ZipBuilder writing the file zip_file and the size of the
-  // output will be at most estimated_size. Use ZipBuilder::EstimateSize() or
+  // output will be at most estimated_size, unless the files are added with
+  // ReserveFile(), which grows the output. Use ZipBuilder::EstimateSize() or
   // ZipExtractor::CalculateOuputLength() to have an estimated_size depending on
-  // a list of file to store.
+  // a list of file to store. The ZIP gets zip64 records when it has 65535 or
+  // more entries or is 4GB or larger.
   // On failure, returns NULL. Refer to errno for error code.
   static ZipBuilder* Create(const char* zip_file, u8 estimated_size);
 
   // Estimate the maximum size of the ZIP files containing files in the "files"
-  // null-terminated array.
+  // null-terminated array. The files are stat'ed by "threads" threads.
   // Returns 0 on error.
   static u8 EstimateSize(char const* const* files, char const* const* zip_paths,
-                         int nb_entries);
+                         int nb_entries, int threads = 1);
 };
 
 //
@@ -121,6 +153,43 @@ class ZipExtractorProcessor {
   // in the buffer pointed by "data".
   virtual void Process(const char* filename, const u4 attr,
                        const u1* data, const size_t size) = 0;
+
+  // Process a file accepted by Accept without having it uncompressed first.
+  // "data" points to the "compressed_size" bytes of the file as stored in
+  // the ZIP, deflated if "compressed" is true, and "size" is the length of
+  // the file. Unlike the buffer passed to Process(), they stay valid as long
+  // as the ZipExtractor. "crc32" is the CRC-32 of the file recorded in the
+  // central directory. This method returns false if the file should be
+  // uncompressed and passed to Process() instead, which is the default.
+  virtual bool ProcessRaw(const char* filename, const u4 attr,
+                          const u1* data, const size_t compressed_size,
+                          const size_t size, const bool compressed,
+                          const u4 crc32) {
+    return false;
+  }
+
+  // The largest chunk of a file passed to ProcessChunk().
+  static const size_t STREAM_CHUNK_SIZE = 1024 * 1024;  // 1MB
+
+  // Tells whether to process the file "filename" accepted by Accept, of
+  // length "size", in chunks instead of in a single buffer, so that large
+  // files are processed with bounded memory. If this method returns true,
+  // ProcessChunk() is called with each consecutive chunk of the file, of at
+  // most STREAM_CHUNK_SIZE bytes, and then FinishStream() is called, unless
+  // the file turns out to be corrupt. The buffer passed to ProcessChunk() is
+  // only valid until it returns. This method is called if ProcessRaw()
+  // returned false, and returns false if the file should be passed to
+  // Process() instead, which is the default.
+  virtual bool StartStream(const char* filename, const u4 attr,
+                           const size_t size) {
+    return false;
+  }
+
+  // Process the next chunk of the file started by StartStream().
+  virtual void ProcessChunk(const u1* data, const size_t size) {}
+
+  // Finish processing the file started by StartStream().
+  virtual void FinishStream() {}
 };
 
 //
@@ -27,12 +27,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "third_party/ijar/platform_utils.h"
 #include "third_party/ijar/zip.h"
+#include "third_party/ijar/zlib_client.h"
 
 namespace devtools_ijar {
 
@@ -59,6 +65,10 @@ class UnzipProcessor : public ZipExtractorProcessor {
 
   virtual void Process(const char* filename, const u4 attr,
                        const u1* data, const size_t size);
+  virtual bool StartStream(const char* filename, const u4 attr,
+                           const size_t size);
+  virtual void ProcessChunk(const u1* data, const size_t size);
+  virtual void FinishStream();
   virtual bool Accept(const char* filename, const u4 attr) {
     // All entry files are accepted by default.
     if (file_names.empty()) {
@@ -74,6 +84,13 @@ class UnzipProcessor : public ZipExtractorProcessor {
   const bool verbose_;
   const bool extract_;
   std::set<std::string> file_names;
+  // The file being extracted chunk by chunk.
+  OutputFile stream_output_;
+
+  // Get the permissions of the file "filename" from its external attributes
+  // "attr", and whether it is a directory.
+  static void GetMode(const char* filename, const u4 attr, mode_t* perm,
+                      bool* isdir);
 };
 
 // Concatene 2 path, path1 and path2, using / as a directory separator and
@@ -94,15 +111,22 @@ void concat_path(char* out, const size_t size,
   }
 }
 
-void UnzipProcessor::Process(const char* filename, const u4 attr,
-                             const u1* data, const size_t size) {
-  mode_t perm = zipattr_to_perm(attr);
-  bool isdir = zipattr_is_dir(attr);
+void UnzipProcessor::GetMode(const char* filename, const u4 attr,
+                             mode_t* perm, bool* isdir) {
+  *perm = zipattr_to_perm(attr);
+  *isdir = zipattr_is_dir(attr);
   if (attr == 0) {
     // Fallback when the external attribute is not set.
-    isdir = filename[strlen(filename)-1] == '/';
-    perm = 0777;
+    *isdir = filename[strlen(filename)-1] == '/';
+    *perm = 0777;
   }
+}
+
+void UnzipProcessor::Process(const char* filename, const u4 attr,
+                             const u1* data, const size_t size) {
+  mode_t perm;
+  bool isdir;
+  GetMode(filename, attr, &perm, &isdir);
   if (verbose_) {
     printf("%c %o %s\n", isdir ? 'd' : 'f', perm, filename);
   }
@@ -116,6 +140,41 @@ void UnzipProcessor::Process(const char* filename, const u4 attr,
   }
 }
 
+bool UnzipProcessor::StartStream(const char* filename, const u4 attr,
+                                 const size_t size) {
+  // Only the files that do not fit in one chunk are worth a stream.
+  if (!extract_ || size <= STREAM_CHUNK_SIZE) {
+    return false;
+  }
+  mode_t perm;
+  bool isdir;
+  GetMode(filename, attr, &perm, &isdir);
+  if (isdir) {
+    return false;
+  }
+  if (verbose_) {
+    printf("f %o %s\n", perm, filename);
+  }
+  char path[PATH_MAX];
+  concat_path(path, PATH_MAX, output_root_, filename);
+  if (!make_dirs(path, perm) || !stream_output_.Open(path, perm)) {
+    abort();
+  }
+  return true;
+}
+
+void UnzipProcessor::ProcessChunk(const u1* data, const size_t size) {
+  if (!stream_output_.Write(data, size)) {
+    abort();
+  }
+}
+
+void UnzipProcessor::FinishStream() {
+  if (!stream_output_.Close()) {
+    abort();
+  }
+}
+
 // Get the basename of path and store it in output. output_size
 // is the size of the output buffer.
 void basename(const char *path, char *output, size_t output_size) {
@@ -160,16 +219,24 @@ int extract(char *zipfile, char* exdir, char **files, bool verbose,
   return 0;
 }
 
-// add a file to the zip
-int add_file(std::unique_ptr<ZipBuilder> const &builder, char *file,
-             char *zip_path, bool flatten, bool verbose, bool compress) {
-  Stat file_stat = {0, 0666, false};
-  if (file != NULL) {
-    if (!stat_file(file, &file_stat)) {
-      fprintf(stderr, "Cannot stat file %s: %s\n", file, strerror(errno));
-      return -1;
-    }
-  }
+// A file read and compressed ahead by a worker thread of ParallelCreator.
+struct StagedFile {
+  bool done;
+  int stat_errno;  // Set if the file could not be stat'ed.
+  bool failed;     // Set if the file could not be read or compressed.
+  Stat file_stat;
+  // The data of the file as given to ZipBuilder::WriteCompressedFile(),
+  // malloc()ed, or NULL if the file is read when it is added.
+  u1 *data;
+  size_t compressed_size;
+  u4 crc;
+};
+
+// add a file with the given stat data to the zip, the data is taken from
+// "staged" unless it is NULL
+int add_stat_file(std::unique_ptr<ZipBuilder> const &builder, char *file,
+                  char *zip_path, const Stat &file_stat, bool flatten,
+                  bool verbose, bool compress, const StagedFile *staged) {
   char *final_path = zip_path != NULL ? zip_path : file;
 
   bool isdir = file_stat.is_directory;
@@ -202,18 +269,206 @@ int add_file(std::unique_ptr<ZipBuilder> const &builder, char *file,
     printf("%c %o %s\n", isdir ? 'd' : 'f', perm, path);
   }
 
-  u1 *buffer = builder->NewFile(path, stat_to_zipattr(file_stat));
-  if (isdir || file_stat.total_size == 0) {
-    builder->FinishFile(0);
+  size_t size = isdir ? 0 : file_stat.total_size;
+  if (staged != NULL && staged->data != NULL) {
+    if (builder->WriteCompressedFile(path, stat_to_zipattr(file_stat),
+                                     staged->data, staged->compressed_size,
+                                     size, staged->crc) < 0) {
+      fprintf(stderr, "%s\n", builder->GetError());
+      return -1;
+    }
+    return 0;
+  }
+  u1 *buffer = builder->ReserveFile(path, stat_to_zipattr(file_stat), size);
+  if (buffer == NULL) {
+    fprintf(stderr, "%s\n", builder->GetError());
+    return -1;
+  }
+  if (size == 0) {
+    builder->CommitFile(0);
   } else {
-    if (!read_file(file, buffer, file_stat.total_size)) {
+    if (!read_file(file, buffer, size)) {
+      return -1;
+    }
+    if (builder->CommitFile(size, compress, true) < 0) {
+      fprintf(stderr, "%s\n", builder->GetError());
       return -1;
     }
-    builder->FinishFile(file_stat.total_size, compress, true);
   }
   return 0;
 }
 
+// add a file to the zip
+int add_file(std::unique_ptr<ZipBuilder> const &builder, char *file,
+             char *zip_path, bool flatten, bool verbose, bool compress) {
+  Stat file_stat = {0, 0666, false};
+  if (file != NULL) {
+    if (!stat_file(file, &file_stat)) {
+      fprintf(stderr, "Cannot stat file %s: %s\n", file, strerror(errno));
+      return -1;
+    }
+  }
+  return add_stat_file(builder, file, zip_path, file_stat, flatten, verbose,
+                       compress, NULL);
+}
+
+//
+// Adds files to a zip like add_file(), but the files are stat'ed, read and
+// compressed by worker threads, ahead of the main thread adding them to the
+// zip in order. The zip is the same as with add_file().
+//
+class ParallelCreator {
+ public:
+  ParallelCreator(char **files, char **zip_paths, int nb_entries,
+                  bool flatten, bool verbose, bool compress, int threads)
+      : files_(files), zip_paths_(zip_paths), nb_entries_(nb_entries),
+        flatten_(flatten), verbose_(verbose), compress_(compress),
+        threads_(threads), next_(0), written_(0), staged_bytes_(0),
+        stopping_(false), staged_files_(nb_entries) {}
+
+  // Add all the files to the zip. Returns -1 on error.
+  int Run(std::unique_ptr<ZipBuilder> const &builder);
+
+ private:
+  // Stages the files until all are taken or Run() is done.
+  void WorkerLoop();
+  // Stats the i-th file, and reads and compresses it unless it is large.
+  void Stage(int i);
+
+  // The files larger than this are read by the main thread, right into the
+  // output, so that the staged data stays small.
+  static const u8 kMaxStagedFileSize = 32 << 20;
+  // The staged data not written yet is limited to this...
+  static const u8 kMaxStagedBytes = 256 << 20;
+  // ... and to these many files per thread.
+  static const int kFilesPerThread = 32;
+
+  char **files_;
+  char **zip_paths_;
+  const int nb_entries_;
+  const bool flatten_;
+  const bool verbose_;
+  const bool compress_;
+  const int threads_;
+
+  std::mutex mutex_;
+  std::condition_variable staged_;   // A file is staged.
+  std::condition_variable written_cv_;  // A file is written.
+  int next_;  // The next file to stage.
+  int written_;  // The number of files written.
+  u8 staged_bytes_;
+  bool stopping_;
+  std::vector<StagedFile> staged_files_;
+};
+
+int ParallelCreator::Run(std::unique_ptr<ZipBuilder> const &builder) {
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads_; i++) {
+    workers.emplace_back(&ParallelCreator::WorkerLoop, this);
+  }
+  int result = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (int i = 0; i < nb_entries_ && result == 0; i++) {
+    StagedFile &staged = staged_files_[i];
+    staged_.wait(lock, [&staged] { return staged.done; });
+    lock.unlock();
+    // Report the errors of the file in order, as add_file() does.
+    if (staged.stat_errno != 0) {
+      fprintf(stderr, "Cannot stat file %s: %s\n", files_[i],
+              strerror(staged.stat_errno));
+      result = -1;
+    } else if (staged.failed ||
+               add_stat_file(builder, files_[i], zip_paths_[i],
+                             staged.file_stat, flatten_, verbose_, compress_,
+                             &staged) < 0) {
+      result = -1;
+    }
+    lock.lock();
+    if (staged.data != NULL) {
+      free(staged.data);
+      staged.data = NULL;
+      staged_bytes_ -= staged.file_stat.total_size;
+    }
+    written_ = i + 1;
+    written_cv_.notify_all();
+  }
+  stopping_ = true;
+  written_cv_.notify_all();
+  lock.unlock();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto &staged : staged_files_) {
+    free(staged.data);
+  }
+  return result;
+}
+
+void ParallelCreator::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    written_cv_.wait(lock, [this] {
+      return stopping_ || next_ >= nb_entries_ ||
+             next_ < written_ + kFilesPerThread * threads_;
+    });
+    if (stopping_ || next_ >= nb_entries_) {
+      return;
+    }
+    int i = next_++;
+    lock.unlock();
+    Stage(i);
+    lock.lock();
+    staged_files_[i].done = true;
+    staged_.notify_all();
+  }
+}
+
+void ParallelCreator::Stage(int i) {
+  StagedFile &staged = staged_files_[i];
+  staged.stat_errno = 0;
+  staged.failed = false;
+  staged.file_stat = {0, 0666, false};
+  staged.data = NULL;
+  if (files_[i] == NULL) {
+    return;
+  }
+  if (!stat_file(files_[i], &staged.file_stat)) {
+    staged.stat_errno = errno;
+    return;
+  }
+  u8 size = staged.file_stat.total_size;
+  if (staged.file_stat.is_directory || size == 0 ||
+      size > kMaxStagedFileSize) {
+    return;
+  }
+
+  {
+    // The next file to write is always staged, so the main thread does not
+    // wait for memory held by later files.
+    std::unique_lock<std::mutex> lock(mutex_);
+    written_cv_.wait(lock, [this, i, size] {
+      return stopping_ || i == written_ ||
+             staged_bytes_ + size <= kMaxStagedBytes;
+    });
+    if (stopping_) {
+      return;
+    }
+    staged_bytes_ += size;
+  }
+  // Counted in staged_bytes_ from now on, even if reading fails.
+  staged.data = reinterpret_cast<u1 *>(malloc(size));
+  if (!read_file(files_[i], staged.data, size)) {
+    staged.failed = true;
+    return;
+  }
+  staged.crc = ComputeCrcChecksum(staged.data, size);
+  staged.compressed_size = compress_ ? TryDeflate(staged.data, size) : size;
+  if (staged.compressed_size == 0) {
+    fprintf(stderr, "Error compressing files.\n");
+    staged.failed = true;
+  }
+}
+
 // Read a list of files separated by newlines. The resulting array can be
 // freed using the free method.
 char **read_filelist(char *filename) {
@@ -229,7 +484,7 @@ char **read_filelist(char *filename) {
   }
 
   int nb_entries = 1;
-  for (int i = 0; i < file_stat.total_size; i++) {
+  for (u8 i = 0; i < file_stat.total_size; i++) {
     if (data[i] == '\n') {
       nb_entries++;
     }
@@ -245,7 +500,7 @@ char **read_filelist(char *filename) {
   // Create the corresponding array
   int j = 1;
   filelist[0] = content;
-  for (int i = 0; i < file_stat.total_size; i++) {
+  for (u8 i = 0; i < file_stat.total_size; i++) {
     if (content[i] == '\n') {
       content[i] = 0;
       if (i + 1 < file_stat.total_size) {
@@ -293,9 +548,10 @@ char **parse_filelist(char *zipfile, char **file_entries, int nb_entries,
   return files;
 }
 
-// Execute the create operation
+// Execute the create operation. With worker threads, the files are read and
+// compressed in parallel.
 int create(char *zipfile, char **file_entries, bool flatten, bool verbose,
-           bool compress) {
+           bool compress, int threads) {
   int nb_entries = 0;
   while (file_entries[nb_entries] != NULL) {
     nb_entries++;
@@ -306,7 +562,8 @@ int create(char *zipfile, char **file_entries, bool flatten, bool verbose,
     return -1;
   }
 
-  u8 size = ZipBuilder::EstimateSize(files, zip_paths, nb_entries);
+  u8 size = ZipBuilder::EstimateSize(files, zip_paths, nb_entries,
+                                     std::max(threads, 1));
   if (size == 0) {
     return -1;
   }
@@ -317,11 +574,19 @@ int create(char *zipfile, char **file_entries, bool flatten, bool verbose,
     return -1;
   }
 
-  for (int i = 0; i < nb_entries; i++) {
-    if (add_file(builder, files[i], zip_paths[i], flatten, verbose, compress) <
-        0) {
+  if (threads > 0) {
+    ParallelCreator creator(files, zip_paths, nb_entries, flatten, verbose,
+                            compress, threads);
+    if (creator.Run(builder) < 0) {
       return -1;
     }
+  } else {
+    for (int i = 0; i < nb_entries; i++) {
+      if (add_file(builder, files[i], zip_paths[i], flatten, verbose,
+                   compress) < 0) {
+        return -1;
+      }
+    }
   }
   if (builder->Finish() < 0) {
     fprintf(stderr, "%s\n", builder->GetError());
@@ -337,7 +602,7 @@ int create(char *zipfile, char **file_entries, bool flatten, bool verbose,
 //
 static void usage(char *progname) {
   fprintf(stderr,
-          "Usage: %s [vxc[fC]] x.zip [-d exdir] [[zip_path1=]file1 ... "
+          "Usage: %s [vxc[fCj]] x.zip [-d exdir] [[zip_path1=]file1 ... "
           "[zip_pathn=]filen]\n",
           progname);
   fprintf(stderr, "  v verbose - list all file in x.zip\n");
@@ -349,6 +614,9 @@ static void usage(char *progname) {
   fprintf(stderr, "  f flatten - flatten files to use with create operation\n");
   fprintf(stderr,
           "  C compress - compress files when using the create operation\n");
+  fprintf(stderr,
+          "  j jobs - read and compress files on all the processors when "
+          "using the create operation\n");
   fprintf(stderr, "x and c cannot be used in the same command-line.\n");
   fprintf(stderr,
           "\nFor every file, a path in the zip can be specified. Examples:\n");
@@ -370,6 +638,7 @@ int main(int argc, char **argv) {
   bool create = false;
   bool compress = false;
   bool flatten = false;
+  int threads = 0;  // worker threads
 
   if (argc < 3) {
     usage(argv[0]);
@@ -392,6 +661,9 @@ int main(int argc, char **argv) {
     case 'C':
       compress = true;
       break;
+    case 'j':
+      threads = std::max(1u, std::thread::hardware_concurrency());
+      break;
     default:
       usage(argv[0]);
     }
@@ -436,7 +708,8 @@ int main(int argc, char **argv) {
 
   if (create) {
     // Create a zip
-    return devtools_ijar::create(argv[2], filelist, flatten, verbose, compress);
+    return devtools_ijar::create(argv[2], filelist, flatten, verbose, compress,
+                                 threads);
   } else {
     if (flatten) {
       usage(argv[0]);
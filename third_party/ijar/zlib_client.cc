@@ -22,8 +22,21 @@
 
 namespace devtools_ijar {
 
+// zlib takes the lengths as uInt, so larger buffers are passed in chunks.
+static const size_t kMaxZlibChunk = 1 << 30;
+
 u4 ComputeCrcChecksum(u1 *buf, size_t length) {
-  return crc32(0, buf, length);
+  return UpdateCrcChecksum(crc32(0, Z_NULL, 0), buf, length);
+}
+
+u4 UpdateCrcChecksum(u4 crc, const u1 *buf, size_t length) {
+  do {
+    size_t chunk = std::min(length, kMaxZlibChunk);
+    crc = crc32(crc, buf, chunk);
+    buf += chunk;
+    length -= chunk;
+  } while (length > 0);
+  return crc;
 }
 
 size_t TryDeflate(u1 *buf, size_t length) {
@@ -34,10 +47,8 @@ size_t TryDeflate(u1 *buf, size_t length) {
   stream.zalloc = Z_NULL;
   stream.zfree = Z_NULL;
   stream.opaque = Z_NULL;
-  stream.total_in = length;
-  stream.avail_in = length;
-  stream.total_out = length;
-  stream.avail_out = length;
+  stream.avail_in = 0;
+  stream.avail_out = 0;
   stream.next_in = buf;
   stream.next_out = outbuf;
 
@@ -49,9 +60,22 @@ size_t TryDeflate(u1 *buf, size_t length) {
     return length;
   }
 
-  if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+  size_t in_left = length;
+  size_t out_left = length;
+  int status;
+  do {
+    size_t in_chunk = std::min(in_left, kMaxZlibChunk - stream.avail_in);
+    stream.avail_in += in_chunk;
+    in_left -= in_chunk;
+    size_t out_chunk = std::min(out_left, kMaxZlibChunk - stream.avail_out);
+    stream.avail_out += out_chunk;
+    out_left -= out_chunk;
+    status = deflate(&stream, in_left == 0 ? Z_FINISH : Z_NO_FLUSH);
+  } while (status == Z_OK && (stream.avail_out > 0 || out_left > 0));
+
+  if (status == Z_STREAM_END) {
     // Compression successful and fits in outbuf, let's copy the result in buf.
-    length = stream.total_out;
+    length = stream.next_out - outbuf;
     memcpy(buf, outbuf, length);
   }
 
@@ -62,13 +86,21 @@ size_t TryDeflate(u1 *buf, size_t length) {
   return length;
 }
 
-Decompressor::Decompressor() {
+Decompressor::Decompressor()
+    : stream_(NULL), stream_active_(false), stream_ended_(false) {
   uncompressed_data_allocated_ = INITIAL_BUFFER_SIZE;
   uncompressed_data_ =
       reinterpret_cast<u1 *>(malloc(uncompressed_data_allocated_));
+  errmsg[0] = 0;
 }
 
-Decompressor::~Decompressor() { free(uncompressed_data_); }
+Decompressor::~Decompressor() {
+  if (stream_active_) {
+    inflateEnd(stream_);
+  }
+  delete stream_;
+  free(uncompressed_data_);
+}
 
 DecompressedFile *Decompressor::UncompressFile(const u1 *buffer,
                                                size_t bytes_avail) {
@@ -145,6 +177,84 @@ DecompressedFile *Decompressor::UncompressFile(const u1 *buffer,
   }
 }
 
+bool Decompressor::StartStream(const u1 *buffer, size_t bytes_avail,
+                               size_t chunk_size) {
+  if (stream_ == NULL) {
+    stream_ = new z_stream;
+  } else if (stream_active_) {
+    inflateEnd(stream_);
+    stream_active_ = false;
+  }
+  stream_->zalloc = Z_NULL;
+  stream_->zfree = Z_NULL;
+  stream_->opaque = Z_NULL;
+  stream_->avail_in = 0;
+  stream_->next_in =
+      const_cast<Bytef *>(reinterpret_cast<const Bytef *>(buffer));
+
+  int ret = inflateInit2(stream_, -MAX_WBITS);
+  if (ret != Z_OK) {
+    error("inflateInit: %d\n", ret);
+    return false;
+  }
+  stream_active_ = true;
+  stream_ended_ = false;
+  stream_input_ = buffer;
+  stream_input_left_ = bytes_avail;
+  stream_chunk_size_ = std::min(chunk_size, kMaxZlibChunk);
+  if (uncompressed_data_allocated_ < stream_chunk_size_) {
+    uncompressed_data_allocated_ = stream_chunk_size_;
+    uncompressed_data_ = reinterpret_cast<u1 *>(
+        realloc(uncompressed_data_, uncompressed_data_allocated_));
+  }
+  return true;
+}
+
+int Decompressor::NextChunk(const u1 **data, size_t *size) {
+  if (stream_ended_) {
+    return 0;
+  }
+  if (!stream_active_) {
+    return error("no stream to inflate.\n");
+  }
+
+  stream_->next_out = uncompressed_data_;
+  stream_->avail_out = stream_chunk_size_;
+  int ret = Z_OK;
+  while (ret == Z_OK && stream_->avail_out > 0) {
+    if (stream_->avail_in == 0 && stream_input_left_ > 0) {
+      size_t in_chunk = std::min(stream_input_left_, kMaxZlibChunk);
+      stream_->avail_in = in_chunk;
+      stream_input_left_ -= in_chunk;
+    }
+    ret = inflate(stream_, Z_SYNC_FLUSH);
+  }
+
+  if (ret == Z_STREAM_END) {
+    // zlib said that there is no more data to decompress.
+    stream_ended_ = true;
+  } else if (ret != Z_OK) {
+    inflateEnd(stream_);
+    stream_active_ = false;
+    return error("zlib returned error code %d during inflate.\n", ret);
+  }
+
+  *data = uncompressed_data_;
+  *size = stream_chunk_size_ - stream_->avail_out;
+  if (stream_ended_) {
+    inflateEnd(stream_);
+    stream_active_ = false;
+  }
+  return *size > 0 ? 1 : 0;
+}
+
+size_t Decompressor::StreamCompressedSize() {
+  if (stream_ == NULL) {
+    return 0;
+  }
+  return reinterpret_cast<const u1 *>(stream_->next_in) - stream_input_;
+}
+
 char *Decompressor::GetError() {
   if (errmsg[0] == 0) {
     return NULL;
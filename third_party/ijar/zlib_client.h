@@ -16,9 +16,12 @@
 #define THIRD_PARTY_IJAR_ZLIB_CLIENT_H_
 
 #include <limits.h>
+#include <limits>
 
 #include "third_party/ijar/common.h"
 
+struct z_stream_s;
+
 namespace devtools_ijar {
 // Try to compress a file entry in memory using the deflate algorithm.
 // It will compress buf (of size length) unless the compressed size is bigger
@@ -28,6 +31,11 @@ size_t TryDeflate(u1* buf, size_t length);
 
 u4 ComputeCrcChecksum(u1* buf, size_t length);
 
+// Continues the CRC-32 `crc` of the preceding data with the next `length`
+// bytes at `buf`, for data that is only available in chunks. The CRC-32 of
+// no data is 0.
+u4 UpdateCrcChecksum(u4 crc, const u1* buf, size_t length);
+
 struct DecompressedFile {
   u1* uncompressed_data;
   u4 uncompressed_size;
@@ -39,6 +47,22 @@ class Decompressor {
   Decompressor();
   ~Decompressor();
   DecompressedFile* UncompressFile(const u1* buffer, size_t bytes_avail);
+
+  // Start inflating the deflated data at "buffer" chunk by chunk, instead of
+  // into a single buffer like UncompressFile(). Each chunk is at most
+  // "chunk_size" bytes long and is overwritten by the next one.
+  // Returns false on error.
+  bool StartStream(const u1* buffer, size_t bytes_avail, size_t chunk_size);
+
+  // Inflate the next chunk of the stream started by StartStream() and point
+  // "data" and "size" to it. Returns 1 if there is a chunk, 0 at the end of
+  // the stream and -1 on error.
+  int NextChunk(const u1** data, size_t* size);
+
+  // Returns the number of bytes of deflated data inflated so far by
+  // NextChunk(), which is the compressed size at the end of the stream.
+  size_t StreamCompressedSize();
+
   char* GetError();
 
  private:
@@ -48,6 +72,16 @@ class Decompressor {
   // can call realloc.
   u1* uncompressed_data_;
   size_t uncompressed_data_allocated_;
+
+  // State of the stream started by StartStream(). The deflated data is
+  // fed to zlib in pieces because its lengths are 32 bits.
+  z_stream_s* stream_;
+  const u1* stream_input_;
+  size_t stream_input_left_;
+  size_t stream_chunk_size_;
+  bool stream_active_;
+  bool stream_ended_;
+
   // last error
   char errmsg[4 * PATH_MAX];
 